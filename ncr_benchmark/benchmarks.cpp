@@ -0,0 +1,582 @@
+#include "../ncr_test/number_sets.h"
+#include "../ncr_test/approximate_number_sets.h"
+
+#include <benchmark/benchmark.h>
+
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+using namespace std;
+using namespace ncr_test;
+
+/*
+	Microbenchmarks for the parser, hashing, the table and the batch pipeline
+	* built on google benchmark (https://github.com/google/benchmark)
+	* results are written as json to ncr_benchmark.json, unless --benchmark_out is given
+	  compare two versions with tools/compare.py of google benchmark
+	* inputs are generated with a fixed seed, so that runs are comparable
+
+	Parameters, where they apply:
+	* numbers per line
+	* percentage of duplicate lines
+	* percentage of invalid lines
+	* producer thread count
+*/
+
+
+/*
+	input generation
+*/
+
+struct input_params
+{
+	int nums_per_line;
+	int duplicate_percent;
+	int invalid_percent;
+	int line_count;
+};
+
+// lines of comma separated numbers
+// duplicate lines repeat an earlier line, invalid lines contain a letter
+vector<string> generate_lines(const input_params& params)
+{
+	mt19937 gen(42);
+	uniform_int_distribution<int> number(-1'000'000, 1'000'000);
+	uniform_int_distribution<int> percent(0, 99);
+
+	vector<string> lines;
+	lines.reserve(params.line_count);
+
+	for (int line = 0; line < params.line_count; ++line)
+	{
+		if (!lines.empty() && percent(gen) < params.duplicate_percent)
+		{
+			lines.push_back(lines[uniform_int_distribution<size_t>(0, lines.size() - 1)(gen)]);
+			continue;
+		}
+
+		string s;
+		for (int i = 0; i < params.nums_per_line; ++i)
+		{
+			if (i != 0)
+				s += ", ";
+			s += to_string(number(gen));
+		}
+
+		if (percent(gen) < params.invalid_percent)
+			s += ", x";
+
+		lines.push_back(s);
+	}
+
+	return lines;
+}
+
+// the sorted number sets of the valid lines
+vector<vector<int>> generate_sets(const input_params& params)
+{
+	vector<vector<int>> sets;
+
+	for (const auto& line : generate_lines(params))
+	{
+		try
+		{
+			sets.push_back(produce_number_set<int, char>(line));
+		}
+		catch (runtime_error&)
+		{
+		}
+	}
+
+	return sets;
+}
+
+// input files are generated once per parameter set, and reused by every benchmark needing them
+const string& input_file(const input_params& params)
+{
+	static map<vector<int>, string> files;
+
+	vector<int> key = { params.nums_per_line, params.duplicate_percent, params.invalid_percent, params.line_count };
+	auto found = files.find(key);
+	if (found != files.end())
+		return found->second;
+
+	string filename = "ncr_benchmark_input_" + to_string(params.nums_per_line) + "_" + to_string(params.duplicate_percent) + "_" +
+		to_string(params.invalid_percent) + "_" + to_string(params.line_count) + ".txt";
+
+	ofstream ofile(filename, ios::binary);
+	for (const auto& line : generate_lines(params))
+		ofile << line << "\n";
+
+	return files[key] = filename;
+}
+
+size_t total_size(const vector<string>& lines)
+{
+	size_t size = 0;
+	for (const auto& line : lines)
+		size += line.size() + 1;
+	return size;
+}
+
+
+/*
+	parsing
+	arg 0: numbers per line
+*/
+
+template<typename Parse>
+void parse_lines(benchmark::State& state, Parse parse)
+{
+	vector<string> lines = generate_lines(input_params{ static_cast<int>(state.range(0)), 0, 0, 10'000 });
+
+	for (auto _ : state)
+	{
+		for (const auto& line : lines)
+			benchmark::DoNotOptimize(parse(line));
+	}
+
+	state.SetItemsProcessed(state.iterations() * lines.size());
+	state.SetBytesProcessed(state.iterations() * total_size(lines));
+}
+
+// integral types use the fast parser of parse_ints_fast.cpp
+template<typename T>
+void BM_parse_ints_fast(benchmark::State& state)
+{
+	parse_lines(state, [](const string& line) { return get_numbers<T, char>(line); });
+}
+BENCHMARK_TEMPLATE(BM_parse_ints_fast, int)->Arg(3)->Arg(10)->Arg(100);
+BENCHMARK_TEMPLATE(BM_parse_ints_fast, long long)->Arg(3)->Arg(10)->Arg(100);
+
+// the stringstream parsing, used for the other types
+void BM_get_numbers_stringstream(benchmark::State& state)
+{
+	parse_lines(state, [](const string& line) { return get_numbers_stringstream<long long, char>(line); });
+}
+BENCHMARK(BM_get_numbers_stringstream)->Arg(3)->Arg(10)->Arg(100);
+
+
+/*
+	sorting
+	arg 0: numbers per set
+*/
+
+template<typename Sort>
+void sort_sets(benchmark::State& state, Sort sort_set)
+{
+	vector<vector<int>> sets = generate_sets(input_params{ static_cast<int>(state.range(0)), 0, 0, 10'000 });
+	mt19937 gen(42);
+	for (auto& numbers : sets)
+		shuffle(numbers.begin(), numbers.end(), gen);
+
+	vector<int> numbers;
+
+	for (auto _ : state)
+	{
+		for (const auto& set : sets)
+		{
+			numbers.assign(set.begin(), set.end());
+			sort_set(numbers);
+			benchmark::DoNotOptimize(numbers.data());
+		}
+	}
+
+	state.SetItemsProcessed(state.iterations() * sets.size());
+}
+
+void BM_std_sort(benchmark::State& state)
+{
+	sort_sets(state, [](vector<int>& numbers) { sort(numbers.begin(), numbers.end()); });
+}
+BENCHMARK(BM_std_sort)->Arg(5)->Arg(16)->Arg(30)->Arg(100)->Arg(1000);
+
+// sorting networks, std::sort or radix sort depending on the size
+void BM_sort_numbers(benchmark::State& state)
+{
+	sort_sets(state, [](vector<int>& numbers) { sort_numbers(numbers); });
+}
+BENCHMARK(BM_sort_numbers)->Arg(5)->Arg(16)->Arg(30)->Arg(100)->Arg(1000);
+
+
+/*
+	hashing
+	arg 0: numbers per set
+*/
+
+void BM_hash_value(benchmark::State& state)
+{
+	vector<vector<int>> sets = generate_sets(input_params{ static_cast<int>(state.range(0)), 0, 0, 10'000 });
+
+	for (auto _ : state)
+	{
+		for (const auto& numbers : sets)
+			benchmark::DoNotOptimize(hash_value(numbers));
+	}
+
+	state.SetItemsProcessed(state.iterations() * sets.size());
+}
+BENCHMARK(BM_hash_value)->Arg(3)->Arg(10)->Arg(100);
+
+template<typename HashPolicy>
+void BM_hash_policy(benchmark::State& state)
+{
+	vector<vector<int>> sets = generate_sets(input_params{ static_cast<int>(state.range(0)), 0, 0, 10'000 });
+	hasher<int, HashPolicy> hash;
+
+	for (auto _ : state)
+	{
+		for (const auto& numbers : sets)
+			benchmark::DoNotOptimize(hash(numbers));
+	}
+
+	state.SetItemsProcessed(state.iterations() * sets.size());
+}
+BENCHMARK_TEMPLATE(BM_hash_policy, combine_hash_policy)->Arg(3)->Arg(10)->Arg(100);
+BENCHMARK_TEMPLATE(BM_hash_policy, stripe_hash_policy)->Arg(3)->Arg(10)->Arg(100);
+BENCHMARK_TEMPLATE(BM_hash_policy, commutative_hash_policy)->Arg(3)->Arg(10)->Arg(100);
+
+
+/*
+	table
+	arg 0: numbers per set, arg 1: percentage of duplicates
+	every iteration fills an empty table with all the sets
+*/
+
+void BM_consume_number_set(benchmark::State& state)
+{
+	vector<vector<int>> sets = generate_sets(input_params{ static_cast<int>(state.range(0)), static_cast<int>(state.range(1)), 0, 100'000 });
+
+	for (auto _ : state)
+	{
+		number_sets_data<int, char> data;
+
+		for (const auto& numbers : sets)
+			consume_number_set(numbers, data);
+
+		benchmark::DoNotOptimize(data.duplicate_count);
+	}
+
+	state.SetItemsProcessed(state.iterations() * sets.size());
+}
+BENCHMARK(BM_consume_number_set)
+	->ArgNames({ "nums", "dup%" })
+	->Args({ 3, 0 })->Args({ 3, 50 })->Args({ 3, 90 })
+	->Args({ 100, 0 })->Args({ 100, 50 })->Args({ 100, 90 })
+	->Unit(benchmark::kMillisecond);
+
+/*
+	merge of 8 instances holding 1M sets in all, half of them found in several instances
+	arg 0: threads, 0 merges the instances one at a time
+*/
+void BM_merge(benchmark::State& state)
+{
+	vector<string> lines = generate_lines(input_params{ 10, 50, 0, 1'000'000 });
+	int thread_count = static_cast<int>(state.range(0));
+
+	for (auto _ : state)
+	{
+		state.PauseTiming();
+		vector<unique_ptr<number_sets<int>>> parts;
+		vector<number_sets<int>*> part_ptrs;
+		for (int i = 0; i < 8; ++i)
+		{
+			parts.push_back(make_unique<number_sets<int>>());
+			part_ptrs.push_back(parts.back().get());
+		}
+		for (size_t i = 0; i < lines.size(); ++i)
+			parts[i % parts.size()]->add(lines[i]);
+		number_sets<int> merged;
+		state.ResumeTiming();
+
+		if (thread_count == 0)
+		{
+			for (auto& part : parts)
+				merged.merge(move(*part));
+		}
+		else
+			merged.merge(part_ptrs, thread_count);
+
+		benchmark::DoNotOptimize(merged.get_duplicate_count());
+	}
+
+	state.SetItemsProcessed(state.iterations() * lines.size());
+}
+BENCHMARK(BM_merge)->ArgName("threads")->Arg(0)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+/*
+	report of 1M sets sorted by occurences, written to memory
+	arg 0: threads, 0 is the copy, single threaded sort and operator<< the report was made with before
+*/
+void BM_export(benchmark::State& state)
+{
+	vector<string> lines = generate_lines(input_params{ 10, 50, 0, 1'000'000 });
+	int thread_count = static_cast<int>(state.range(0));
+
+	number_sets<int> sets;
+	for (const auto& line : lines)
+		sets.add(line);
+
+	for (auto _ : state)
+	{
+		stringstream out;
+
+		if (thread_count == 0)
+		{
+			vector<number_set<int>> copies;
+			for (auto item : sets.get_data())
+				copies.push_back(number_set<int>{ item.numbers.to_vector(), item.occurences });
+
+			sort(copies.begin(), copies.end(), [](const auto& a, const auto& b) { return a.occurences > b.occurences; });
+
+			for (const auto& item : copies)
+				out << item.occurences << "\t" << item.numbers << "\n";
+		}
+		else
+			sets.export_sets(out, export_order::occurences, thread_count);
+
+		benchmark::DoNotOptimize(out.tellp());
+	}
+
+	state.SetItemsProcessed(state.iterations() * sets.get_data().size());
+}
+BENCHMARK(BM_export)->ArgName("threads")->Arg(0)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+
+/*
+	end to end
+	arg 0: numbers per line, arg 1: percentage of duplicates, arg 2: percentage of invalid lines, arg 3: producer threads
+*/
+
+void add_batch_mode_args(benchmark::internal::Benchmark* b)
+{
+	b->ArgNames({ "nums", "dup%", "invalid%", "threads" });
+
+	for (int nums_per_line : { 3, 100 })
+		for (int duplicate_percent : { 0, 50 })
+			for (int invalid_percent : { 0, 10 })
+				for (int threads : { 1, 2, 4, 8 })
+					b->Args({ nums_per_line, duplicate_percent, invalid_percent, threads });
+}
+
+void BM_add_batch_mode(benchmark::State& state)
+{
+	input_params params{ static_cast<int>(state.range(0)), static_cast<int>(state.range(1)), static_cast<int>(state.range(2)), 0 };
+	params.line_count = params.nums_per_line >= 100 ? 100'000 : 1'000'000;
+
+	const string& filename = input_file(params);
+	int producer_count = static_cast<int>(state.range(3));
+
+	for (auto _ : state)
+	{
+		number_sets<int> sets;
+		sets.add_batch_mode(filename, producer_count);
+		benchmark::DoNotOptimize(sets.get_duplicate_count());
+	}
+
+	ifstream ifile(filename, ios::binary | ios::ate);
+	state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(ifile.tellg()));
+	state.SetItemsProcessed(state.iterations() * params.line_count);
+}
+BENCHMARK(BM_add_batch_mode)->Apply(add_batch_mode_args)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// same input with the fixed memory heavy hitters engine
+void BM_add_batch_mode_approximate(benchmark::State& state)
+{
+	input_params params{ static_cast<int>(state.range(0)), static_cast<int>(state.range(1)), static_cast<int>(state.range(2)), 0 };
+	params.line_count = params.nums_per_line >= 100 ? 100'000 : 1'000'000;
+
+	const string& filename = input_file(params);
+	int producer_count = static_cast<int>(state.range(3));
+
+	for (auto _ : state)
+	{
+		approximate_number_sets<int> sets;
+		sets.add_batch_mode(filename, producer_count);
+		benchmark::DoNotOptimize(sets.get_duplicate_count());
+	}
+
+	ifstream ifile(filename, ios::binary | ios::ate);
+	state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(ifile.tellg()));
+	state.SetItemsProcessed(state.iterations() * params.line_count);
+}
+BENCHMARK(BM_add_batch_mode_approximate)->Apply(add_batch_mode_args)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// same input read in chunks by chunk_reader instead of being mapped
+void BM_add_batch_mode_async_reads(benchmark::State& state)
+{
+	input_params params{ static_cast<int>(state.range(0)), static_cast<int>(state.range(1)), static_cast<int>(state.range(2)), 0 };
+	params.line_count = params.nums_per_line >= 100 ? 100'000 : 1'000'000;
+
+	const string& filename = input_file(params);
+	int producer_count = static_cast<int>(state.range(3));
+
+	read_options read;
+	read.async = true;
+
+	for (auto _ : state)
+	{
+		number_sets<int> sets;
+		sets.set_read_options(read);
+		sets.add_batch_mode(filename, producer_count);
+		benchmark::DoNotOptimize(sets.get_duplicate_count());
+	}
+
+	ifstream ifile(filename, ios::binary | ios::ate);
+	state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(ifile.tellg()));
+	state.SetItemsProcessed(state.iterations() * params.line_count);
+}
+BENCHMARK(BM_add_batch_mode_async_reads)->Apply(add_batch_mode_args)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// the lines of one input spread over file_count files
+vector<string> input_files(const input_params& params, int file_count)
+{
+	static map<vector<int>, vector<string>> files;
+
+	vector<int> key = { params.nums_per_line, params.duplicate_percent, params.invalid_percent, params.line_count, file_count };
+	auto found = files.find(key);
+	if (found != files.end())
+		return found->second;
+
+	vector<string> lines = generate_lines(params);
+	vector<string> filenames;
+
+	for (int file = 0; file < file_count; ++file)
+	{
+		filenames.push_back("ncr_benchmark_input_" + to_string(params.nums_per_line) + "_" + to_string(params.line_count) + "_part_" +
+			to_string(file) + "_of_" + to_string(file_count) + ".txt");
+
+		ofstream ofile(filenames.back(), ios::binary);
+		for (size_t line = file; line < lines.size(); line += file_count)
+			ofile << lines[line] << "\n";
+	}
+
+	return files[key] = filenames;
+}
+
+// args: file count, producer count
+void add_batch_mode_files_args(benchmark::internal::Benchmark* b)
+{
+	for (int file_count : { 10, 1000 })
+		for (int producer_count : { 1, 4 })
+			b->Args({ file_count, producer_count });
+}
+
+// a call per file, the pipeline is set up again for each of them
+void BM_add_batch_mode_per_file(benchmark::State& state)
+{
+	input_params params{ 10, 10, 1, 1'000'000 };
+	vector<string> filenames = input_files(params, static_cast<int>(state.range(0)));
+	int producer_count = static_cast<int>(state.range(1));
+
+	for (auto _ : state)
+	{
+		number_sets<int> sets;
+		for (const auto& filename : filenames)
+			sets.add_batch_mode(filename, producer_count);
+		benchmark::DoNotOptimize(sets.get_duplicate_count());
+	}
+
+	state.SetItemsProcessed(state.iterations() * params.line_count);
+}
+BENCHMARK(BM_add_batch_mode_per_file)->Apply(add_batch_mode_files_args)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// all the files in one run of the pipeline
+void BM_add_batch_mode_files(benchmark::State& state)
+{
+	input_params params{ 10, 10, 1, 1'000'000 };
+	vector<string> filenames = input_files(params, static_cast<int>(state.range(0)));
+	int producer_count = static_cast<int>(state.range(1));
+
+	for (auto _ : state)
+	{
+		number_sets<int> sets;
+		sets.add_batch_mode_files(filenames, producer_count);
+		benchmark::DoNotOptimize(sets.get_duplicate_count());
+	}
+
+	state.SetItemsProcessed(state.iterations() * params.line_count);
+}
+BENCHMARK(BM_add_batch_mode_files)->Apply(add_batch_mode_files_args)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+template<typename HashPolicy>
+void add_lines(benchmark::State& state)
+{
+	vector<string> lines = generate_lines(input_params{ static_cast<int>(state.range(0)), static_cast<int>(state.range(1)), static_cast<int>(state.range(2)), 100'000 });
+
+	for (auto _ : state)
+	{
+		number_sets<int, char, HashPolicy> sets;
+		for (const auto& line : lines)
+		{
+			try
+			{
+				sets.add(line);
+			}
+			catch (runtime_error&)
+			{
+			}
+		}
+		benchmark::DoNotOptimize(sets.get_duplicate_count());
+	}
+
+	state.SetItemsProcessed(state.iterations() * lines.size());
+}
+
+void BM_add(benchmark::State& state)
+{
+	add_lines<default_hash_policy>(state);
+}
+BENCHMARK(BM_add)
+	->ArgNames({ "nums", "dup%", "invalid%" })
+	->Args({ 3, 0, 0 })->Args({ 3, 50, 10 })->Args({ 3, 90, 0 })->Args({ 100, 0, 0 })->Args({ 100, 50, 10 })->Args({ 100, 90, 0 })
+	->Unit(benchmark::kMillisecond);
+
+// duplicates are found without sorting, only new sets are sorted
+void BM_add_order_independent(benchmark::State& state)
+{
+	add_lines<commutative_hash_policy>(state);
+}
+BENCHMARK(BM_add_order_independent)
+	->ArgNames({ "nums", "dup%", "invalid%" })
+	->Args({ 3, 0, 0 })->Args({ 3, 50, 10 })->Args({ 3, 90, 0 })->Args({ 100, 0, 0 })->Args({ 100, 50, 10 })->Args({ 100, 90, 0 })
+	->Unit(benchmark::kMillisecond);
+
+
+/*
+	main
+	same as BENCHMARK_MAIN, but writes json results by default
+*/
+
+int main(int argc, char** argv)
+{
+	vector<char*> args(argv, argv + argc);
+
+	char out_arg[] = "--benchmark_out=ncr_benchmark.json";
+	char format_arg[] = "--benchmark_out_format=json";
+
+	bool has_out = any_of(args.begin(), args.end(), [](const char* arg) {
+		return strncmp(arg, "--benchmark_out=", strlen("--benchmark_out=")) == 0;
+	});
+
+	if (!has_out)
+	{
+		args.push_back(out_arg);
+		args.push_back(format_arg);
+	}
+
+	int args_count = static_cast<int>(args.size());
+
+	benchmark::Initialize(&args_count, args.data());
+	if (benchmark::ReportUnrecognizedArguments(args_count, args.data()))
+		return 1;
+
+	benchmark::RunSpecifiedBenchmarks();
+	return 0;
+}
@@ -1,9 +1,15 @@
+#include "mpsc_ring.h"
+#include "task_pool.h"
 #include "number_sets.h"
+#include "approximate_number_sets.h"
 
 #include <assert.h>
 
 #include <map>
+#include <atomic>
 #include <chrono>
+#include <future>
+#include <thread>
 #include <random>
 #include <fstream>
 #include <filesystem>
@@ -99,27 +105,29 @@ void process_input_file(const string& filename)
 
 	cout << "Duplicates: " << x.get_duplicate_count() << " Non Duplicates: " << x.get_non_duplicate_count() << "\n";
 
-	vector<number_set<int>> sets;
-
-	for (auto item : x.get_data())
-		sets.push_back(number_set<int>{item.numbers, item.occurences});
-
-	sort(sets.begin(), sets.end(), [](const auto& a, const auto& b) {
-		return a.occurences > b.occurences;
-	});
-
 	cout << "\n";
 	cout << "Occurences\tNumber Set\n";
+	x.export_sets(cout);
+
 	int count = 0;
-	for (auto item : sets)
-	{
+	for (const auto& item : x.get_data())
 		count += item.occurences;
-		cout << item.occurences << "\t\t" << item.numbers << "\n";
-	}
 
 	cout << "Total: " << count << "\n";
 }
 
+// occurences of every set, for any number_sets of int
+template<typename SetsT>
+map<vector<int>, int> get_map_num_set(const SetsT &x)
+{
+	map<vector<int>, int> sets;
+
+	for (auto item : x.get_data())
+		sets[item.numbers.to_vector()] = item.occurences;
+
+	return sets;
+}
+
 vector<number_set<int>> get_vec_num_set(const number_sets<int> &x)
 {
 	vector<number_set<int>> sets;
@@ -169,6 +177,25 @@ void test_input_file_result(const string& filename)
 	assert(x.get_duplicate_count() == y.get_duplicate_count() && x.get_non_duplicate_count() == y.get_non_duplicate_count() &&
 	x.get_most_frequent_data().numbers == y.get_most_frequent_data().numbers && x.get_most_frequent_data().occurences == y.get_most_frequent_data().occurences &&
 	x.get_invalid_inputs() == y.get_invalid_inputs());
+
+
+	// test sharded batch mode
+
+	number_sets<int> z;
+
+	z.add_batch_mode(filename, 4, 3);
+
+	assert(get_vec_num_set(z) == simple_number_sets_impl(filename));
+	assert(x.get_duplicate_count() == z.get_duplicate_count() && x.get_non_duplicate_count() == z.get_non_duplicate_count() &&
+	x.get_most_frequent_data().occurences == z.get_most_frequent_data().occurences &&
+	x.get_invalid_inputs() == z.get_invalid_inputs());
+
+	// shards are merged with the content added before
+	z.add_batch_mode(filename, 2, 5);
+
+	assert(z.get_data().size() == x.get_data().size());
+	assert(z.get_duplicate_count() == 2 * (x.get_duplicate_count() + x.get_non_duplicate_count()) && z.get_non_duplicate_count() == 0);
+	assert(z.get_most_frequent_data().occurences == 2 * x.get_most_frequent_data().occurences);
 }
 
 void test_invalid_inputs()
@@ -182,7 +209,9 @@ void test_invalid_inputs()
 		"1       ,           2,          3,               4                ",
 		"123456789,     12",
 		"-1234, 1324",
-		"0, 0, 0, 0"
+		"0, 0, 0, 0",
+		"-2147483648, 2147483647",
+		"000000000000000000000042,\t1234567890"
 	};
 
 	vector<string> invalid_inputs = {
@@ -194,7 +223,10 @@ void test_invalid_inputs()
 		"123 123",
 		"123.456",
 		"1,2,3,4s,6",
-		"123,456,12-456"
+		"123,456,12-456",
+		"2147483648",
+		"12345678901234567890",
+		"1, -"
 	};
 
 	for (size_t i = 0; i < valid_inputs.size(); ++i)
@@ -224,6 +256,94 @@ void test_invalid_inputs()
 	assert(x.get_invalid_inputs() == invalid_inputs);
 }
 
+// sort_numbers against std::sort, for every algorithm it picks from
+template<typename T>
+void test_sort_numbers_typed()
+{
+	mt19937 gen(7);
+	uniform_int_distribution<int> pick(0, 5);
+
+	for (size_t count = 0; count < 300; count += (count < 40 ? 1 : 37))
+	{
+		for (int round = 0; round < 20; ++round)
+		{
+			vector<T> numbers(count);
+			for (auto& number : numbers)
+			{
+				// limits, duplicates and random bits
+				switch (pick(gen))
+				{
+				case 0: number = numeric_limits<T>::max(); break;
+				case 1: number = numeric_limits<T>::min(); break;
+				case 2: number = static_cast<T>(pick(gen)); break;
+				default: number = static_cast<T>(gen() * 0x9E3779B97F4A7C15ull); break;
+				}
+			}
+
+			vector<T> expected(numbers);
+			sort(expected.begin(), expected.end());
+
+			uint64_t hash = sort_and_hash<default_hash_policy>(numbers);
+			assert(numbers == expected);
+			assert(hash == hasher<T>()(expected));
+		}
+	}
+}
+
+void test_sort_numbers()
+{
+	test_sort_numbers_typed<short>();
+	test_sort_numbers_typed<unsigned short>();
+	test_sort_numbers_typed<int>();
+	test_sort_numbers_typed<unsigned int>();
+	test_sort_numbers_typed<long long>();
+	test_sort_numbers_typed<unsigned long long>();
+}
+
+// kinds and offsets of the errors reported by parse_numbers and try_produce_number_set
+void test_parse_errors()
+{
+	auto check = [](auto input, auto value, parse_error_kind kind, size_t offset) {
+		using char_type = typename remove_const<typename remove_pointer<decltype(input)>::type>::type;
+		basic_string<char_type> line(input);
+		vector<decltype(value)> numbers(3);
+
+		parse_error error = try_produce_number_set<decltype(value), char_type>(line, numbers);
+		assert(error.kind == kind && error.offset == offset);
+		assert(static_cast<bool>(error) == (kind != parse_error_kind::none));
+		assert(error || !numbers.empty());
+	};
+
+	check("3, 1, 2", 0, parse_error_kind::none, 0);
+	check("", 0, parse_error_kind::empty, 0);
+	check("  \t", 0, parse_error_kind::empty, 0);
+	check("1, 2, x", 0, parse_error_kind::invalid_character, 6);
+	check("1,, 2", 0, parse_error_kind::missing_number, 2);
+	check("  ,", 0, parse_error_kind::missing_number, 2);
+	check("1, -", 0, parse_error_kind::missing_number, 3);
+	check("1 2", 0, parse_error_kind::missing_comma, 2);
+	check("1, 99999999999", 0, parse_error_kind::out_of_range, 3);
+	check("1, -5", 0u, parse_error_kind::out_of_range, 3);
+	check("-9223372036854775808", 0ll, parse_error_kind::none, 0);
+	check(L"1, 2 3", 0, parse_error_kind::missing_comma, 5 * sizeof(wchar_t));
+	check("12", 'a', parse_error_kind::invalid_number, 0); // char is parsed by streams, as a character
+
+	// not sorted, and the buffer is reused
+	string line("5, 4");
+	vector<int> numbers;
+	numbers.reserve(10);
+	assert(!(parse_numbers<int, char>(string_ref(line.data(), line.data() + line.size()), numbers)));
+	assert((numbers == vector<int>({ 5, 4 }) && numbers.capacity() == 10));
+
+	number_sets<int> x;
+	parse_error error;
+	assert(!x.try_add("1, a", error) && error.kind == parse_error_kind::invalid_character && error.offset == 3);
+	assert(x.try_add("1", error) && !error);
+	assert(!x.try_add("1", error) && !error);
+	assert(x.get_invalid_inputs() == vector<string>({ "1, a" }));
+	assert(x.get_duplicate_count() == 2);
+}
+
 void test_different_integral_types()
 {
 	vector<string> inputs = {
@@ -242,7 +362,7 @@ void test_different_integral_types()
 	number_sets<long long int> lld;
 	number_sets<unsigned long long int> ulld;
 
-	auto f = [](auto& set, auto& input) {
+	auto f = [](auto& set, const auto& input) {
 		try
 		{
 			set.add(input);
@@ -263,6 +383,28 @@ void test_different_integral_types()
 	assert(lld.get_invalid_inputs()		== vector<string>({ to_string(_UI64_MAX), "123.456" }));
 	assert(ulld.get_invalid_inputs()	== vector<string>({ to_string(INT_MIN), to_string(_I64_MIN), "123.456" }));
 
+	// limits of every width, one past them, and leading zeros
+	number_sets<short> sd;
+	number_sets<unsigned short, wchar_t> usd;
+	for (auto input : { "32767", "-32768", "32768", "-32769", "0000000000000000000000065535", "65536", "-0" })
+	{
+		f(sd, string(input));
+		f(usd, wstring(input, input + strlen(input)));
+	}
+	assert(sd.get_invalid_inputs() == vector<string>({ "32768", "-32769", "0000000000000000000000065535", "65536" }));
+	assert(usd.get_invalid_inputs() == vector<wstring>({ L"-32768", L"-32769", L"65536", L"-0" }));
+
+	f(lld, to_string(_I64_MAX) + "0");
+	f(ulld, to_string(_UI64_MAX) + "0");
+	f(ulld, "00000000000000000000" + to_string(_UI64_MAX));
+	assert(lld.get_invalid_inputs().back() == to_string(_I64_MAX) + "0");
+	assert(ulld.get_invalid_inputs().back() == to_string(_UI64_MAX) + "0");
+
+	// only ascii digits
+	number_sets<int, wchar_t> wd;
+	f(wd, wstring(L"1, \x0663"));
+	assert(wd.get_invalid_inputs().size() == 1);
+
 	// following should static_assert
 	//number_sets<float> f; // should give static_assert, float is not an integral type
 	//number_sets<string> s; // should give static_assert, string is not an integral type
@@ -349,6 +491,824 @@ void test_duplicates()
 	assert(d.get_most_frequent_data().occurences == 100);
 }
 
+// enough sets to make the index grow several times
+void test_many_unique_sets()
+{
+	number_sets<int> d;
+	number_sets<int> reserved;
+
+	reserved.reserve(200'000);
+
+	for (int round = 0; round < 2; ++round)
+	{
+		for (int i = 0; i < 100'000; ++i)
+		{
+			string input = to_string(i) + ", " + to_string(i * 7);
+			assert(d.add(input) == (round == 0));
+			assert(reserved.add(input) == (round == 0));
+		}
+	}
+
+	assert(d.get_data().size() == 100'000 && reserved.get_data().size() == 100'000);
+	assert(d.get_duplicate_count() == 200'000 && d.get_non_duplicate_count() == 0);
+	assert(reserved.get_duplicate_count() == 200'000 && reserved.get_non_duplicate_count() == 0);
+
+	// insertion order is kept
+	int i = 0;
+	for (auto item : d.get_data())
+	{
+		assert(item.numbers == vector<int>({ i, i * 7 }) || item.numbers == vector<int>({ i * 7, i }));
+		assert(item.occurences == 2);
+		++i;
+	}
+}
+
+void test_snapshot(const string& filename)
+{
+	number_sets<int> x;
+	x.add_batch_mode(filename, 4);
+
+	string snapshot_filename("snapshot_test.bin");
+	x.save(snapshot_filename);
+
+	number_sets<int> y;
+	y.add("1, 2, 3"); // replaced by the snapshot
+	y.load(snapshot_filename);
+
+	assert(get_vec_num_set(x) == get_vec_num_set(y));
+	assert(x.get_duplicate_count() == y.get_duplicate_count() && x.get_non_duplicate_count() == y.get_non_duplicate_count());
+	assert(x.get_most_frequent_data().numbers == y.get_most_frequent_data().numbers && x.get_most_frequent_data().occurences == y.get_most_frequent_data().occurences);
+	assert(x.get_invalid_inputs() == y.get_invalid_inputs());
+
+	// the index of the loaded sets works as before
+	x.add_batch_mode(filename, 4);
+	y.add_batch_mode(filename, 4);
+	assert(get_vec_num_set(x) == get_vec_num_set(y));
+	assert(x.get_duplicate_count() == y.get_duplicate_count() && x.get_non_duplicate_count() == y.get_non_duplicate_count());
+
+	// an empty snapshot
+	number_sets<int> empty;
+	empty.save(snapshot_filename);
+	y.load(snapshot_filename);
+	assert(y.get_data().empty() && y.get_invalid_inputs().empty() && y.get_most_frequent_data().occurences == 0);
+
+	// snapshots of other types, and files that aren't snapshots, are rejected
+	x.save(snapshot_filename);
+
+	auto load_fails = [](auto& sets, const string& name) {
+		try
+		{
+			sets.load(name);
+			return false;
+		}
+		catch (runtime_error&)
+		{
+			return true;
+		}
+	};
+
+	number_sets<long long> other_type;
+	number_sets<int, char, combine_hash_policy> other_policy;
+	assert(load_fails(other_type, snapshot_filename));
+	assert(load_fails(other_policy, snapshot_filename));
+	assert(load_fails(y, filename));
+
+	resize_file(snapshot_filename, file_size(snapshot_filename) - 1);
+	assert(load_fails(y, snapshot_filename));
+	assert(y.get_data().empty()); // untouched by the failed loads
+}
+
+// sets built for partitions of the input and merged give the same result as the whole input
+void test_merge(const string& filename)
+{
+	auto check_same = [](const number_sets<int>& x, const number_sets<int>& y) {
+		assert(get_map_num_set(x) == get_map_num_set(y));
+		assert(x.get_duplicate_count() == y.get_duplicate_count() && x.get_non_duplicate_count() == y.get_non_duplicate_count());
+		assert(x.get_most_frequent_data().occurences == y.get_most_frequent_data().occurences);
+
+		auto x_top = x.get_top_k(10), y_top = y.get_top_k(10);
+		assert(x_top.size() == y_top.size());
+		for (size_t i = 0; i < x_top.size(); ++i)
+			assert(x_top[i].occurences == y_top[i].occurences);
+
+		auto x_invalid = x.get_invalid_inputs(), y_invalid = y.get_invalid_inputs();
+		sort(x_invalid.begin(), x_invalid.end());
+		sort(y_invalid.begin(), y_invalid.end());
+		assert(x_invalid == y_invalid);
+	};
+
+	// the lines of the input dealt over 3 partitions
+	vector<string> lines;
+	ifstream ifile(filename);
+	for (string line; getline(ifile, line); )
+		lines.push_back(line);
+
+	number_sets<int> expected;
+	number_sets<int> parts[3];
+	for (size_t i = 0; i < lines.size(); ++i)
+	{
+		parse_error error;
+		expected.try_add(lines[i], error);
+		parts[i % 3].try_add(lines[i], error);
+	}
+
+	for (auto& part : parts)
+	{
+		number_sets<int> copy;
+		copy.merge({ &part }, 2); // leaves part as it was, through a round trip
+		part.merge(move(copy));
+		assert(copy.get_data().empty() && copy.get_invalid_inputs().empty());
+	}
+
+	number_sets<int> parallel;
+	parallel.add("1, 2, 3"); // already there before the merge
+	expected.add("3, 2, 1");
+	parallel.merge({ &parts[0], &parts[1], &parts[2], &parallel, &parts[0] }, 3);
+	check_same(parallel, expected);
+	assert(parts[0].get_data().empty() && parts[2].get_duplicate_count() == 0);
+
+	// the sets only in the merged instance come after the ones already there
+	number_sets<int> x, y;
+	x.add("5, 6");
+	y.add("1, 2");
+	y.add("6, 5");
+	x.merge(move(y));
+
+	vector<pair<vector<int>, int>> in_order;
+	for (auto item : x.get_data())
+		in_order.emplace_back(item.numbers.to_vector(), item.occurences);
+	assert((in_order == vector<pair<vector<int>, int>>{ { { 5, 6 }, 2 }, { { 1, 2 }, 1 } }));
+
+	// more sets than a chunk of the parallel merge, overlapping between the instances
+	const int set_count = 100'000;
+	number_sets<int> many_expected;
+	vector<unique_ptr<number_sets<int>>> many(4);
+	vector<number_sets<int>*> many_ptrs;
+
+	for (auto& sets : many)
+	{
+		sets = make_unique<number_sets<int>>();
+		many_ptrs.push_back(sets.get());
+	}
+
+	for (int i = 0; i < set_count; ++i)
+	{
+		string line = to_string(i % (set_count / 2)) + ", " + to_string(i % 7);
+		many_expected.add(line);
+		many[i % many.size()]->add(line);
+	}
+
+	number_sets<int> many_merged;
+	many_merged.merge(many_ptrs, 4);
+	check_same(many_merged, many_expected);
+}
+
+// all the memory taken from the allocator of the sets, including the one of the shards, is given back to it
+void test_arena_allocator(const string& filename)
+{
+	struct counting_allocator
+	{
+		atomic<size_t> allocated;
+		atomic<size_t> deallocated;
+	} counts{ { 0 }, { 0 } };
+
+	arena_allocator allocator(
+		[](size_t bytes, void* context) {
+			static_cast<counting_allocator*>(context)->allocated += bytes;
+			return ::operator new(bytes);
+		},
+		[](void* memory, size_t bytes, void* context) {
+			static_cast<counting_allocator*>(context)->deallocated += bytes;
+			::operator delete(memory);
+		},
+		&counts);
+
+	{
+		number_sets<int> expected;
+		expected.add_batch_mode(filename, 2);
+
+		number_sets<int> x;
+		x.set_allocator(allocator);
+		x.add_batch_mode(filename, 3, 4);
+		x.add("1, 2, 3");
+		expected.add("1, 2, 3");
+
+		assert(get_map_num_set(x) == get_map_num_set(expected));
+		assert(counts.allocated > 0 && counts.deallocated > 0); // merged shards have been freed already
+
+		// the sets allocated so far go back to the allocator they came from
+		x.set_allocator(arena_allocator());
+		x.add("1, 2, 3, 4, 5, 6, 7");
+	}
+
+	assert(counts.allocated == counts.deallocated);
+}
+
+// a log file growing between calls, ending up with the same result as processing the final file at once
+// batch mode against add, for several T, with narrow and wide input files
+template<typename T, typename CharT>
+void test_batch_mode_typed(const string& filename, const vector<basic_string<CharT>>& lines)
+{
+	number_sets<T, CharT> x;
+	for (const auto& line : lines)
+	{
+		try
+		{
+			x.add(line);
+		}
+		catch (exception&)
+		{
+		}
+	}
+
+	number_sets<T, CharT> y;
+	y.add_batch_mode(filename, 3, 2);
+
+	assert(x.get_data().size() == y.get_data().size());
+	assert(x.get_duplicate_count() == y.get_duplicate_count() && x.get_non_duplicate_count() == y.get_non_duplicate_count());
+	assert(x.get_most_frequent_data().occurences == y.get_most_frequent_data().occurences);
+
+	auto x_invalid = x.get_invalid_inputs(), y_invalid = y.get_invalid_inputs();
+	sort(x_invalid.begin(), x_invalid.end());
+	sort(y_invalid.begin(), y_invalid.end());
+	assert(x_invalid == y_invalid);
+
+	approximate_number_sets<T, CharT> z;
+	z.add_batch_mode(filename, 2);
+	assert(z.get_invalid_count() == static_cast<int64_t>(x_invalid.size()));
+}
+
+void test_batch_mode_types()
+{
+	vector<string> lines;
+	for (int line = 0; line < 20'000; ++line)
+	{
+		string s;
+		for (int i = 0, count = 1 + rand() % 5; i < count; ++i)
+		{
+			if (i != 0)
+				s += ", ";
+
+			switch (rand() % 4)
+			{
+			case 0: s += to_string(rand() % 100); break;
+			case 1: s += to_string(-(rand() % 40'000)); break;
+			case 2: s += to_string(rand() % 70'000); break;
+			default: s += to_string((static_cast<long long>(rand()) << 40) + rand()); break;
+			}
+		}
+		lines.push_back(s);
+	}
+
+	string filename("batch_mode_types.txt");
+	{
+		ofstream ofile(filename, ios::binary);
+		for (const auto& line : lines)
+			ofile << line << "\n";
+	}
+
+	test_batch_mode_typed<short>(filename, lines);
+	test_batch_mode_typed<unsigned int>(filename, lines);
+	test_batch_mode_typed<long long>(filename, lines);
+	test_batch_mode_typed<unsigned long long>(filename, lines);
+
+	// native wide characters, with a byte order mark
+	vector<wstring> wide_lines;
+	string wide_filename("batch_mode_types_wide.txt");
+	{
+		wstring content(1, wchar_t(0xFEFF));
+		for (const auto& line : lines)
+		{
+			wide_lines.push_back(wstring(line.begin(), line.end()));
+			content += wide_lines.back() + L"\n";
+		}
+
+		ofstream ofile(wide_filename, ios::binary);
+		ofile.write(reinterpret_cast<const char*>(content.data()), content.size() * sizeof(wchar_t));
+	}
+
+	test_batch_mode_typed<int>(wide_filename, wide_lines);
+	test_batch_mode_typed<long long>(wide_filename, wide_lines);
+}
+
+void test_batch_mode_appended()
+{
+	string filename("appended_test.txt");
+
+	vector<string> parts = {
+		"1, 2\n3, 4\n5, ",		// the last line is completed by the next part
+		"6\n2, 1\nabcd\n",
+		"",
+		"4, 3\n1, 2\n7"			// never completed
+	};
+
+	number_sets<int> x;
+
+	ofstream(filename, ios::trunc).close();
+
+	for (const auto& part : parts)
+	{
+		ofstream(filename, ios::app | ios::binary) << part;
+		x.add_batch_mode_appended(filename, 3, 2);
+	}
+
+	ofstream(filename, ios::app | ios::binary) << "\n";
+	x.add_batch_mode_appended(filename, 3, 2);
+
+	number_sets<int> y;
+	y.add_batch_mode(filename, 3);
+
+	assert(get_vec_num_set(x) == get_vec_num_set(y));
+	assert(x.get_duplicate_count() == y.get_duplicate_count() && x.get_non_duplicate_count() == y.get_non_duplicate_count());
+	assert(x.get_most_frequent_data().numbers == y.get_most_frequent_data().numbers && x.get_most_frequent_data().occurences == y.get_most_frequent_data().occurences);
+	assert(x.get_invalid_inputs() == y.get_invalid_inputs());
+
+	// a file that got shorter can't be continued
+	ofstream(filename, ios::trunc) << "1, 2\n";
+	try
+	{
+		x.add_batch_mode_appended(filename, 3);
+		assert(false);
+	}
+	catch (runtime_error&)
+	{
+	}
+}
+
+// the file read in chunks gives the same result as mapped
+// chunks are small, so that lines are cut by chunk ends and some are longer than a chunk
+void test_batch_mode_async_reads(const string& filename)
+{
+	auto check_same = [](const auto& x, const auto& y) {
+		assert(get_map_num_set(x) == get_map_num_set(y));
+		assert(x.get_duplicate_count() == y.get_duplicate_count() && x.get_non_duplicate_count() == y.get_non_duplicate_count());
+
+		auto x_invalid = x.get_invalid_inputs(), y_invalid = y.get_invalid_inputs();
+		sort(x_invalid.begin(), x_invalid.end());
+		sort(y_invalid.begin(), y_invalid.end());
+		assert(x_invalid == y_invalid);
+	};
+
+	read_options read;
+	read.async = true;
+	read.chunk_size = 1; // rounded up to chunk_reader::read_alignment
+
+	number_sets<int> expected;
+	expected.add_batch_mode(filename, 2);
+
+	for (bool direct_io : { false, true })
+	{
+		for (size_t queue_depth : { 1, 3 })
+		{
+			read.direct_io = direct_io;
+			read.queue_depth = queue_depth;
+
+			number_sets<int> x;
+			x.set_read_options(read);
+			x.enable_stats();
+			x.add_batch_mode(filename, 3, 2);
+			check_same(x, expected);
+			assert(x.get_stats().producers.bytes == file_size(filename));
+		}
+	}
+
+	// lines longer than a chunk, an empty line and a last line without newline
+	string long_line;
+	for (int i = 0; i < 3000; ++i)
+		long_line += to_string(i) + ", ";
+	long_line += "1";
+
+	string content = "1, 2\n" + long_line + "\n\n" + long_line + "\n3, 1\n" + long_line + "\nabc\n2, 3";
+	string long_filename("async_reads_test.txt");
+	ofstream(long_filename, ios::binary) << content;
+
+	number_sets<int> x;
+	x.add_batch_mode(long_filename, 2);
+	number_sets<int> y;
+	y.set_read_options(read);
+	y.add_batch_mode(long_filename, 3);
+	check_same(x, y);
+
+	// the last line is left for the next call until it is complete
+	number_sets<int> z;
+	z.set_read_options(read);
+	z.add_batch_mode_appended(long_filename, 2);
+	assert((get_map_num_set(z).count({ 2, 3 }) == 0));
+	ofstream(long_filename, ios::app | ios::binary) << "\n";
+	z.add_batch_mode_appended(long_filename, 2);
+	check_same(x, z);
+
+	// wide characters, with a byte order mark
+	wstring wide_content(1, wchar_t(0xFEFF));
+	wide_content += wstring(content.begin(), content.end());
+	string wide_filename("async_reads_test_wide.txt");
+	ofstream(wide_filename, ios::binary).write(reinterpret_cast<const char*>(wide_content.data()), wide_content.size() * sizeof(wchar_t));
+
+	number_sets<int, wchar_t> wide_x;
+	wide_x.add_batch_mode(wide_filename, 2);
+	number_sets<int, wchar_t> wide_y;
+	wide_y.set_read_options(read);
+	wide_y.add_batch_mode(wide_filename, 3, 2);
+	check_same(wide_x, wide_y);
+	assert(get_map_num_set(wide_y) == get_map_num_set(y));
+}
+
+// several files in one run give the same result as one call per file
+void test_batch_mode_files(const string& filename)
+{
+	auto check_same = [](const auto& x, const auto& y) {
+		assert(get_map_num_set(x) == get_map_num_set(y));
+		assert(x.get_duplicate_count() == y.get_duplicate_count() && x.get_non_duplicate_count() == y.get_non_duplicate_count());
+
+		auto x_invalid = x.get_invalid_inputs(), y_invalid = y.get_invalid_inputs();
+		sort(x_invalid.begin(), x_invalid.end());
+		sort(y_invalid.begin(), y_invalid.end());
+		assert(x_invalid == y_invalid);
+	};
+
+	string directory("batch_files_test");
+	create_directory(directory);
+	create_directory(directory + "/sub.txt");
+
+	// the input file, copies of its start, an empty file and a last line without newline
+	ifstream input(filename, ios::binary);
+	string content((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+
+	ofstream(directory + "/a.txt", ios::binary) << content;
+	ofstream(directory + "/b.txt", ios::binary) << content.substr(0, content.find('\n', content.size() / 3) + 1);
+	ofstream(directory + "/c.txt", ios::binary);
+	ofstream(directory + "/d.txt", ios::binary) << "1, 2\nabc\n3, 2, 1";
+	ofstream(directory + "/e.dat", ios::binary) << "5, 6\n";
+
+	vector<string> filenames = list_files(directory + "/*.txt");
+	assert((filenames == vector<string>{ directory + "/a.txt", directory + "/b.txt", directory + "/c.txt", directory + "/d.txt" }));
+	assert(list_files(directory + "/*.none").empty());
+
+	number_sets<int> expected;
+	for (const auto& name : filenames)
+		expected.add_batch_mode(name, 2);
+
+	number_sets<int> x;
+	x.enable_stats();
+	x.add_batch_mode_files(filenames, 3, 2);
+	check_same(x, expected);
+	assert(x.get_stats().producers.bytes == file_size(filename) + file_size(directory + "/b.txt") + 16);
+
+	read_options read;
+	read.async = true;
+	read.chunk_size = 1;
+
+	number_sets<int> y;
+	y.set_read_options(read);
+	y.add_batch_mode_files(filenames, 3);
+	check_same(y, expected);
+
+	// nothing to do
+	number_sets<int> z;
+	z.add_batch_mode_files(vector<string>(), 2);
+	z.set_read_options(read);
+	z.add_batch_mode_files(vector<string>(), 2);
+	assert(z.get_non_duplicate_count() == 0);
+
+	approximate_number_sets<int> approximate;
+	approximate.add_batch_mode_files(filenames, 2);
+	assert(approximate.get_total_count() == static_cast<uint64_t>(expected.get_duplicate_count() + expected.get_non_duplicate_count()));
+
+	// a missing file fails before anything is added
+	try
+	{
+		x.add_batch_mode_files({ directory + "/a.txt", directory + "/missing.txt" }, 2);
+		assert(false);
+	}
+	catch (runtime_error&)
+	{
+	}
+	check_same(x, expected);
+}
+
+void test_batch_mode_stats(const string& filename)
+{
+	number_sets<int> x;
+
+	// off by default
+	x.add_batch_mode(filename, 2);
+	assert(x.get_stats().producer_count == 0 && x.get_stats().producers.lines == 0);
+
+	number_sets<int> y;
+	y.enable_stats();
+	y.add_batch_mode(filename, 2, 3);
+
+	const pipeline_stats& stats = y.get_stats();
+
+	size_t line_count = 0;
+	ifstream ifile(filename);
+	for (string line; getline(ifile, line); )
+		++line_count;
+
+	assert(stats.producer_count == 2 && stats.shard_count == 3);
+	assert(stats.producers.bytes == file_size(filename));
+	assert(stats.producers.lines == line_count);
+	assert(stats.producers.invalid_lines == y.get_invalid_inputs().size());
+	assert(stats.consumers.sets == line_count - y.get_invalid_inputs().size());
+	assert(stats.consumers.batches >= 3);
+	assert(stats.table.set_count == y.get_data().size());
+	assert(stats.table.load_factor > 0 && stats.table.load_factor <= 1);
+	assert(stats.table.average_probe_length >= 1 && stats.table.max_probe_length >= 1);
+	assert(stats.total_time >= stats.produce_time + stats.drain_time + stats.merge_time);
+	assert(stats.memory_limit == batch_options::default_memory_limit);
+	assert(stats.max_bytes_in_flight > 0 && stats.max_bytes_in_flight <= stats.memory_limit / 2);
+	assert(stats.batch_bytes > 0);
+}
+
+// a memory limit far below the size of the input, the batches sent never hold more than half of it
+void test_batch_mode_memory_limit()
+{
+	string filename("memory_limit_test.txt");
+
+	{
+		ofstream ofile(filename);
+		for (int line = 0; line < 50'000; ++line)
+		{
+			for (int i = 0; i < 20; ++i)
+				ofile << (i ? ", " : "") << (line % 10'000) * 20 + i;
+			ofile << (line % 100 == 0 ? ", x\n" : "\n");
+		}
+	}
+
+	number_sets<int> expected;
+	expected.add_batch_mode(filename, 2);
+
+	const size_t limit = 1 << 20;
+
+	number_sets<int> x;
+	x.enable_stats();
+	x.set_memory_limit(limit);
+	x.add_batch_mode(filename, 3, 2);
+
+	assert(get_map_num_set(x) == get_map_num_set(expected));
+	assert(x.get_invalid_inputs().size() == expected.get_invalid_inputs().size());
+	assert(x.get_stats().memory_limit == limit);
+	assert(x.get_stats().max_bytes_in_flight > 0 && x.get_stats().max_bytes_in_flight <= limit / 2);
+	assert(x.get_stats().consumers.batches > 10);
+
+	// a limit smaller than a single batch still makes progress
+	approximate_number_sets<int> y;
+	y.set_memory_limit(1);
+	y.add_batch_mode(filename, 2, 2);
+	assert(y.get_total_count() == static_cast<uint64_t>(expected.get_duplicate_count() + expected.get_non_duplicate_count()));
+}
+
+// get_top_k against a full sort of the sets
+void test_export(const string& filename)
+{
+	auto format = [](auto value) {
+		char text[max_integer_chars];
+		return string(text, format_integer(value, text));
+	};
+
+	assert(format(0) == "0" && format(7) == "7" && format(10) == "10" && format(-105) == "-105");
+	assert(format(INT64_MIN) == to_string(INT64_MIN) && format(INT64_MAX) == to_string(INT64_MAX) && format(UINT64_MAX) == to_string(UINT64_MAX));
+	assert(format(static_cast<signed char>(-128)) == "-128" && format(static_cast<unsigned short>(65535)) == "65535");
+
+	number_sets<int> x;
+	x.add("3, 1");
+	x.add("-2147483648, 20");
+	x.add("1, 3");
+	x.add("5");
+	x.add("1, 2, 3");
+	x.add("1, 3");
+
+	stringstream by_occurences, lexicographic;
+	x.export_sets(by_occurences);
+	x.export_sets(lexicographic, export_order::lexicographic, 2);
+	assert(by_occurences.str() == "3\t1, 3\n1\t-2147483648, 20\n1\t1, 2, 3\n1\t5\n");
+	assert(lexicographic.str() == "1\t-2147483648, 20\n1\t1, 2, 3\n3\t1, 3\n1\t5\n");
+
+	// enough sets for the sort and the formatting to be split among the threads, same result whatever their count
+	number_sets<int> many;
+	for (int i = 0; i < 200'000; ++i)
+		many.add(to_string(i % 70'000) + ", " + to_string(i % 3));
+
+	string single_thread;
+	for (int thread_count : { 1, 4 })
+	{
+		stringstream out;
+		many.export_sets(out, export_order::occurences, thread_count);
+
+		if (thread_count == 1)
+			single_thread = out.str();
+		else
+			assert(out.str() == single_thread);
+	}
+
+	vector<pair<int, vector<int>>> lines;
+	stringstream exported(single_thread);
+	for (string line; getline(exported, line); )
+	{
+		auto tab = line.find('\t');
+		lines.emplace_back(convertTo<int>(line.substr(0, tab)), get_numbers_stringstream<int>(line.substr(tab + 1)));
+	}
+
+	assert(lines.size() == many.get_data().size());
+	assert(is_sorted(lines.begin(), lines.end(), [](const auto& a, const auto& b) {
+		return a.first != b.first ? a.first > b.first : a.second < b.second;
+	}));
+
+	// to a file, the sets read back as they were exported
+	number_sets<int> from_file;
+	from_file.add_batch_mode(filename, 4);
+
+	string export_filename("export_test.txt");
+	from_file.export_sets(export_filename, export_order::lexicographic, 4);
+
+	map<vector<int>, int> read_back;
+	ifstream ifile(export_filename);
+	for (string line; getline(ifile, line); )
+	{
+		auto tab = line.find('\t');
+		read_back[get_numbers_stringstream<int>(line.substr(tab + 1))] = convertTo<int>(line.substr(0, tab));
+	}
+	ifile.close();
+
+	assert(read_back == get_map_num_set(from_file));
+	remove(export_filename);
+}
+
+void test_top_k(const string& filename)
+{
+	auto check_top_k = [](const auto& sets) {
+		vector<number_set<int>> sorted = get_vec_num_set(sets);
+		auto top = sets.get_top_k(sorted.size() + 10);
+
+		assert(top.size() == sorted.size());
+		for (size_t i = 0; i < top.size(); ++i)
+			assert(top[i].occurences == sorted[i].occurences);
+
+		// the most frequent set is first
+		if (!top.empty())
+			assert(top[0].numbers == sets.get_most_frequent_data().numbers);
+
+		auto top_3 = sets.get_top_k(3);
+		assert(top_3.size() == min<size_t>(3, top.size()));
+		for (size_t i = 0; i < top_3.size(); ++i)
+			assert(top_3[i].numbers == top[i].numbers);
+	};
+
+	number_sets<int> x;
+	assert(x.get_top_k(5).empty());
+
+	ifstream ifile(filename);
+	for (string line; getline(ifile, line); )
+	{
+		try
+		{
+			x.add(line);
+		}
+		catch (exception&)
+		{
+		}
+	}
+	check_top_k(x);
+
+	// shards merged with occurences of more than 1 at a time
+	number_sets<int> y;
+	y.add_batch_mode(filename, 3, 4);
+	y.add_batch_mode(filename, 2, 3);
+	check_top_k(y);
+
+	// the ranking survives a snapshot
+	string snapshot_filename("top_k_snapshot.bin");
+	y.save(snapshot_filename);
+	number_sets<int> z;
+	z.load(snapshot_filename);
+	check_top_k(z);
+	auto y_top = y.get_top_k(10), z_top = z.get_top_k(10);
+	for (size_t i = 0; i < y_top.size(); ++i)
+		assert(y_top[i].numbers == z_top[i].numbers);
+
+	// a set overtaking others one occurence at a time
+	number_sets<int> w;
+	w.add("1");
+	w.add("2");
+	w.add("2");
+	w.add("3");
+	w.add("3");
+	w.add("3");
+	w.add("1");
+	w.add("1");
+	w.add("1");
+	auto w_top = w.get_top_k(3);
+	assert(w_top[0].numbers == vector<int>({ 1 }) && w_top[0].occurences == 4);
+	assert(w_top[1].numbers == vector<int>({ 3 }) && w_top[1].occurences == 3);
+	assert(w_top[2].numbers == vector<int>({ 2 }) && w_top[2].occurences == 2);
+}
+
+// with room for every set the approximation is exact
+// with less room the frequent sets are still found, within their bounds
+void test_heavy_hitters(const string& filename)
+{
+	number_sets<int> exact;
+	exact.add_batch_mode(filename, 2);
+	vector<number_set<int>> exact_sets = get_vec_num_set(exact);
+
+	auto check_exact = [&](const approximate_number_sets<int>& x) {
+		assert(x.get_duplicate_count() == exact.get_duplicate_count());
+		assert(x.get_non_duplicate_count() == exact.get_non_duplicate_count());
+		assert(x.get_invalid_count() == static_cast<int64_t>(exact.get_invalid_inputs().size()));
+		assert(x.get_unmonitored_bound() == 0);
+
+		auto hitters = x.get_heavy_hitters(exact_sets.size() + 1);
+		assert(hitters.size() == exact_sets.size());
+		for (size_t i = 0; i < hitters.size(); ++i)
+		{
+			assert(hitters[i].occurences == exact_sets[i].occurences);
+			assert(hitters[i].min_occurences == hitters[i].occurences);
+			auto found = find_if(exact_sets.begin(), exact_sets.end(), [&](const auto& s) { return s.numbers == hitters[i].numbers; });
+			assert(found != exact_sets.end() && found->occurences == hitters[i].occurences);
+		}
+	};
+
+	approximate_number_sets<int> x(heavy_hitters_config(exact_sets.size() + 1, 1 << 16, 4));
+	ifstream ifile(filename);
+	for (string line; getline(ifile, line); )
+	{
+		try
+		{
+			x.add(line);
+		}
+		catch (exception&)
+		{
+		}
+	}
+	check_exact(x);
+
+	approximate_number_sets<int> y(heavy_hitters_config(exact_sets.size() + 1, 1 << 16, 4));
+	y.add_batch_mode(filename, 3, 3);
+	check_exact(y);
+
+	// 2 frequent sets in a stream of unique ones, more than there is room for
+	approximate_number_sets<int> z(heavy_hitters_config(16, 1 << 10, 4));
+	for (int i = 0; i < 1000; ++i)
+	{
+		z.add(to_string(i) + ", " + to_string(i + 1) + ", -5");
+		if (i % 4 == 0)
+			z.add("1, 2, 3");
+		if (i % 10 == 0)
+			assert(!z.add("4, 5") == (i != 0));
+	}
+
+	auto hitters = z.get_heavy_hitters(2);
+	assert(hitters.size() == 2);
+	assert(hitters[0].numbers == vector<int>({ 1, 2, 3 }) && hitters[0].min_occurences <= 250 && hitters[0].occurences >= 250);
+	assert(hitters[1].numbers == vector<int>({ 4, 5 }) && hitters[1].min_occurences <= 100 && hitters[1].occurences >= 100);
+	assert(z.get_total_count() == 1350);
+	assert(z.get_unmonitored_bound() <= 1350 / 16);
+	assert(z.get_error_bound() >= hitters[0].occurences - 250);
+}
+
+// sets with their numbers in any order are the same set, and are stored sorted
+void test_order_independent_hash(const string& filename)
+{
+	using policy = commutative_hash_policy;
+
+	vector<int> a = { 3, 1, 2 }, b = { 1, 2, 3 }, c = { 1, 1, 2 }, d = { 1, 2, 2 }, e = { 4, 1, 2 };
+	assert(policy::hash(array_ref<int>(a)) == policy::hash(array_ref<int>(b)));
+	assert(policy::hash(array_ref<int>(c)) != policy::hash(array_ref<int>(d)));
+
+	assert(is_permutation_of_sorted(array_ref<int>(b), array_ref<int>(a)));
+	assert(is_permutation_of_sorted(array_ref<int>(b), array_ref<int>(b)));
+	assert(!is_permutation_of_sorted(array_ref<int>(c), array_ref<int>(d)));
+	assert(!is_permutation_of_sorted(array_ref<int>(d), array_ref<int>(c)));
+	assert(!is_permutation_of_sorted(array_ref<int>(b), array_ref<int>(e)));
+	assert(!is_permutation_of_sorted(array_ref<int>(b), array_ref<int>(c)));
+
+	number_sets<int, char, policy> x;
+	assert(x.add("3, 1, 2"));
+	assert(!x.add("1,2,3"));
+	assert(!x.add("2, 3, 1"));
+	assert(x.add("1, 1, 2"));
+	assert(x.add("2, 1, 2"));
+	assert(!x.add("1, 2, 1"));
+	assert(x.get_most_frequent_data().numbers == b && x.get_most_frequent_data().occurences == 3);
+	assert(x.get_duplicate_count() == 5 && x.get_non_duplicate_count() == 1);
+	for (auto set : x.get_data())
+		assert(is_sorted(set.numbers.begin(), set.numbers.end()));
+
+	// batch mode finds the same sets as the default policy
+	number_sets<int> expected;
+	expected.add_batch_mode(filename, 2);
+	number_sets<int, char, policy> y;
+	y.add_batch_mode(filename, 3, 2);
+	assert(get_map_num_set(y) == get_map_num_set(expected));
+	assert(y.get_duplicate_count() == expected.get_duplicate_count() && y.get_non_duplicate_count() == expected.get_non_duplicate_count());
+
+	approximate_number_sets<int, char, policy> z;
+	z.add_batch_mode(filename, 2);
+	auto expected_map = get_map_num_set(expected);
+	for (const auto& hitter : z.get_heavy_hitters(10))
+		assert(expected_map.count(hitter.numbers) && expected_map[hitter.numbers] == hitter.occurences);
+}
+
 void test_non_copyable()
 {
 	 //following code should fail to compile due to being non copyable
@@ -395,6 +1355,24 @@ void generate_large_data_set(const string& filename, int total_lines, int nums_p
 	cout << "Finished generating large data set\n";
 }
 
+void print_stats(const pipeline_stats& stats)
+{
+	auto ms = [](nanoseconds time) { return duration_cast<std::chrono::microseconds>(time).count() / 1000.0; };
+
+	cout << "Batch mode stats: producers-" << stats.producer_count << " shards-" << stats.shard_count << "\n";
+	cout << "  memory (KB): limit-" << stats.memory_limit / 1024 << " max in flight-" << stats.max_bytes_in_flight / 1024
+		<< " batch size-" << stats.batch_bytes / 1024 << "\n";
+	cout << "  stages (ms): setup-" << ms(stats.setup_time) << " produce-" << ms(stats.produce_time)
+		<< " drain-" << ms(stats.drain_time) << " merge-" << ms(stats.merge_time) << " total-" << ms(stats.total_time) << "\n";
+	cout << "  input: " << stats.bytes_per_second() / (1 << 20) << " MB/s " << stats.lines_per_second() << " lines/s"
+		<< " invalid lines-" << stats.producers.invalid_lines << "\n";
+	cout << "  producers (ms, all threads): busy-" << ms(stats.producers.busy_time) << " stalled-" << ms(stats.producers.stall_time) << "\n";
+	cout << "  consumers (ms, all threads): busy-" << ms(stats.consumers.busy_time) << " idle-" << ms(stats.consumers.idle_time)
+		<< " batches-" << stats.consumers.batches << " max queue depth-" << stats.consumers.max_queue_depth << "\n";
+	cout << "  table: sets-" << stats.table.set_count << " load factor-" << stats.table.load_factor
+		<< " probe length avg-" << stats.table.average_probe_length << " max-" << stats.table.max_probe_length << "\n";
+}
+
 void test_large_data_set()
 {
 	string filename = "large_data.txt";
@@ -432,6 +1410,8 @@ void test_large_data_set()
 
 	number_sets<int> sets_batch_mode;
 
+	sets_batch_mode.reserve_for_file(filename);
+	sets_batch_mode.enable_stats();
 	sets_batch_mode.add_batch_mode(filename, 3);
 
 	cout << "Finished\n";
@@ -443,6 +1423,8 @@ void test_large_data_set()
 
 	cout << "Time taken: " << duration_cast<std::chrono::milliseconds>(end - start).count() / 1000.0 << "s\n";
 
+	print_stats(sets_batch_mode.get_stats());
+
 
 	// cross check between single add and batch mode add result
 
@@ -457,6 +1439,85 @@ void test_large_data_set()
 	{
 		cout << "ERROR!!! Results between single add and batch mode add doesn't match.\n";
 	}
+
+
+	cout << "Creating approximate number sets using batch mode\n";
+	start = system_clock::now();
+
+	approximate_number_sets<int> sets_approximate;
+	sets_approximate.add_batch_mode(filename, 3);
+
+	end = system_clock::now();
+
+	cout << "Finished\n";
+	cout << "Estimated duplicates: " << sets_approximate.get_duplicate_count() << " Non duplicates: " << sets_approximate.get_non_duplicate_count() << "\n";
+	cout << "Error bound of occurences: " << sets_approximate.get_error_bound() << "\n";
+	cout << "Time taken: " << duration_cast<std::chrono::milliseconds>(end - start).count() / 1000.0 << "s\n";
+}
+
+// hashes the same sets with both hash policies
+// reports time taken, collisions of the full 64 bit hash,
+// and collisions of the low bits, which is what a hash table bucket sees
+template<typename HashPolicy>
+void benchmark_hash_policy(const string& name, const vector<vector<int>>& all_sets)
+{
+	const int bucket_bits = 20;
+	const uint64_t bucket_mask = (uint64_t(1) << bucket_bits) - 1;
+
+	hasher<int, HashPolicy> hash;
+	vector<uint64_t> hashes;
+	hashes.reserve(all_sets.size());
+
+	system_clock::time_point start = system_clock::now();
+
+	for (const auto& numbers : all_sets)
+		hashes.push_back(hash(numbers));
+
+	system_clock::time_point end = system_clock::now();
+
+	vector<uint64_t> buckets;
+	buckets.reserve(hashes.size());
+	for (uint64_t h : hashes)
+		buckets.push_back(h & bucket_mask);
+
+	auto count_collisions = [](vector<uint64_t>& values) {
+		sort(values.begin(), values.end());
+		return values.size() - (unique(values.begin(), values.end()) - values.begin());
+	};
+
+	// a uniform hash puts n sets into 2^bucket_bits buckets with about n - b * (1 - e^(-n/b)) collisions
+	cout << name << ": time-" << duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0 << "ms"
+		<< " full hash collisions-" << count_collisions(hashes)
+		<< " " << bucket_bits << " bit bucket collisions-" << count_collisions(buckets) << "\n";
+}
+
+void benchmark_hash_policies()
+{
+	vector<vector<int>> all_sets;
+
+	// small dense numbers... where an identity std::hash<int> does worst
+	for (int i = 0; i < 100; ++i)
+		for (int j = i + 1; j < 100; ++j)
+			for (int k = j + 1; k < 100; ++k)
+				all_sets.push_back({ i, j, k });
+
+	// longer sets of random numbers
+	mt19937 gen(5);
+	uniform_int_distribution<int> dist(0, 1'000'000);
+	for (int i = 0; i < 200'000; ++i)
+	{
+		vector<int> numbers(5 + i % 100);
+		for (int& n : numbers)
+			n = dist(gen);
+		sort(numbers.begin(), numbers.end());
+		all_sets.push_back(numbers);
+	}
+
+	cout << "Comparing hash policies on " << all_sets.size() << " sets\n";
+
+	benchmark_hash_policy<combine_hash_policy>("combine_hash_policy", all_sets);
+	benchmark_hash_policy<stripe_hash_policy>("stripe_hash_policy", all_sets);
+	benchmark_hash_policy<commutative_hash_policy>("commutative_hash_policy", all_sets);
 }
 
 void test_number_sets_small_getters(number_sets<int> &x)
@@ -515,6 +1576,143 @@ void test_number_sets_small()
 	test_number_sets_small_getters(x);
 }
 
+// batch mode splits the input file in chunks
+// lines crossing chunk boundaries must be processed exactly once
+void test_batch_mode_chunk_boundaries()
+{
+	string filename("chunk_test.txt");
+
+	ofstream ofile(filename);
+
+	// a few MBs of data, with some very long lines spanning multiple chunks
+	for (int line = 0; line < 50'000; ++line)
+	{
+		int nums_per_line = (line % 5000 == 0) ? 300'000 : 1 + rand() % 20;
+
+		for (int i = 0; i < nums_per_line; ++i)
+		{
+			if (i != 0)
+				ofile << ", ";
+			ofile << rand() % 50;
+		}
+
+		if (line % 1000 == 0)
+			ofile << ", abcd";
+
+		ofile << "\n";
+	}
+
+	ofile << "1, 2, 3"; // no newline at the end of file
+	ofile.close();
+
+	number_sets<int> x;
+	ifstream ifile(filename);
+
+	string line;
+	while (getline(ifile, line))
+	{
+		try
+		{
+			x.add(line);
+		}
+		catch (exception&)
+		{
+		}
+	}
+
+	number_sets<int> y;
+
+	y.add_batch_mode(filename, 4);
+
+	assert(x.get_data().size() == y.get_data().size());
+	assert(x.get_duplicate_count() == y.get_duplicate_count() && x.get_non_duplicate_count() == y.get_non_duplicate_count());
+	assert(x.get_invalid_inputs().size() == y.get_invalid_inputs().size());
+}
+
+// a ring much smaller than the number of values, so that producers block on a full ring
+// and the consumer on an empty one
+void test_mpsc_ring()
+{
+	const int producers_count = 4;
+	const int values_per_producer = 100'000;
+
+	mpsc_ring<unique_ptr<int>> ring(8);
+
+	vector<future<void>> producers;
+	for (int p = 0; p < producers_count; ++p)
+		producers.push_back(async(launch::async, [&ring, p] {
+			for (int i = 0; i < values_per_producer; ++i)
+				ring.push(make_unique<int>(p * values_per_producer + i));
+		}));
+
+	auto consumer = async(launch::async, [&ring] {
+		vector<int> last_seen(producers_count, -1);
+		long long sum = 0;
+		unique_ptr<int> value;
+
+		while (ring.pop(value))
+		{
+			// values of a single producer come out in the order they were pushed
+			int p = *value / values_per_producer;
+			assert(*value > last_seen[p]);
+			last_seen[p] = *value;
+			sum += *value;
+		}
+
+		return sum;
+	});
+
+	for (auto& f : producers)
+		f.get();
+
+	ring.close();
+
+	long long total = static_cast<long long>(producers_count) * values_per_producer;
+	assert(consumer.get() == total * (total - 1) / 2);
+}
+
+// every task runs exactly once, also when one worker is much slower than the others
+// the same pool runs several jobs, exceptions reach the caller
+void test_task_pool()
+{
+	task_pool pool(4);
+
+	for (int job = 0; job < 3; ++job)
+	{
+		const size_t task_count = 1000;
+		vector<atomic<int>> runs(task_count);
+		for (auto& r : runs)
+			r = 0;
+
+		pool.run(task_count, [&](task_pool::task_source& tasks) {
+			size_t task;
+			while (tasks.next(task))
+			{
+				if (tasks.worker_index() == 0)
+					this_thread::sleep_for(chrono::milliseconds(1));
+				++runs[task];
+			}
+		});
+
+		assert(all_of(runs.begin(), runs.end(), [](const atomic<int>& r) { return r == 1; }));
+	}
+
+	try
+	{
+		pool.run(10, [](task_pool::task_source&) { throw runtime_error("job failed"); });
+		assert(false);
+	}
+	catch (runtime_error&)
+	{
+	}
+
+	// nothing to do
+	pool.run(0, [](task_pool::task_source& tasks) {
+		size_t task;
+		assert(!tasks.next(task));
+	});
+}
+
 int main()
 {
 	string filename = "input.txt";
@@ -532,14 +1730,52 @@ int main()
 
 	test_number_sets_small();
 
+	test_batch_mode_chunk_boundaries();
+
+	test_batch_mode_appended();
+
+	test_batch_mode_types();
+
+	test_batch_mode_stats(filename);
+
+	test_batch_mode_memory_limit();
+
+	test_batch_mode_async_reads(filename);
+
+	test_batch_mode_files(filename);
+
+	test_mpsc_ring();
+
+	test_task_pool();
+
 	test_invalid_inputs();
 
+	test_parse_errors();
+
+	test_sort_numbers();
+
 	test_different_integral_types();
 
 	test_different_char_types();
 
 	test_duplicates();
 
+	test_many_unique_sets();
+
+	test_snapshot(filename);
+
+	test_arena_allocator(filename);
+
+	test_merge(filename);
+
+	test_export(filename);
+
+	test_top_k(filename);
+
+	test_heavy_hitters(filename);
+
+	test_order_independent_hash(filename);
+
 	test_non_copyable();
 
 	cout << "Successfully ran all tests.\n";
@@ -548,6 +1784,8 @@ int main()
 	// This is too slow to run in debug mode
 	test_large_data_set();
 
+	benchmark_hash_policies();
+
 #endif // _DEBUG
 
 }
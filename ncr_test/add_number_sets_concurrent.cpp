@@ -1,265 +1,1292 @@
+#include "mpsc_ring.h"
+#include "task_pool.h"
+#include "file_list.h"
+#include "mapped_file.h"
+#include "chunk_reader.h"
+#include "heavy_hitters.h"
 #include "number_sets_impl.h"
 
 #include <array>
 #include <mutex>
-#include <queue>
+#include <atomic>
 #include <future>
 #include <memory>
 #include <thread>
-#include <fstream>
-#include <sstream>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <algorithm>
 #include <functional>
 
 using namespace std;
 using namespace placeholders;
 using namespace ncr_test;
 
+template<typename DataT>
+class batch_pool;
+
+// the numbers of all the sets of a batch are stored back to back in one buffer, the sets are located by their end
+// so a parsed set is only copied once more, into the table, and only if it is new
+template<typename DataT>
 struct batch_content
 {
-	static constexpr int array_size = 5000;
-	vector<vector<int>> num_sets;
-	vector<string> invalid_inputs;
+	using value_type = typename DataT::value_type;
+	using string_type = typename DataT::string_type;
+
+	vector<value_type> numbers;
+	vector<size_t> set_ends; // in numbers, one per set
+	vector<uint64_t> hashes; // of the sets, so that consumers don't hash them again
+	vector<string_type> invalid_inputs;
+	size_t bytes; // of the sets and invalid inputs added, what the batch size is compared with
+	size_t reserved_bytes; // taken from the memory limit when sent, given back once consumed
+	batch_pool<DataT>* pool; // of the producer that filled it, it goes back there once consumed
+
+	batch_content() :
+		bytes(0),
+		reserved_bytes(0),
+		pool(nullptr)
+	{}
+
+	size_t set_count() const { return set_ends.size(); }
+
+	// the memory held by the buffers, which is at least bytes
+	size_t capacity_bytes() const {
+		size_t res = numbers.capacity() * sizeof(value_type) + (set_ends.capacity() + hashes.capacity()) * sizeof(uint64_t) +
+			invalid_inputs.capacity() * sizeof(string_type);
+
+		for (const auto& input : invalid_inputs)
+			res += input.capacity() * sizeof(typename string_type::value_type);
+
+		return res;
+	}
+
+	// keeps the capacity of the buffers
+	void clear() {
+		numbers.clear();
+		set_ends.clear();
+		hashes.clear();
+		invalid_inputs.clear();
+		bytes = 0;
+		reserved_bytes = 0;
+	}
+
+	array_ref<value_type> get_num_set(size_t index) const {
+		size_t begin = index ? set_ends[index - 1] : 0;
+		return array_ref<value_type>(numbers.data() + begin, set_ends[index] - begin);
+	}
 };
 
 // as we know batch data will be frequently passed between objects
 // so making it unique_ptr
-using batch_data = unique_ptr<batch_content>;
+template<typename DataT>
+using batch_data = unique_ptr<batch_content<DataT>>;
+
+
+/*
+	class flow_control
+	batch sizes and backpressure of a run, in bytes of batch content
+	* half of the memory limit is for the batches sent and not consumed yet, the other half for the batches producers hold:
+	  being filled, or back in their pools... the batch size is capped to the share of every one of those
+	* producers reserve the bytes of a batch before sending it, and wait while the sent batches would go over their half
+	  a batch is let through anyway when nothing is in flight, so that a huge line can't stop the run
+	* consumers give the bytes back once a batch is processed, and tune the batch size from their throughput
+	  so that a batch takes about target_batch_time to consume: long enough to amortize the queue, short enough to keep memory low
+*/
+class flow_control : private noncopyable
+{
+	enum : size_t
+	{
+		min_batch_bytes = 16 << 10,
+		initial_batch_bytes = 256 << 10,
+		target_batch_time_ns = 500'000
+	};
+
+	size_t in_flight_limit;
+	size_t max_batch_bytes;
+	atomic<size_t> in_flight;
+	atomic<size_t> max_in_flight;
+	atomic<size_t> batch_bytes;
+	event_count released;
+
+private:
+	bool try_reserve(size_t bytes);
+
+public:
+	// held_batch_count is the most batches producers hold at once
+	flow_control(size_t memory_limit, size_t held_batch_count);
+	// the batch size to fill up to, bytes of batch_content
+	size_t get_batch_bytes() const { return batch_bytes.load(memory_order_relaxed); }
+	// larger contents aren't kept for reuse
+	size_t get_max_batch_bytes() const { return max_batch_bytes; }
+	// the most batches that can be in flight
+	size_t get_max_batch_count() const { return in_flight_limit / min_batch_bytes + 1; }
+	size_t get_max_in_flight() const { return max_in_flight.load(); }
+	// blocks while sending bytes would go over the limit
+	void reserve(size_t bytes);
+	// bytes of a batch consumed in busy_time
+	void release(size_t bytes, stats_clock::duration busy_time);
+};
+
+flow_control::flow_control(size_t memory_limit, size_t held_batch_count) :
+	in_flight_limit(memory_limit / 2),
+	max_batch_bytes(max<size_t>(memory_limit / 2 / max<size_t>(held_batch_count, 1), min_batch_bytes)),
+	in_flight(0),
+	max_in_flight(0),
+	batch_bytes(min<size_t>(initial_batch_bytes, max_batch_bytes))
+{
+}
+
+bool flow_control::try_reserve(size_t bytes)
+{
+	size_t current = in_flight.load();
+
+	while (current == 0 || current + bytes <= in_flight_limit)
+	{
+		if (in_flight.compare_exchange_weak(current, current + bytes))
+		{
+			size_t high = max_in_flight.load();
+			while (high < current + bytes && !max_in_flight.compare_exchange_weak(high, current + bytes))
+				;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void flow_control::reserve(size_t bytes)
+{
+	while (!try_reserve(bytes))
+	{
+		uint32_t key = released.prepare_wait();
+
+		if (try_reserve(bytes))
+		{
+			released.cancel_wait();
+			break;
+		}
+
+		released.wait(key);
+	}
+}
+
+void flow_control::release(size_t bytes, stats_clock::duration busy_time)
+{
+	in_flight -= bytes;
+	released.notify_all();
+
+	auto busy_ns = chrono::duration_cast<chrono::nanoseconds>(busy_time).count();
+	if (busy_ns <= 0)
+		return;
+
+	// smoothed, a single batch slowed down by the table growing shouldn't shrink the next ones much
+	double tuned = static_cast<double>(bytes) / busy_ns * target_batch_time_ns;
+	double smoothed = (3.0 * batch_bytes.load(memory_order_relaxed) + tuned) / 4;
+	batch_bytes.store(static_cast<size_t>(min<double>(max<double>(smoothed, min_batch_bytes), max_batch_bytes)), memory_order_relaxed);
+}
+
+
+/*
+	class batch_pool
+	the batch contents of one producer, recycled with their capacity instead of being freed by consumers
+	* consumers give processed contents back through a lock free ring, only the owning producer takes them out
+	* a content given back while the ring is full, or grown past what the batch size allows, is freed
+	  new ones are allocated while the ring is empty
+	* must outlive the consumers, which may still be giving contents back after the producer is done
+*/
+template<typename DataT>
+class batch_pool : private noncopyable
+{
+	mpsc_ring<batch_data<DataT>> returned;
+	size_t max_content_bytes;
+
+public:
+	// capacity is the most contents kept, of at most max_content_bytes
+	batch_pool(size_t capacity, size_t max_content_bytes);
+	// only to be called from the producer owning the pool
+	batch_data<DataT> acquire();
+	// called from the consumers
+	void release(batch_data<DataT> content);
+};
+
+template<typename DataT>
+batch_pool<DataT>::batch_pool(size_t capacity, size_t _max_content_bytes) :
+	returned(capacity),
+	max_content_bytes(_max_content_bytes)
+{
+}
+
+template<typename DataT>
+batch_data<DataT> batch_pool<DataT>::acquire()
+{
+	batch_data<DataT> content;
+
+	if (returned.try_pop(content))
+		return content;
+
+	// the buffers grow with the first batches, and keep their capacity from then on
+	content = make_unique<batch_content<DataT>>();
+	content->pool = this;
+	return content;
+}
+
+template<typename DataT>
+void batch_pool<DataT>::release(batch_data<DataT> content)
+{
+	content->clear();
+
+	if (content->capacity_bytes() <= max_content_bytes)
+		returned.try_push(content);
+}
+
+
+/*
+	the parts of the pipeline that depend on the data being updated
+	overloaded for number_sets_data and heavy_hitters_data
+*/
+
+template<typename T, typename CharT, typename HashPolicy>
+void consume_invalid_inputs(vector<basic_string<CharT>>&& invalid_inputs, number_sets_data<T, CharT, HashPolicy> &data)
+{
+	data.invalid_inputs.insert(data.invalid_inputs.end(), make_move_iterator(invalid_inputs.begin()), make_move_iterator(invalid_inputs.end()));
+}
+
+template<typename T, typename CharT, typename HashPolicy>
+void consume_invalid_inputs(vector<basic_string<CharT>>&& invalid_inputs, heavy_hitters_data<T, CharT, HashPolicy> &data)
+{
+	data.invalid_count += invalid_inputs.size();
+}
+
+// every shard gets its part of what has been reserved for data
+template<typename T, typename CharT, typename HashPolicy>
+unique_ptr<number_sets_data<T, CharT, HashPolicy>> make_shard(const number_sets_data<T, CharT, HashPolicy> &data, size_t shard_count)
+{
+	auto shard = make_unique<number_sets_data<T, CharT, HashPolicy>>();
+	shard->reserve(data.records.capacity() / shard_count);
+	shard->arena.set_allocator(data.arena.get_allocator());
+	return shard;
+}
+
+template<typename T, typename CharT, typename HashPolicy>
+unique_ptr<heavy_hitters_data<T, CharT, HashPolicy>> make_shard(const heavy_hitters_data<T, CharT, HashPolicy> &data, size_t)
+{
+	return make_unique<heavy_hitters_data<T, CharT, HashPolicy>>(data.config);
+}
+
+template<typename T, typename CharT, typename HashPolicy>
+void merge_shard(number_sets_data<T, CharT, HashPolicy> &&shard, number_sets_data<T, CharT, HashPolicy> &data)
+{
+	merge_number_sets_data(move(shard), data);
+}
+
+template<typename T, typename CharT, typename HashPolicy>
+void merge_shard(heavy_hitters_data<T, CharT, HashPolicy> &&shard, heavy_hitters_data<T, CharT, HashPolicy> &data)
+{
+	merge_heavy_hitters_data(move(shard), data);
+}
+
+template<typename T, typename CharT, typename HashPolicy>
+table_stats get_table_stats(const number_sets_data<T, CharT, HashPolicy> &data)
+{
+	table_stats stats;
+	probe_statistics probes = data.index.get_probe_statistics();
+
+	stats.set_count = data.index.size();
+	stats.slot_count = data.index.capacity();
+	stats.load_factor = stats.slot_count ? static_cast<double>(stats.set_count) / stats.slot_count : 0;
+	stats.average_probe_length = probes.average;
+	stats.max_probe_length = probes.max;
+	return stats;
+}
+
+// the entries of space_saving are the slots, there is no probing
+template<typename T, typename CharT, typename HashPolicy>
+table_stats get_table_stats(const heavy_hitters_data<T, CharT, HashPolicy> &data)
+{
+	table_stats stats;
+
+	stats.set_count = data.frequent.size();
+	stats.slot_count = data.frequent.get_capacity();
+	stats.load_factor = static_cast<double>(stats.set_count) / stats.slot_count;
+	return stats;
+}
 
 
 /*
 	Interface for class consumer
 	responsible for updating the number_sets_data based on the produced numbers
+	DataT is the number_sets_data or heavy_hitters_data type being updated
+	* batches are handed over through a lock free ring, producers only block while it is full
+	  or while the batches in flight would go over the memory limit of flow_control
+	* the consumer thread sleeps while there is nothing to process
 */
+template<typename DataT>
 class consumer
 {
-	static constexpr int max_batch_queue_size = 100'000;
-	queue<batch_data> batch_queue;
-	mutex batch_queue_mutex; // access to batch_queue needs to be syncronized
+	static constexpr size_t max_batch_queue_size = 100'000;
+	mpsc_ring<batch_data<DataT>> batch_queue;
 	future<void> f;
-	atomic<bool> done;
-	number_sets_data<int, char> &data;
+	DataT &data;
+	flow_control &flow;
+	consumer_stats stats;
 
 private:
-	batch_data get_batch();
-	void process_batch(batch_data batch);
+	void process_batch(batch_data<DataT> batch);
 	void job();
 
 public:
-	explicit consumer(number_sets_data<int, char> &_data);
+	consumer(DataT &_data, flow_control &_flow);
 	// will be called from other threads
-	void add_batch(batch_data batch);
-	// signals stopping the thread
+	void add_batch(batch_data<DataT> batch);
+	// signals stopping the thread and waits for it
 	// will only stop once batch_queue is empty
 	// should only be called once all producers have completed their jobs
 	void stop();
+	// only valid once stopped
+	const consumer_stats& get_stats() const { return stats; }
 };
 
 /*
 	Implementation for class consumer
 */
-consumer::consumer(number_sets_data<int, char> &_data) :
-	done(false),
-	data(_data)
+template<typename DataT>
+consumer<DataT>::consumer(DataT &_data, flow_control &_flow) :
+	batch_queue(min(_flow.get_max_batch_count(), max_batch_queue_size)),
+	data(_data),
+	flow(_flow)
 {
-	f = async(bind(&consumer::job, this));
+	f = async(launch::async, bind(&consumer::job, this));
 }
 
-void consumer::add_batch(batch_data batch)
+template<typename DataT>
+void consumer<DataT>::add_batch(batch_data<DataT> batch)
 {
-	lock_guard<mutex> guard(batch_queue_mutex);
-
-	// queue is full
-	// consumer needs to free up some space before we can enqueue new batch
-	while (batch_queue.size() == max_batch_queue_size)
-		this_thread::sleep_for(chrono::milliseconds(100));
-
+	// blocks while the queue is full, until the consumer frees up some space
 	batch_queue.push(move(batch));
 }
 
-void consumer::stop()
+template<typename DataT>
+void consumer<DataT>::stop()
 {
-	done = true;
+	batch_queue.close();
+	f.get();
 }
 
-void consumer::job()
+template<typename DataT>
+void consumer<DataT>::job()
 {
-	while (!done)
+	batch_data<DataT> batch;
+
+	for (auto idle_start = stats_clock::now(); ; )
 	{
-		// call to empty is safe in this case
-		while (!batch_queue.empty())
-			process_batch(get_batch());
+		// the batch about to be popped counts as waiting too
+		stats.max_queue_depth = max(stats.max_queue_depth, batch_queue.size());
+
+		if (!batch_queue.pop(batch))
+			break;
+
+		auto busy_start = stats_clock::now();
+		stats.idle_time += busy_start - idle_start;
+
+		process_batch(move(batch));
+
+		idle_start = stats_clock::now();
+		stats.busy_time += idle_start - busy_start;
 	}
 }
 
-void consumer::process_batch(batch_data batch)
+template<typename DataT>
+void consumer<DataT>::process_batch(batch_data<DataT> batch)
 {
-	for_each(batch->num_sets.begin(), batch->num_sets.end(), bind(consume_number_set<int, char>, _1, ref(data)));
-	data.invalid_inputs.insert(data.invalid_inputs.end(), batch->invalid_inputs.begin(), batch->invalid_inputs.end());
-}
+	auto start = stats_clock::now();
 
-batch_data consumer::get_batch()
-{
-	lock_guard<mutex> guard(batch_queue_mutex);
-	auto res = move(batch_queue.front());
-	batch_queue.pop();
-	return res;
+	++stats.batches;
+	stats.sets += batch->set_count();
+
+	for (size_t i = 0; i < batch->set_count(); ++i)
+		consume_number_set(batch->get_num_set(i), batch->hashes[i], data);
+	consume_invalid_inputs(move(batch->invalid_inputs), data);
+
+	flow.release(batch->reserved_bytes, stats_clock::now() - start);
+
+	batch_pool<DataT>* pool = batch->pool;
+	pool->release(move(batch));
 }
 
 /*
 	* class batch
 	* we will batch a bunch of output produced by producer
 	* and send it to consumer... this will reduce communication between producer and consumer... which can be slow
+	* a batch is sent once it holds the batch size of flow_control, as it was when the batch was started
 */
+template<typename DataT>
 class batch
 {
 private:
-	batch_data data;
-	consumer &single_consumer;
+	using value_type = typename DataT::value_type;
+	using string_type = typename DataT::string_type;
+
+	batch_data<DataT> data;
+	size_t batch_bytes; // data is sent once it holds that many bytes
+	consumer<DataT> &target_consumer;
+	batch_pool<DataT> &pool;
+	flow_control &flow;
+	producer_stats &stats;
 
 private:
 	void init_data();
 	void ensure_space();
+	void send();
 
 public:
-	explicit batch(consumer &_single_consumer);
+	// pool is the one of the producer, data is taken from it
+	batch(consumer<DataT> &_target_consumer, batch_pool<DataT> &_pool, flow_control &_flow, producer_stats &_stats);
 	~batch();
-	void add_num_set(const vector<int>& num_set);
-	void add_invalid_input(const string& invalid_input);
+	// the numbers are appended to the buffer of the batch
+	void add_num_set(const vector<value_type>& num_set, uint64_t hash);
+	void add_invalid_input(string_type&& invalid_input);
 };
 
 /*
 	Implementation for class batch
 */
 
-batch::batch(consumer &_single_consumer) :
-	single_consumer(_single_consumer)
+template<typename DataT>
+batch<DataT>::batch(consumer<DataT> &_target_consumer, batch_pool<DataT> &_pool, flow_control &_flow, producer_stats &_stats) :
+	target_consumer(_target_consumer),
+	pool(_pool),
+	flow(_flow),
+	stats(_stats)
 {
 	init_data();
 }
 
-batch::~batch()
+template<typename DataT>
+batch<DataT>::~batch()
 {
-	if (!data->invalid_inputs.empty() || !data->num_sets.empty())
-		single_consumer.add_batch(move(data));
+	if (!data->invalid_inputs.empty() || data->set_count() != 0)
+		send();
 }
 
-void batch::add_num_set(const vector<int>& num_set)
+template<typename DataT>
+void batch<DataT>::add_num_set(const vector<value_type>& num_set, uint64_t hash)
 {
 	ensure_space();
-	data->num_sets.push_back(num_set);
+	data->numbers.insert(data->numbers.end(), num_set.begin(), num_set.end());
+	data->set_ends.push_back(data->numbers.size());
+	data->hashes.push_back(hash);
+	data->bytes += num_set.size() * sizeof(value_type) + sizeof(size_t) + sizeof(uint64_t);
 }
 
-void batch::add_invalid_input(const string& invalid_input)
+template<typename DataT>
+void batch<DataT>::add_invalid_input(string_type&& invalid_input)
 {
 	ensure_space();
-	data->invalid_inputs.push_back(invalid_input);
+	data->bytes += sizeof(string_type) + invalid_input.size() * sizeof(typename string_type::value_type);
+	data->invalid_inputs.push_back(move(invalid_input));
 }
 
-void batch::ensure_space()
+template<typename DataT>
+void batch<DataT>::ensure_space()
 {
-	if (data->num_sets.size() == batch_content::array_size || data->invalid_inputs.size() == batch_content::array_size)
+	if (data->bytes >= batch_bytes)
 	{
 		// get ready for a new batch
-		single_consumer.add_batch(move(data));
+		send();
 		init_data();
 	}
 }
 
-void batch::init_data()
+// time spent here is time the consumer queue is full, or the memory limit reached
+// the memory actually held is reserved, which the capacity of the buffers may make larger than their content
+template<typename DataT>
+void batch<DataT>::send()
 {
-	data = make_unique<batch_content>();
-	data->num_sets.reserve(batch_content::array_size);
-	data->invalid_inputs.reserve(batch_content::array_size);
+	auto start = stats_clock::now();
+	data->reserved_bytes = data->capacity_bytes();
+	flow.reserve(data->reserved_bytes);
+	target_consumer.add_batch(move(data));
+	stats.stall_time += stats_clock::now() - start;
 }
 
+template<typename DataT>
+void batch<DataT>::init_data()
+{
+	data = pool.acquire();
+	batch_bytes = flow.get_batch_bytes();
+}
+
+/*
+	find_char
+	the first ch in [first, last), nullptr if there is none
+*/
+const char* find_char(const char* first, const char* last, char ch)
+{
+	return static_cast<const char*>(memchr(first, ch, last - first));
+}
+
+template<typename CharT>
+const CharT* find_char(const CharT* first, const CharT* last, CharT ch)
+{
+	const CharT* found = find(first, last, ch);
+	return found != last ? found : nullptr;
+}
+
+
 /*
-	class poll_for_data
-	a secure method for consumer class to get the next string data to process
+	class input_ranges
+	splits a region of the input file in ranges, one per task of the producers
+	* the whole file is memory mapped, ranges point straight into the mapping
+	* the region is cut at fixed size positions, each widened to the next newline, so that each line belongs to exactly one range
+	* there are many more ranges than producers, so that idle producers have something to steal
+	* positions are counted in CharT characters, offsets given to and returned by the class in bytes
 */
-class poll_for_data
+template<typename CharT>
+class input_ranges
 {
-	static constexpr int string_size = 100'000;
-	char raw_string[string_size + 10];
-	ifstream ifile;
-	mutex sync_read_file;
+	enum : size_t
+	{
+		min_range_size = (1 << 16) / sizeof(CharT),
+		max_range_size = (1 << 20) / sizeof(CharT),
+		ranges_per_producer = 16
+	};
+
+	mapped_file file;
+	const CharT* chars;
+	size_t region_begin;
+	size_t region_end;
+	size_t range_size;
+
+private:
+	size_t line_boundary(size_t pos) const;
 
 public:
-	explicit poll_for_data(const string& filename);
-	bool get_data(stringstream &ss);
+	// the range size for a region of region_size characters
+	static size_t range_size_for(size_t region_size, size_t producer_count);
+
+	// the region starts at start_offset, which must be the start of a line
+	// whole_lines_only leaves out a last line not terminated by a newline
+	// fixed_range_size, if not 0, is used instead of the range size for the region
+	input_ranges(const string& filename, size_t producer_count, size_t start_offset, bool whole_lines_only, size_t fixed_range_size = 0);
+	size_t size() const;
+	// offset of the end of the region in the file
+	size_t end_offset() const;
+	// may be empty, if a line longer than the range size started in an earlier range
+	basic_string_ref<CharT> get(size_t index) const;
 };
 
-poll_for_data::poll_for_data(const string& filename) :
-	ifile(filename)
-{}
+template<typename CharT>
+size_t input_ranges<CharT>::range_size_for(size_t region_size, size_t producer_count)
+{
+	size_t size = region_size / (producer_count * ranges_per_producer);
+	return min<size_t>(max<size_t>(size, min_range_size), max_range_size);
+}
 
+template<typename CharT>
+input_ranges<CharT>::input_ranges(const string& filename, size_t producer_count, size_t start_offset, bool whole_lines_only, size_t fixed_range_size) :
+	file(filename),
+	chars(reinterpret_cast<const CharT*>(file.data())),
+	region_begin(start_offset / sizeof(CharT)),
+	region_end(file.size() / sizeof(CharT)) // an incomplete character at the end is left out
+{
+	if (start_offset > file.size())
+		throw runtime_error("File is shorter than the part already processed: " + filename);
 
-bool poll_for_data::get_data(stringstream &ss)
+	// byte order mark of a wide file
+	if (sizeof(CharT) > 1 && region_begin == 0 && region_end != 0 && chars[0] == CharT(0xFEFF))
+		region_begin = 1;
+
+	if (whole_lines_only)
+	{
+		while (region_end != region_begin && chars[region_end - 1] != CharT('\n'))
+			--region_end;
+	}
+
+	range_size = fixed_range_size ? fixed_range_size : range_size_for(region_end - region_begin, producer_count);
+}
+
+template<typename CharT>
+size_t input_ranges<CharT>::size() const
+{
+	return (region_end - region_begin + range_size - 1) / range_size;
+}
+
+template<typename CharT>
+size_t input_ranges<CharT>::end_offset() const
+{
+	return region_end * sizeof(CharT);
+}
+
+// returns the start of the first line beginning at or after pos
+template<typename CharT>
+size_t input_ranges<CharT>::line_boundary(size_t pos) const
+{
+	if (pos <= region_begin || pos >= region_end)
+		return min(max(pos, region_begin), region_end);
+
+	auto found = find_char(chars + pos - 1, chars + region_end, CharT('\n'));
+
+	return found ? static_cast<size_t>(found - chars) + 1 : region_end;
+}
+
+template<typename CharT>
+basic_string_ref<CharT> input_ranges<CharT>::get(size_t index) const
+{
+	size_t begin = line_boundary(region_begin + index * range_size);
+	size_t end = line_boundary(region_begin + (index + 1) * range_size);
+
+	return basic_string_ref<CharT>(chars + begin, chars + max(begin, end));
+}
+
+
+/*
+	class input_files
+	the ranges of several files, as the tasks of a single run of the pipeline
+	* the tasks of the files are numbered one file after the other, every file is cut by its own input_ranges
+	* the range size comes from the size of all the files, so that ranges are alike whatever the size of their file
+	* a file is mapped when the first of its ranges is taken, and unmapped once all of them are done
+	  so that only the files being parsed are open, however many there are
+*/
+template<typename CharT>
+class input_files
 {
-	if (ifile.eof())
-		return false;
+	struct file_ranges
+	{
+		string filename;
+		size_t task_count;
+		mutex open_mutex; // guards ranges
+		unique_ptr<input_ranges<CharT>> ranges;
+		atomic<size_t> tasks_left;
+	};
+
+	vector<unique_ptr<file_ranges>> files; // empty files are left out
+	vector<size_t> first_tasks; // of every file
+	size_t range_size;
+
+public:
+	// throws std::runtime_error if a file doesn't exist
+	input_files(const vector<string>& filenames, size_t producer_count);
+	size_t size() const;
+	// maps the file of task if needed
+	basic_string_ref<CharT> get(size_t task);
+	// the file of task is unmapped after its last task
+	void done(size_t task);
+};
+
+template<typename CharT>
+input_files<CharT>::input_files(const vector<string>& filenames, size_t producer_count)
+{
+	vector<size_t> sizes; // in characters
+	for (const auto& filename : filenames)
+		sizes.push_back(get_file_size(filename) / sizeof(CharT));
+
+	size_t total_size = 0;
+	for (size_t size : sizes)
+		total_size += size;
+
+	range_size = input_ranges<CharT>::range_size_for(total_size, producer_count);
+
+	size_t task = 0;
+	for (size_t i = 0; i < filenames.size(); ++i)
+	{
+		if (sizes[i] == 0)
+			continue;
 
-	lock_guard<mutex> guard(sync_read_file);
+		// at least as many as input_ranges, a byte order mark only makes the region shorter
+		// the ranges past the end of the region are empty
+		auto file = make_unique<file_ranges>();
+		file->filename = filenames[i];
+		file->task_count = (sizes[i] + range_size - 1) / range_size;
+		file->tasks_left = file->task_count;
 
-	ifile.read(raw_string, string_size);
+		first_tasks.push_back(task);
+		task += file->task_count;
+		files.push_back(move(file));
+	}
+}
 
-	raw_string[ifile.gcount()] = '\0';
+template<typename CharT>
+size_t input_files<CharT>::size() const
+{
+	return files.empty() ? 0 : first_tasks.back() + files.back()->task_count;
+}
 
-	string str(raw_string);
+template<typename CharT>
+basic_string_ref<CharT> input_files<CharT>::get(size_t task)
+{
+	size_t index = (upper_bound(first_tasks.begin(), first_tasks.end(), task) - first_tasks.begin()) - 1;
+	file_ranges& file = *files[index];
 
-	// read the rest of line from stream
-	string temp_str;
+	{
+		lock_guard<mutex> guard(file.open_mutex);
+		if (!file.ranges)
+			file.ranges = make_unique<input_ranges<CharT>>(file.filename, 1, 0, false, range_size);
+	}
 
-	if (getline(ifile, temp_str))
-		str += temp_str;
+	return file.ranges->get(task - first_tasks[index]);
+}
 
-	ss = stringstream(str);
+template<typename CharT>
+void input_files<CharT>::done(size_t task)
+{
+	size_t index = (upper_bound(first_tasks.begin(), first_tasks.end(), task) - first_tasks.begin()) - 1;
+	file_ranges& file = *files[index];
 
-	return true;
+	if (--file.tasks_left == 0)
+	{
+		lock_guard<mutex> guard(file.open_mutex);
+		file.ranges.reset();
+	}
 }
 
 
 /*
-	function producer
-	processes strings and generates batch data for consumer to work with
+	class input_chunks
+	the lines of a region of the input files, read by chunk_reader instead of being mapped
+	* chunks come in file order, a line cut by the end of a chunk is completed with the start of the next ones
+	* so a piece of input is the line joined across chunks, followed by the whole lines of a chunk
+	* pieces are taken under a lock, which only covers the search for the first and last newline of a chunk
+	* files are read one after the other, the reader of a file is closed once it is done and its pieces are released
+	* sizes are in bytes, as for input_ranges
 */
-void producer(poll_for_data &poll, consumer &single_consumer)
+template<typename CharT>
+class input_chunks
 {
-	batch data(single_consumer);
-	stringstream ss;
+public:
+	struct piece
+	{
+		basic_string<CharT> joined_line; // with its newline, unless it is the last line of its file
+		basic_string_ref<CharT> lines;
+		file_chunk chunk;
+		size_t file;
+		bool has_chunk;
+	};
 
-	while (poll.get_data(ss))
+private:
+	struct file_reader
 	{
-		string input;
-		while (getline(ss, input))
+		unique_ptr<chunk_reader> reader;
+		size_t pieces_out; // handed out and not released yet
+		bool done; // all its pieces have been taken
+	};
+
+	vector<string> filenames;
+	size_t producer_count;
+	read_options options;
+	bool whole_lines_only;
+
+	mutex readers_mutex; // guards readers, but for the reader of the current file which stays open
+	vector<file_reader> readers;
+
+	mutex sequence_mutex; // guards everything below
+	size_t current; // file being read
+	basic_string<CharT> carry; // the start of the line cut by the end of the last chunk
+	bool skip_byte_order_mark;
+	size_t region_end;
+
+private:
+	void open(size_t file, size_t start_offset);
+	void close_if_released(size_t file);
+
+public:
+	// same parameters as input_ranges, a producer holds one piece at a time
+	input_chunks(const string& filename, size_t producer_count, size_t start_offset, bool whole_lines_only, const read_options& options);
+	// the files are read whole, in order
+	// throws std::runtime_error if a file doesn't exist
+	input_chunks(const vector<string>& filenames, size_t producer_count, const read_options& options);
+	// returns false once the region is done
+	bool next(piece& input);
+	void release(const piece& input);
+	// offset of the end of the region in the last file, once all the pieces have been taken
+	size_t end_offset() const;
+};
+
+template<typename CharT>
+input_chunks<CharT>::input_chunks(const string& filename, size_t _producer_count, size_t start_offset, bool _whole_lines_only, const read_options& _options) :
+	filenames(1, filename),
+	producer_count(_producer_count),
+	options(_options),
+	whole_lines_only(_whole_lines_only),
+	readers(1),
+	current(0)
+{
+	open(0, start_offset);
+}
+
+template<typename CharT>
+input_chunks<CharT>::input_chunks(const vector<string>& _filenames, size_t _producer_count, const read_options& _options) :
+	filenames(_filenames),
+	producer_count(_producer_count),
+	options(_options),
+	whole_lines_only(false),
+	readers(_filenames.size()),
+	current(0),
+	region_end(0)
+{
+	// the next files are opened as they come, this only checks that they exist
+	for (size_t i = 1; i < filenames.size(); ++i)
+		get_file_size(filenames[i]);
+
+	if (!filenames.empty())
+		open(0, 0);
+}
+
+template<typename CharT>
+void input_chunks<CharT>::open(size_t file, size_t start_offset)
+{
+	auto reader = make_unique<chunk_reader>(filenames[file], options);
+
+	if (start_offset > reader->size())
+		throw runtime_error("File is shorter than the part already processed: " + filenames[file]);
+
+	skip_byte_order_mark = sizeof(CharT) > 1 && start_offset == 0;
+	region_end = reader->size() / sizeof(CharT) * sizeof(CharT); // an incomplete character at the end is left out
+
+	reader->start(start_offset, region_end, producer_count);
+
+	lock_guard<mutex> guard(readers_mutex);
+	readers[file].reader = move(reader);
+	readers[file].pieces_out = 0;
+	readers[file].done = false;
+}
+
+// called with readers_mutex held
+template<typename CharT>
+void input_chunks<CharT>::close_if_released(size_t file)
+{
+	if (readers[file].done && readers[file].pieces_out == 0)
+		readers[file].reader.reset();
+}
+
+template<typename CharT>
+bool input_chunks<CharT>::next(piece& input)
+{
+	lock_guard<mutex> guard(sequence_mutex);
+
+	for (;;)
+	{
+		if (current == filenames.size())
+			return false;
+
+		chunk_reader& reader = *readers[current].reader;
+		file_chunk chunk;
+
+		if (!reader.next(chunk))
 		{
-			try
+			// the last line of the file, without newline
+			if (!carry.empty())
 			{
-				data.add_num_set(produce_number_set<int, char>(input));
+				if (whole_lines_only)
+				{
+					region_end -= carry.size() * sizeof(CharT);
+					carry.clear();
+				}
+				else
+				{
+					input.joined_line.swap(carry);
+					carry.clear();
+					input.lines = basic_string_ref<CharT>();
+					input.has_chunk = false;
+					return true;
+				}
 			}
-			catch (...)
+
+			// the last file stays open, for the calls still to come
+			if (current + 1 == filenames.size())
+				return false;
+
 			{
-				data.add_invalid_input(input);
+				lock_guard<mutex> readers_guard(readers_mutex);
+				readers[current].done = true;
+				close_if_released(current);
 			}
+
+			open(++current, 0);
+			continue;
 		}
+
+		const CharT* first = reinterpret_cast<const CharT*>(chunk.data);
+		const CharT* last = first + chunk.size / sizeof(CharT);
+
+		if (skip_byte_order_mark && chunk.index == 0 && first != last && *first == CharT(0xFEFF))
+			++first;
+
+		auto first_newline = find_char(first, last, CharT('\n'));
+		if (!first_newline)
+		{
+			carry.append(first, last);
+			reader.release(chunk);
+			continue;
+		}
+
+		const CharT* last_newline = last - 1;
+		while (*last_newline != CharT('\n'))
+			--last_newline;
+
+		input.joined_line.assign(carry);
+		input.joined_line.append(first, first_newline + 1);
+		input.lines = basic_string_ref<CharT>(first_newline + 1, last_newline + 1);
+		input.chunk = chunk;
+		input.file = current;
+		input.has_chunk = true;
+
+		{
+			lock_guard<mutex> readers_guard(readers_mutex);
+			++readers[current].pieces_out;
+		}
+
+		carry.assign(last_newline + 1, last);
+		return true;
 	}
 }
 
-namespace ncr_test
+template<typename CharT>
+void input_chunks<CharT>::release(const piece& input)
+{
+	if (!input.has_chunk)
+		return;
+
+	// without sequence_mutex, a producer waiting in next() for a chunk may need this buffer
+	lock_guard<mutex> guard(readers_mutex);
+
+	readers[input.file].reader->release(input.chunk);
+	--readers[input.file].pieces_out;
+	close_if_released(input.file);
+}
+
+template<typename CharT>
+size_t input_chunks<CharT>::end_offset() const
+{
+	return region_end;
+}
+
+
+/*
+	function process_range
+	splits a range of the input in lines, and parses them in place
+	every number set goes to the batch of its shard, invalid inputs always go to the first batch
+*/
+template<typename DataT>
+void process_range(const basic_string_ref<typename DataT::char_type>& range, vector<unique_ptr<batch<DataT>>> &batches, producer_stats &stats)
+{
+	using value_type = typename DataT::value_type;
+	using char_type = typename DataT::char_type;
+	using hash_policy = typename DataT::hash_policy;
+
+	const char_type* line_begin = range.begin();
+	vector<value_type> numbers; // reused by every line, copied into the buffer of the batch
+
+	while (line_begin != range.end())
+	{
+		auto line_end = find_char(line_begin, range.end(), char_type('\n'));
+		if (!line_end)
+			line_end = range.end();
+
+		basic_string_ref<char_type> input(line_begin, line_end);
+		++stats.lines;
+
+		// invalid lines are reported without throwing, nothing unwinds here
+		// the set is hashed here, right after being sorted (or parsed, for order independent hashes)
+		// the hash picks the shard and goes along to the consumer
+		uint64_t hash;
+		if (!try_produce_hashed_number_set<value_type, char_type, hash_policy>(input, numbers, hash))
+		{
+			size_t shard = batches.size() == 1 ? 0 : shard_index(hash, batches.size());
+			batches[shard]->add_num_set(numbers, hash);
+		}
+		else
+		{
+			++stats.invalid_lines;
+			batches.front()->add_invalid_input(input.to_string());
+		}
+
+		line_begin = (line_end == range.end()) ? line_end : line_end + 1;
+	}
+}
+
+
+/*
+	function produce
+	takes input until there is none left, overloaded for the mapped and the chunked input
+*/
+
+// ranges of the mapped file are the tasks of the pool
+template<typename DataT>
+void produce(const input_ranges<typename DataT::char_type> &input, task_pool::task_source &tasks, vector<unique_ptr<batch<DataT>>> &batches, producer_stats &stats)
+{
+	size_t task;
+
+	while (tasks.next(task))
+	{
+		auto range = input.get(task);
+		stats.bytes += range.size() * sizeof(typename DataT::char_type);
+		process_range(range, batches, stats);
+	}
+}
+
+// the same for the ranges of several files, which are mapped while they are parsed
+template<typename DataT>
+void produce(input_files<typename DataT::char_type> &input, task_pool::task_source &tasks, vector<unique_ptr<batch<DataT>>> &batches, producer_stats &stats)
+{
+	size_t task;
+
+	while (tasks.next(task))
+	{
+		auto range = input.get(task);
+		stats.bytes += range.size() * sizeof(typename DataT::char_type);
+		process_range(range, batches, stats);
+		input.done(task);
+	}
+}
+
+// pieces come in file order, whichever worker asks first gets the next one
+template<typename DataT>
+void produce(input_chunks<typename DataT::char_type> &input, task_pool::task_source &, vector<unique_ptr<batch<DataT>>> &batches, producer_stats &stats)
 {
-	void add_number_sets_concurrent(const string& filename, number_sets_data<int, char> &data, int producers_count)
+	using char_type = typename DataT::char_type;
+
+	typename input_chunks<char_type>::piece piece;
+
+	while (input.next(piece))
 	{
-		consumer single_consumer(data);
-		poll_for_data poll(filename);
+		basic_string_ref<char_type> joined_line(piece.joined_line.data(), piece.joined_line.data() + piece.joined_line.size());
+		stats.bytes += (joined_line.size() + piece.lines.size()) * sizeof(char_type);
 
-		using future_type = future<void>;
+		process_range(joined_line, batches, stats);
+		process_range(piece.lines, batches, stats);
 
-		vector<future_type> futures(producers_count);
+		input.release(piece);
+	}
+}
 
-		for (int i = 0; i < producers_count; ++i)
-			futures[i] = async(producer, ref(poll), ref(single_consumer));
+/*
+	function producer
+	run by every worker of the task pool
+	generates batch data for consumers to work with, every consumer owns one shard of the number sets
+	batch data is taken from the pool of the worker, where consumers give it back
+*/
+template<typename DataT, typename InputT>
+void producer(InputT &input, task_pool::task_source &tasks, vector<unique_ptr<consumer<DataT>>> &consumers, batch_pool<DataT> &pool, flow_control &flow,
+	producer_stats &stats)
+{
+	auto start = stats_clock::now();
 
-		for_each(futures.begin(), futures.end(), std::bind(&future_type::get, _1));
+	{
+		vector<unique_ptr<batch<DataT>>> batches;
+		for (auto& shard_consumer : consumers)
+			batches.push_back(make_unique<batch<DataT>>(*shard_consumer, pool, flow, stats));
 
-		single_consumer.stop();
+		produce(input, tasks, batches, stats);
 	}
+
+	// the stall time is part of the elapsed time, the batches have been sent by now
+	stats.busy_time += stats_clock::now() - start - stats.stall_time;
+}
+
+// the tasks of the pool
+template<typename CharT>
+size_t task_count(const input_ranges<CharT> &input)
+{
+	return input.size();
+}
+
+template<typename CharT>
+size_t task_count(const input_files<CharT> &input)
+{
+	return input.size();
+}
+
+// none, every worker takes pieces until there are none left
+template<typename CharT>
+size_t task_count(const input_chunks<CharT> &)
+{
+	return 0;
+}
+
+/*
+	function run_pipeline
+	the implementation of add_number_sets_concurrent, for any DataT the parts above are overloaded for
+	and for the mapped or chunked input
+*/
+template<typename DataT, typename InputT>
+void run_pipeline(InputT &input, DataT &data, task_pool &producers, const batch_options& options, stats_clock::time_point start)
+{
+	using data_type = DataT;
+
+	size_t shard_count = static_cast<size_t>(max(options.shard_count, 1));
+
+	// every producer fills a batch per shard, and keeps up to twice as many in its pool
+	// the capacity of their buffers may be up to twice their content, so each counts twice
+	flow_control flow(options.memory_limit, producers.size() * shard_count * 3 * 2);
+
+	// one per worker of the pool, declared first as consumers give batches back to them until they stop
+	vector<unique_ptr<batch_pool<data_type>>> pools;
+	for (size_t i = 0; i < producers.size(); ++i)
+		pools.push_back(make_unique<batch_pool<data_type>>(shard_count, 2 * flow.get_max_batch_bytes()));
+
+	// the first shard consumes straight into data
+	// the others build their own tables, which are merged into data at the end
+	vector<unique_ptr<data_type>> shards_data;
+	vector<unique_ptr<consumer<data_type>>> consumers;
+
+	consumers.push_back(make_unique<consumer<data_type>>(data, flow));
+
+	for (size_t i = 1; i < shard_count; ++i)
+	{
+		shards_data.push_back(make_shard(data, shard_count));
+		consumers.push_back(make_unique<consumer<data_type>>(*shards_data.back(), flow));
+	}
+
+	auto stop_consumers = [&] {
+		for_each(consumers.begin(), consumers.end(), std::bind(&consumer<data_type>::stop, _1));
+	};
+
+	// one per worker of the pool, so that producers don't share counters
+	vector<producer_stats> all_producer_stats(producers.size());
+
+	auto produce_start = stats_clock::now();
+
+	try
+	{
+		producers.run(task_count(input), [&](task_pool::task_source& tasks) {
+			producer<data_type>(input, tasks, consumers, *pools[tasks.worker_index()], flow, all_producer_stats[tasks.worker_index()]);
+		});
+	}
+	catch (...)
+	{
+		// consumers must not be left waiting for batches
+		stop_consumers();
+		throw;
+	}
+
+	auto drain_start = stats_clock::now();
+
+	stop_consumers();
+
+	auto merge_start = stats_clock::now();
+
+	for (auto& shard_data : shards_data)
+		merge_shard(move(*shard_data), data);
+
+	if (options.stats)
+	{
+		pipeline_stats& stats = *options.stats;
+		auto end = stats_clock::now();
+
+		stats = pipeline_stats();
+		stats.producer_count = producers.size();
+		stats.shard_count = consumers.size();
+		stats.memory_limit = options.memory_limit;
+		stats.max_bytes_in_flight = flow.get_max_in_flight();
+		stats.batch_bytes = flow.get_batch_bytes();
+		stats.setup_time = produce_start - start;
+		stats.produce_time = drain_start - produce_start;
+		stats.drain_time = merge_start - drain_start;
+		stats.merge_time = end - merge_start;
+		stats.total_time = end - start;
+
+		for (const auto& worker_stats : all_producer_stats)
+			stats.producers.add(worker_stats);
+
+		for (const auto& shard_consumer : consumers)
+			stats.consumers.add(shard_consumer->get_stats());
+
+		stats.table = get_table_stats(data);
+	}
+}
+
+template<typename DataT>
+size_t run_pipeline(const string& filename, DataT &data, task_pool &producers, const batch_options& options)
+{
+	using char_type = typename DataT::char_type;
+
+	auto start = stats_clock::now();
+
+	// opening the file first, so that a failure doesn't leave running consumers behind
+	if (options.read.async)
+	{
+		input_chunks<char_type> input(filename, producers.size(), options.start_offset, options.whole_lines_only, options.read);
+		run_pipeline(input, data, producers, options, start);
+		return input.end_offset();
+	}
+
+	input_ranges<char_type> input(filename, producers.size(), options.start_offset, options.whole_lines_only);
+	run_pipeline(input, data, producers, options, start);
+	return input.end_offset();
+}
+
+// the consumers and their tables are set up once for all the files
+template<typename DataT>
+void run_pipeline(const vector<string>& filenames, DataT &data, task_pool &producers, const batch_options& options)
+{
+	using char_type = typename DataT::char_type;
+
+	auto start = stats_clock::now();
+
+	if (options.read.async)
+	{
+		input_chunks<char_type> input(filenames, producers.size(), options.read);
+		run_pipeline(input, data, producers, options, start);
+		return;
+	}
+
+	input_files<char_type> input(filenames, producers.size());
+	run_pipeline(input, data, producers, options, start);
+}
+
+namespace ncr_test
+{
+	template<typename T, typename CharT, typename HashPolicy>
+	size_t add_number_sets_concurrent(const string& filename, number_sets_data<T, CharT, HashPolicy> &data, task_pool &producers, const batch_options& options)
+	{
+		return run_pipeline(filename, data, producers, options);
+	}
+
+	template<typename T, typename CharT, typename HashPolicy>
+	size_t add_number_sets_concurrent(const string& filename, heavy_hitters_data<T, CharT, HashPolicy> &data, task_pool &producers, const batch_options& options)
+	{
+		return run_pipeline(filename, data, producers, options);
+	}
+
+	template<typename T, typename CharT, typename HashPolicy>
+	void add_number_sets_concurrent(const vector<string>& filenames, number_sets_data<T, CharT, HashPolicy> &data, task_pool &producers, const batch_options& options)
+	{
+		run_pipeline(filenames, data, producers, options);
+	}
+
+	template<typename T, typename CharT, typename HashPolicy>
+	void add_number_sets_concurrent(const vector<string>& filenames, heavy_hitters_data<T, CharT, HashPolicy> &data, task_pool &producers, const batch_options& options)
+	{
+		run_pipeline(filenames, data, producers, options);
+	}
+
+	// explicit instantiations, for every hash policy and every type accepted by is_fast_parsed
+#define NCR_INSTANTIATE_BATCH_MODE_POLICY(T, CharT, HashPolicy) \
+	template size_t add_number_sets_concurrent(const string&, number_sets_data<T, CharT, HashPolicy>&, task_pool&, const batch_options&); \
+	template size_t add_number_sets_concurrent(const string&, heavy_hitters_data<T, CharT, HashPolicy>&, task_pool&, const batch_options&); \
+	template void add_number_sets_concurrent(const vector<string>&, number_sets_data<T, CharT, HashPolicy>&, task_pool&, const batch_options&); \
+	template void add_number_sets_concurrent(const vector<string>&, heavy_hitters_data<T, CharT, HashPolicy>&, task_pool&, const batch_options&);
+
+#define NCR_INSTANTIATE_BATCH_MODE(T, CharT) \
+	NCR_INSTANTIATE_BATCH_MODE_POLICY(T, CharT, combine_hash_policy) \
+	NCR_INSTANTIATE_BATCH_MODE_POLICY(T, CharT, stripe_hash_policy) \
+	NCR_INSTANTIATE_BATCH_MODE_POLICY(T, CharT, commutative_hash_policy)
+
+#define NCR_INSTANTIATE_BATCH_MODE_CHARS(T) \
+	NCR_INSTANTIATE_BATCH_MODE(T, char) \
+	NCR_INSTANTIATE_BATCH_MODE(T, wchar_t)
+
+	NCR_INSTANTIATE_BATCH_MODE_CHARS(short)
+	NCR_INSTANTIATE_BATCH_MODE_CHARS(unsigned short)
+	NCR_INSTANTIATE_BATCH_MODE_CHARS(int)
+	NCR_INSTANTIATE_BATCH_MODE_CHARS(unsigned int)
+	NCR_INSTANTIATE_BATCH_MODE_CHARS(long)
+	NCR_INSTANTIATE_BATCH_MODE_CHARS(unsigned long)
+	NCR_INSTANTIATE_BATCH_MODE_CHARS(long long)
+	NCR_INSTANTIATE_BATCH_MODE_CHARS(unsigned long long)
+
+#undef NCR_INSTANTIATE_BATCH_MODE_CHARS
+#undef NCR_INSTANTIATE_BATCH_MODE
+#undef NCR_INSTANTIATE_BATCH_MODE_POLICY
 }
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "routines.h"
+#include "task_pool.h"
+#include "file_list.h"
+#include "heavy_hitters.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+
+/*
+	class approximate_number_sets
+	counts number sets like number_sets, in a fixed amount of memory set by heavy_hitters_config
+	* only the most frequent sets are reported, with bounds on their occurences
+	* duplicate and non duplicate counts are estimates, see heavy_hitters.h
+	* meant for feeds with too many unique sets to keep them all
+*/
+
+namespace ncr_test
+{
+	// HashPolicy: see hash_policies.h
+	template<typename T, typename CharT = char, typename HashPolicy = default_hash_policy>
+	class approximate_number_sets
+	{
+	public:
+		using data_type = heavy_hitters_data<T, CharT, HashPolicy>;
+		using string_type = typename data_type::string_type;
+
+	private:
+		data_type data;
+		std::unique_ptr<task_pool> producers; // created by the first add_batch_mode, reused by the next ones
+		read_options file_read_options;
+		std::size_t memory_limit; // of batch mode calls
+
+	private:
+		task_pool& get_producers(int producer_count) {
+			std::size_t thread_count = static_cast<std::size_t>(std::max(producer_count, 1));
+
+			if (!producers || producers->size() != thread_count)
+				producers = std::make_unique<task_pool>(thread_count);
+
+			return *producers;
+		}
+
+		batch_options get_batch_options(int shard_count) {
+			batch_options options;
+			options.shard_count = shard_count;
+			options.read = file_read_options;
+			options.memory_limit = memory_limit;
+			return options;
+		}
+
+	public:
+
+		/*
+			ctors
+		*/
+
+		explicit approximate_number_sets(const heavy_hitters_config& config = heavy_hitters_config()) :
+			data(config),
+			memory_limit(batch_options::default_memory_limit)
+		{
+			static_assert(std::is_integral<T>::value, "Integral type required.");
+		}
+
+		/*
+			Modifiers
+		*/
+
+		// returns false for an estimated duplicate... true otherwise
+		// throws std::runtime_error for invalid input, which is counted
+		bool add(const string_type& input) {
+			std::vector<T> numbers;
+			uint64_t hash;
+
+			if (try_produce_hashed_number_set<T, CharT, HashPolicy>(input, numbers, hash))
+			{
+				data.invalid_count++;
+				throw std::runtime_error("Invalid input");
+			}
+
+			return consume_number_set(numbers, hash, data);
+		}
+
+		// same as number_sets::add_batch_mode
+		// every shard has its own memory of the size given by the config
+		// supported for the T and CharT accepted by is_fast_parsed, see add_number_sets_concurrent for the file format
+		void add_batch_mode(const std::string& filename, int producer_count, int shard_count = 1) {
+			static_assert(is_fast_parsed<T, CharT>::value, "batch mode needs CharT = char or wchar_t, and an integral T other than character types");
+			add_number_sets_concurrent(filename, data, get_producers(producer_count), get_batch_options(shard_count));
+		}
+
+		// same as number_sets::add_batch_mode_files
+		void add_batch_mode_files(const std::vector<std::string>& filenames, int producer_count, int shard_count = 1) {
+			static_assert(is_fast_parsed<T, CharT>::value, "batch mode needs CharT = char or wchar_t, and an integral T other than character types");
+			add_number_sets_concurrent(filenames, data, get_producers(producer_count), get_batch_options(shard_count));
+		}
+
+		// same as number_sets::set_read_options
+		void set_read_options(const read_options& read) {
+			file_read_options = read;
+		}
+
+		// same as number_sets::set_memory_limit
+		void set_memory_limit(std::size_t bytes) {
+			memory_limit = bytes;
+		}
+
+		void clear() {
+			data.clear();
+		}
+
+		/*
+			getters
+		*/
+
+		// the k most frequent sets, most frequent first
+		// a set occuring more than get_total_count() / capacity times is always among them, if k is large enough
+		std::vector<heavy_hitter<T>> get_heavy_hitters(std::size_t k) const {
+			return ::ncr_test::get_heavy_hitters(data, k);
+		}
+		// the most occurences a set not among the heavy hitters may have
+		int get_unmonitored_bound() const {
+			return data.frequent.get_unmonitored_bound();
+		}
+		// the most an occurence estimate of the sketch overcounts, with probability 1 - e^-sketch_depth
+		uint64_t get_error_bound() const {
+			return data.sketch.error_bound();
+		}
+		int64_t get_duplicate_count() const {
+			return data.duplicate_count;
+		}
+		int64_t get_non_duplicate_count() const {
+			return data.non_duplicate_count;
+		}
+		int64_t get_invalid_count() const {
+			return data.invalid_count;
+		}
+		// all the valid sets added, duplicates included
+		uint64_t get_total_count() const {
+			return data.sketch.get_total();
+		}
+	};
+}
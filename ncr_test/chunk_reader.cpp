@@ -0,0 +1,667 @@
+#include "chunk_reader.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+// io_uring is used through its system calls, so that no library is needed
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define NCR_IO_URING
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
+using namespace std;
+
+namespace ncr_test
+{
+	/*
+		struct io_ring
+		the submission and completion queues of an io_uring instance, mapped from the kernel
+		* only the ring thread touches it
+		* reads are submitted as readv, supported by every kernel with io_uring
+	*/
+
+#ifdef NCR_IO_URING
+
+	struct chunk_reader::io_ring : private noncopyable
+	{
+		int ring_descriptor;
+		bool single_mapping;
+
+		void* sq_ring;
+		size_t sq_ring_size;
+		void* cq_ring;
+		size_t cq_ring_size;
+		io_uring_sqe* sqes;
+		size_t sqes_size;
+
+		unsigned* sq_tail;
+		unsigned* sq_mask;
+		unsigned* sq_array;
+		unsigned* cq_head;
+		unsigned* cq_tail;
+		unsigned* cq_mask;
+		io_uring_cqe* cqes;
+
+		vector<iovec> iovecs; // one per buffer, the kernel reads it until the read completes
+		unsigned in_flight;
+		unsigned to_submit;
+
+		explicit io_ring(size_t buffer_count) :
+			ring_descriptor(-1),
+			single_mapping(false),
+			sq_ring(MAP_FAILED),
+			sq_ring_size(0),
+			cq_ring(MAP_FAILED),
+			cq_ring_size(0),
+			sqes(static_cast<io_uring_sqe*>(MAP_FAILED)),
+			sqes_size(0),
+			iovecs(buffer_count),
+			in_flight(0),
+			to_submit(0)
+		{}
+
+		~io_ring() {
+			if (sqes != MAP_FAILED)
+				munmap(sqes, sqes_size);
+			if (cq_ring != MAP_FAILED && !single_mapping)
+				munmap(cq_ring, cq_ring_size);
+			if (sq_ring != MAP_FAILED)
+				munmap(sq_ring, sq_ring_size);
+			if (ring_descriptor != -1)
+				::close(ring_descriptor);
+		}
+
+		// false if io_uring isn't available, e.g. an old kernel or a sandbox not allowing it
+		bool setup(unsigned entries) {
+			io_uring_params params;
+			memset(&params, 0, sizeof(params));
+
+			ring_descriptor = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+			if (ring_descriptor < 0)
+			{
+				ring_descriptor = -1;
+				return false;
+			}
+
+			sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+			cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+#ifdef IORING_FEAT_SINGLE_MMAP
+			single_mapping = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+#endif
+
+			if (single_mapping)
+				sq_ring_size = cq_ring_size = max(sq_ring_size, cq_ring_size);
+
+			sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_descriptor, IORING_OFF_SQ_RING);
+			if (sq_ring == MAP_FAILED)
+				return false;
+
+			cq_ring = single_mapping ? sq_ring :
+				mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_descriptor, IORING_OFF_CQ_RING);
+			if (cq_ring == MAP_FAILED)
+				return false;
+
+			sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+			sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_descriptor, IORING_OFF_SQES));
+			if (sqes == MAP_FAILED)
+				return false;
+
+			char* sq = static_cast<char*>(sq_ring);
+			char* cq = static_cast<char*>(cq_ring);
+
+			sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+			sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+			sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+			cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+			cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+			cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+			cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+			return true;
+		}
+
+		// queues a read into buffer, submitted by the next call to enter
+		void push_read(int file, size_t buffer, char* target, size_t offset, size_t size) {
+			unsigned tail = *sq_tail;
+			unsigned index = tail & *sq_mask;
+
+			iovecs[buffer].iov_base = target;
+			iovecs[buffer].iov_len = size;
+
+			io_uring_sqe& sqe = sqes[index];
+			memset(&sqe, 0, sizeof(sqe));
+			sqe.opcode = IORING_OP_READV;
+			sqe.fd = file;
+			sqe.addr = reinterpret_cast<uint64_t>(&iovecs[buffer]);
+			sqe.len = 1;
+			sqe.off = offset;
+			sqe.user_data = buffer;
+
+			sq_array[index] = index;
+
+			// the kernel must see the entry before the new tail
+			__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+			++in_flight;
+			++to_submit;
+		}
+
+		// submits the queued reads, and waits for at least one completion
+		bool enter() {
+			for (;;)
+			{
+				long submitted = syscall(__NR_io_uring_enter, ring_descriptor, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+
+				if (submitted >= 0)
+				{
+					to_submit -= static_cast<unsigned>(submitted);
+					return true;
+				}
+
+				if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+					return false;
+			}
+		}
+
+		// calls on_complete(buffer, result) for every completed read
+		template<typename OnComplete>
+		void reap(OnComplete on_complete) {
+			unsigned head = *cq_head;
+			unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+			for (; head != tail; ++head)
+			{
+				const io_uring_cqe& cqe = cqes[head & *cq_mask];
+				--in_flight;
+				on_complete(static_cast<size_t>(cqe.user_data), cqe.res);
+			}
+
+			__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+		}
+	};
+
+#else
+
+	struct chunk_reader::io_ring
+	{};
+
+#endif
+
+
+	/*
+		Implementation for class chunk_reader
+	*/
+
+	void chunk_reader::aligned_delete::operator()(char* p) const
+	{
+#ifdef _WIN32
+		_aligned_free(p);
+#else
+		free(p);
+#endif
+	}
+
+#ifdef _WIN32
+
+	chunk_reader::chunk_reader(const string& _filename, const read_options& _options) :
+		file_handle(INVALID_HANDLE_VALUE),
+		filename(_filename),
+		content_size(0),
+		options(_options),
+		aligned_begin(0),
+		region_begin(0),
+		region_end(0),
+		chunk_count(0),
+		next_read(0),
+		next_chunk(0),
+		stopping(false),
+		failed(false)
+	{
+		DWORD flags = FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN | (options.direct_io ? FILE_FLAG_NO_BUFFERING : 0);
+		file_handle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, flags, nullptr);
+
+		if (file_handle == INVALID_HANDLE_VALUE)
+			throw runtime_error("Unable to open file: " + filename);
+
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(file_handle, &file_size))
+		{
+			close();
+			throw runtime_error("Unable to get file size: " + filename);
+		}
+
+		content_size = static_cast<size_t>(file_size.QuadPart);
+	}
+
+	void chunk_reader::close()
+	{
+		if (file_handle != INVALID_HANDLE_VALUE)
+			CloseHandle(file_handle);
+
+		file_handle = INVALID_HANDLE_VALUE;
+	}
+
+	// the handle is overlapped, so that reads of several threads don't wait for each other
+	bool chunk_reader::read_at(char* target, size_t offset, size_t size, size_t min_size)
+	{
+		HANDLE event = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+		if (!event)
+			return false;
+
+		size_t done = 0;
+		bool ok = true;
+
+		while (ok && done < size)
+		{
+			OVERLAPPED overlapped;
+			memset(&overlapped, 0, sizeof(overlapped));
+			overlapped.Offset = static_cast<DWORD>(static_cast<uint64_t>(offset + done) & 0xFFFFFFFF);
+			overlapped.OffsetHigh = static_cast<DWORD>(static_cast<uint64_t>(offset + done) >> 32);
+			overlapped.hEvent = event;
+
+			DWORD read = 0;
+			if (!ReadFile(file_handle, target + done, static_cast<DWORD>(min<size_t>(size - done, 1 << 30)), nullptr, &overlapped) &&
+				GetLastError() != ERROR_IO_PENDING)
+			{
+				ok = GetLastError() == ERROR_HANDLE_EOF;
+				break;
+			}
+
+			if (!GetOverlappedResult(file_handle, &overlapped, &read, TRUE))
+			{
+				ok = GetLastError() == ERROR_HANDLE_EOF;
+				break;
+			}
+
+			if (read == 0)
+				break;
+
+			done += read;
+		}
+
+		CloseHandle(event);
+		return ok && done >= min_size;
+	}
+
+#else
+
+	chunk_reader::chunk_reader(const string& _filename, const read_options& _options) :
+		file_descriptor(-1),
+		filename(_filename),
+		content_size(0),
+		options(_options),
+		aligned_begin(0),
+		region_begin(0),
+		region_end(0),
+		chunk_count(0),
+		next_read(0),
+		next_chunk(0),
+		stopping(false),
+		failed(false)
+	{
+		int flags = O_RDONLY;
+#ifdef O_DIRECT
+		if (options.direct_io)
+			flags |= O_DIRECT;
+#endif
+
+		file_descriptor = open(filename.c_str(), flags);
+
+		// file systems without direct io, e.g. tmpfs, refuse the flag
+		if (file_descriptor == -1 && flags != O_RDONLY && errno == EINVAL)
+			file_descriptor = open(filename.c_str(), O_RDONLY);
+
+		if (file_descriptor == -1)
+			throw runtime_error("Unable to open file: " + filename);
+
+		struct stat file_stat;
+		if (fstat(file_descriptor, &file_stat) == -1)
+		{
+			close();
+			throw runtime_error("Unable to get file size: " + filename);
+		}
+
+		content_size = static_cast<size_t>(file_stat.st_size);
+
+#ifdef POSIX_FADV_SEQUENTIAL
+		posix_fadvise(file_descriptor, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	}
+
+	void chunk_reader::close()
+	{
+		if (file_descriptor != -1)
+			::close(file_descriptor);
+
+		file_descriptor = -1;
+	}
+
+	bool chunk_reader::read_at(char* target, size_t offset, size_t size, size_t min_size)
+	{
+		size_t done = 0;
+
+		while (done < size)
+		{
+			ssize_t read = pread(file_descriptor, target + done, size - done, static_cast<off_t>(offset + done));
+
+			if (read < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return false;
+			}
+
+			if (read == 0)
+				break;
+
+			done += static_cast<size_t>(read);
+		}
+
+		return done >= min_size;
+	}
+
+#endif
+
+	chunk_reader::~chunk_reader()
+	{
+		stop();
+		ring.reset();
+		close();
+	}
+
+	void chunk_reader::stop()
+	{
+		{
+			lock_guard<mutex> guard(state_mutex);
+			stopping = true;
+		}
+
+		buffer_freed.notify_all();
+		chunk_filled.notify_all();
+
+		for (auto& reader_thread : threads)
+			reader_thread.join();
+
+		threads.clear();
+	}
+
+	void chunk_reader::start(size_t begin, size_t end, size_t extra_buffers)
+	{
+		size_t chunk_size = max<size_t>(options.chunk_size, read_alignment);
+		options.chunk_size = (chunk_size + read_alignment - 1) / read_alignment * read_alignment;
+		options.queue_depth = max<size_t>(options.queue_depth, 1);
+
+		region_begin = begin;
+		region_end = max(begin, min(end, content_size));
+		aligned_begin = begin - begin % read_alignment;
+		chunk_count = region_end > region_begin ? (region_end - aligned_begin + options.chunk_size - 1) / options.chunk_size : 0;
+
+		if (chunk_count == 0)
+			return;
+
+		// enough buffers for every read in flight while the caller holds extra_buffers chunks
+		// so reading never waits for a chunk that can only be released after it
+		size_t buffer_count = min(chunk_count, options.queue_depth + extra_buffers);
+
+		buffers.resize(buffer_count);
+		for (auto& target : buffers)
+		{
+#ifdef _WIN32
+			char* data = static_cast<char*>(_aligned_malloc(options.chunk_size, read_alignment));
+#else
+			void* data = nullptr;
+			if (posix_memalign(&data, read_alignment, options.chunk_size) != 0)
+				data = nullptr;
+#endif
+			if (!data)
+				throw bad_alloc();
+
+			target.data.reset(static_cast<char*>(data));
+			target.state = buffer_state::free;
+			target.chunk = 0;
+			target.done = 0;
+		}
+
+		if (start_ring())
+		{
+			threads.emplace_back(&chunk_reader::ring_loop, this);
+			return;
+		}
+
+		for (size_t i = 0; i < min(options.queue_depth, chunk_count); ++i)
+			threads.emplace_back(&chunk_reader::reader_loop, this);
+	}
+
+	size_t chunk_reader::chunk_offset(size_t chunk) const
+	{
+		return aligned_begin + chunk * options.chunk_size;
+	}
+
+	// rounded up to the alignment, reading past the end of the file is fine
+	size_t chunk_reader::chunk_read_size(size_t chunk) const
+	{
+		size_t needed = min(options.chunk_size, region_end - chunk_offset(chunk));
+		return min(options.chunk_size, (needed + read_alignment - 1) / read_alignment * read_alignment);
+	}
+
+	// state_mutex must be held
+	bool chunk_reader::take_free_buffer(size_t &index)
+	{
+		if (next_read == chunk_count)
+			return false;
+
+		for (index = 0; index < buffers.size(); ++index)
+		{
+			if (buffers[index].state == buffer_state::free)
+			{
+				buffers[index].state = buffer_state::reading;
+				buffers[index].chunk = next_read++;
+				buffers[index].done = 0;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void chunk_reader::finish_read(size_t index, bool ok)
+	{
+		{
+			lock_guard<mutex> guard(state_mutex);
+
+			if (ok)
+				buffers[index].state = buffer_state::filled;
+			else
+				failed = true;
+		}
+
+		chunk_filled.notify_all();
+	}
+
+	// run by every reader thread, when io_uring isn't available
+	void chunk_reader::reader_loop()
+	{
+		for (;;)
+		{
+			size_t index;
+
+			{
+				unique_lock<mutex> lock(state_mutex);
+				buffer_freed.wait(lock, [this] {
+					return stopping || failed || next_read == chunk_count ||
+						any_of(buffers.begin(), buffers.end(), [](const buffer& b) { return b.state == buffer_state::free; });
+				});
+
+				if (stopping || failed || !take_free_buffer(index))
+					return;
+			}
+
+			size_t chunk = buffers[index].chunk;
+			size_t min_size = min(options.chunk_size, region_end - chunk_offset(chunk));
+
+			finish_read(index, read_at(buffers[index].data.get(), chunk_offset(chunk), chunk_read_size(chunk), min_size));
+		}
+	}
+
+#ifdef NCR_IO_URING
+
+	bool chunk_reader::start_ring()
+	{
+		ring = make_unique<io_ring>(buffers.size());
+
+		if (!ring->setup(static_cast<unsigned>(options.queue_depth)))
+		{
+			ring.reset();
+			return false;
+		}
+
+		return true;
+	}
+
+	// the only thread submitting reads and reaping their completions
+	// reads are only queued while there are free buffers, the thread sleeps when there is nothing in flight
+	void chunk_reader::ring_loop()
+	{
+		for (;;)
+		{
+			{
+				unique_lock<mutex> lock(state_mutex);
+
+				if (ring->in_flight == 0)
+				{
+					buffer_freed.wait(lock, [this] {
+						return stopping || failed || next_read == chunk_count ||
+							any_of(buffers.begin(), buffers.end(), [](const buffer& b) { return b.state == buffer_state::free; });
+					});
+				}
+
+				size_t index;
+				while (!stopping && !failed && ring->in_flight < options.queue_depth && take_free_buffer(index))
+				{
+					size_t chunk = buffers[index].chunk;
+					ring->push_read(file_descriptor, index, buffers[index].data.get(), chunk_offset(chunk), chunk_read_size(chunk));
+				}
+
+				// reads in flight are always waited for, the kernel writes into the buffers until they complete
+				if (ring->in_flight == 0)
+				{
+					if (stopping || failed || next_read == chunk_count)
+						return;
+					continue;
+				}
+			}
+
+			if (!ring->enter())
+			{
+				// nothing queued reached the kernel
+				ring->in_flight -= ring->to_submit;
+				ring->to_submit = 0;
+
+				{
+					lock_guard<mutex> guard(state_mutex);
+					failed = true;
+				}
+
+				chunk_filled.notify_all();
+
+				if (ring->in_flight == 0)
+					return;
+				continue;
+			}
+
+			ring->reap([this](size_t index, int result) {
+				buffer& target = buffers[index];
+				size_t chunk_size = chunk_read_size(target.chunk);
+				size_t min_size = min(options.chunk_size, region_end - chunk_offset(target.chunk));
+
+				if (result > 0)
+					target.done += static_cast<size_t>(result);
+
+				// a short read before the end of the region is continued
+				if (result > 0 && target.done < min_size)
+				{
+					ring->push_read(file_descriptor, index, target.data.get() + target.done,
+						chunk_offset(target.chunk) + target.done, chunk_size - target.done);
+					return;
+				}
+
+				finish_read(index, result >= 0 && target.done >= min_size);
+			});
+		}
+	}
+
+#else
+
+	bool chunk_reader::start_ring()
+	{
+		return false;
+	}
+
+	void chunk_reader::ring_loop()
+	{}
+
+#endif
+
+	bool chunk_reader::next(file_chunk &chunk)
+	{
+		unique_lock<mutex> lock(state_mutex);
+
+		if (next_chunk == chunk_count)
+			return false;
+
+		size_t index = 0;
+		auto is_filled = [&] {
+			for (index = 0; index < buffers.size(); ++index)
+				if (buffers[index].state == buffer_state::filled && buffers[index].chunk == next_chunk)
+					return true;
+			return false;
+		};
+
+		chunk_filled.wait(lock, [&] { return failed || is_filled(); });
+
+		if (failed)
+			throw runtime_error("Unable to read file: " + filename);
+
+		buffers[index].state = buffer_state::handed_out;
+
+		size_t offset = chunk_offset(next_chunk);
+		size_t begin = max(offset, region_begin);
+		size_t end = min(offset + options.chunk_size, region_end);
+
+		chunk.data = buffers[index].data.get() + (begin - offset);
+		chunk.size = end - begin;
+		chunk.index = next_chunk++;
+		chunk.buffer = index;
+
+		return true;
+	}
+
+	void chunk_reader::release(const file_chunk &chunk)
+	{
+		{
+			lock_guard<mutex> guard(state_mutex);
+			buffers[chunk.buffer].state = buffer_state::free;
+		}
+
+		buffer_freed.notify_one();
+	}
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "routines.h"
+
+#include <mutex>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstddef>
+#include <condition_variable>
+
+/*
+	class chunk_reader
+	reads a region of a file in large chunks, with several reads in flight
+	* the alternative to mapped_file, for storage where a single outstanding read (or page fault) can't keep the device busy
+	* chunks are read ahead into a fixed set of buffers, and handed out in file order... a buffer is reused once released
+	* reads go through io_uring on linux, and through reader threads doing positioned reads where it isn't available
+	* reads are aligned to read_alignment in the file and in memory, so that the file can be opened for direct io
+*/
+
+namespace ncr_test
+{
+	struct read_options
+	{
+		bool async; // the batch mode reads the file with chunk_reader, instead of mapping it
+		std::size_t chunk_size; // bytes per read, rounded up to a multiple of read_alignment
+		std::size_t queue_depth; // reads in flight
+		bool direct_io; // bypasses the page cache, if the file system supports it
+
+		read_options() :
+			async(false),
+			chunk_size(4 << 20),
+			queue_depth(4),
+			direct_io(false)
+		{}
+	};
+
+	// a chunk handed out by chunk_reader, valid until released
+	struct file_chunk
+	{
+		const char* data;
+		std::size_t size;
+		std::size_t index; // of the chunk in the region
+		std::size_t buffer;
+	};
+
+	class chunk_reader : private noncopyable
+	{
+	public:
+		enum : std::size_t { read_alignment = 4096 };
+
+	private:
+		enum class buffer_state { free, reading, filled, handed_out };
+
+		struct aligned_delete
+		{
+			void operator()(char* p) const;
+		};
+
+		struct buffer
+		{
+			std::unique_ptr<char, aligned_delete> data;
+			buffer_state state;
+			std::size_t chunk;
+			std::size_t done; // bytes read so far
+		};
+
+		struct io_ring; // io_uring state, see chunk_reader.cpp
+
+#ifdef _WIN32
+		void* file_handle;
+#else
+		int file_descriptor;
+#endif
+		std::string filename;
+		std::size_t content_size;
+		read_options options;
+
+		std::size_t aligned_begin; // region_begin rounded down to read_alignment
+		std::size_t region_begin;
+		std::size_t region_end;
+		std::size_t chunk_count;
+
+		std::vector<buffer> buffers;
+		std::unique_ptr<io_ring> ring;
+		std::vector<std::thread> threads;
+
+		std::mutex state_mutex; // guards everything below
+		std::condition_variable chunk_filled;
+		std::condition_variable buffer_freed;
+		std::size_t next_read; // chunk to be read next
+		std::size_t next_chunk; // chunk to be handed out next
+		bool stopping;
+		bool failed;
+
+	private:
+		void close();
+		void stop();
+
+		std::size_t chunk_offset(std::size_t chunk) const;
+		std::size_t chunk_read_size(std::size_t chunk) const;
+		bool take_free_buffer(std::size_t &index);
+		void finish_read(std::size_t index, bool ok);
+
+		bool read_at(char* target, std::size_t offset, std::size_t size, std::size_t min_size);
+		void reader_loop();
+		bool start_ring();
+		void ring_loop();
+
+	public:
+		// throws std::runtime_error if the file can't be opened
+		chunk_reader(const std::string& _filename, const read_options& _options);
+		~chunk_reader();
+
+		std::size_t size() const { return content_size; }
+
+		// starts reading [begin, end) of the file, once
+		// extra_buffers are the chunks the caller may hold at the same time, on top of the reads in flight
+		void start(std::size_t begin, std::size_t end, std::size_t extra_buffers);
+
+		// waits for the next chunk in file order
+		// returns false after the last one, throws std::runtime_error if a read failed
+		bool next(file_chunk &chunk);
+
+		// the buffer of chunk can be read into again
+		void release(const file_chunk &chunk);
+	};
+}
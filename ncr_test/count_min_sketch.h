@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+/*
+	class count_min_sketch
+	approximate occurences of keys in a fixed depth x width table of counters
+	* a key is counted in one counter per row, its estimate is the smallest of them
+	* estimates never undercount, and overcount by at most e / width * total with probability 1 - e^-depth
+	* conservative update: only counters below the new estimate are raised, which keeps overcounting lower
+	* keys are the 64 bit hashes of the sets, the row positions are derived from it by double hashing
+*/
+
+// source: Cormode, Muthukrishnan "An Improved Data Stream Summary: The Count-Min Sketch and its Applications"
+
+namespace ncr_test
+{
+	class count_min_sketch
+	{
+		std::vector<uint32_t> counters; // depth rows of width counters
+		std::size_t width; // a power of two
+		std::size_t depth;
+		uint64_t total; // sum of all counts added
+
+	private:
+		// murmur3 finalizer, the second hash of the double hashing
+		static uint64_t mix(uint64_t hash) {
+			hash ^= hash >> 33;
+			hash *= 0xff51afd7ed558ccdull;
+			hash ^= hash >> 33;
+			hash *= 0xc4ceb9fe1a85ec53ull;
+			hash ^= hash >> 33;
+			return hash;
+		}
+
+		std::size_t position(uint64_t hash, uint64_t step, std::size_t row) const {
+			return row * width + (static_cast<std::size_t>(hash + row * step) & (width - 1));
+		}
+
+	public:
+		// width is rounded up to a power of two
+		count_min_sketch(std::size_t _width, std::size_t _depth) :
+			width(1),
+			depth(std::max<std::size_t>(_depth, 1)),
+			total(0)
+		{
+			while (width < _width)
+				width *= 2;
+
+			counters.assign(width * depth, 0);
+		}
+
+		// adds count occurences of the key
+		// returns the estimate of the key before adding them
+		uint32_t add(uint64_t hash, uint32_t count) {
+			uint64_t step = mix(hash) | 1;
+
+			uint32_t prev = UINT32_MAX;
+			for (std::size_t row = 0; row < depth; ++row)
+				prev = std::min(prev, counters[position(hash, step, row)]);
+
+			uint32_t estimate = prev + count;
+			for (std::size_t row = 0; row < depth; ++row)
+			{
+				uint32_t& counter = counters[position(hash, step, row)];
+				counter = std::max(counter, estimate);
+			}
+
+			total += count;
+			return prev;
+		}
+
+		uint32_t estimate(uint64_t hash) const {
+			uint64_t step = mix(hash) | 1;
+
+			uint32_t res = UINT32_MAX;
+			for (std::size_t row = 0; row < depth; ++row)
+				res = std::min(res, counters[position(hash, step, row)]);
+
+			return res;
+		}
+
+		// adds the counters of other, which must have the same width and depth
+		// the result is a valid sketch of both streams
+		void merge(const count_min_sketch& other) {
+			for (std::size_t i = 0; i < counters.size(); ++i)
+				counters[i] += other.counters[i];
+
+			total += other.total;
+		}
+
+		// the overcount of an estimate, exceeded with probability e^-depth at most
+		uint64_t error_bound() const {
+			return static_cast<uint64_t>(std::ceil(std::exp(1.0) * total / width));
+		}
+
+		uint64_t get_total() const { return total; }
+		std::size_t get_width() const { return width; }
+		std::size_t get_depth() const { return depth; }
+
+		void clear() {
+			std::fill(counters.begin(), counters.end(), 0);
+			total = 0;
+		}
+	};
+}
@@ -0,0 +1,217 @@
+#pragma once
+
+#include "task_pool.h"
+#include "number_sets_impl.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <fstream>
+#include <ostream>
+#include <stdexcept>
+#include <algorithm>
+#include <type_traits>
+
+/*
+	Export of number_sets_data as text, one set per line
+	* a line is the occurences, a tab, then the numbers separated by ", ", the way they are read
+	* the records are sorted by index, sets aren't copied; chunks are sorted in parallel by the tasks of a task_pool
+	  then merged pairwise, half as many merges in every round
+	* lines are formatted in parallel as well, in blocks written in order, so at most a few blocks are held in memory
+	* integers are formatted two digits at a time into the block, no stream formatting involved
+*/
+
+namespace ncr_test
+{
+	enum class export_order
+	{
+		occurences, // most frequent first, sets with the same occurences in lexicographic order
+		lexicographic // by the numbers of the sets, as stored
+	};
+
+	// room format_integer needs at most, for 64 bit integers with a sign
+	const std::size_t max_integer_chars = 21;
+
+	// writes the decimal digits of value at out, which must have room for max_integer_chars
+	// returns the end of what was written
+	template<typename T>
+	char* format_integer(T value, char* out)
+	{
+		static const char digit_pairs[] =
+			"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+			"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+			"8081828384858687888990919293949596979899";
+
+		using unsigned_type = typename std::make_unsigned<T>::type;
+		uint64_t magnitude = static_cast<unsigned_type>(value);
+
+		if (std::is_signed<T>::value && value < 0)
+		{
+			*out++ = '-';
+			magnitude = static_cast<unsigned_type>(unsigned_type(0) - static_cast<unsigned_type>(value));
+		}
+
+		char digits[max_integer_chars];
+		char* first = digits + sizeof(digits);
+
+		while (magnitude >= 100)
+		{
+			const char* pair = digit_pairs + (magnitude % 100) * 2;
+			magnitude /= 100;
+			*--first = pair[1];
+			*--first = pair[0];
+		}
+
+		if (magnitude >= 10)
+		{
+			const char* pair = digit_pairs + magnitude * 2;
+			*--first = pair[1];
+			*--first = pair[0];
+		}
+		else
+			*--first = static_cast<char>('0' + magnitude);
+
+		return std::copy(first, digits + sizeof(digits), out);
+	}
+
+	// sorts values with the workers of pool, sequential for short ones
+	template<typename Compare>
+	void parallel_sort(std::vector<uint32_t>& values, Compare compare, task_pool& pool)
+	{
+		const std::size_t min_chunk_size = 1 << 14;
+		std::size_t chunk_count = std::min(pool.size() * 2, values.size() / min_chunk_size);
+
+		if (chunk_count <= 1)
+		{
+			std::sort(values.begin(), values.end(), compare);
+			return;
+		}
+
+		// chunk i is [bounds[i], bounds[i + 1])
+		std::vector<std::size_t> bounds;
+		for (std::size_t i = 0; i <= chunk_count; ++i)
+			bounds.push_back(values.size() * i / chunk_count);
+
+		pool.run(chunk_count, [&](task_pool::task_source& tasks) {
+			std::size_t task;
+			while (tasks.next(task))
+				std::sort(values.begin() + bounds[task], values.begin() + bounds[task + 1], compare);
+		});
+
+		// width: chunks already merged together, the last round merges two halves with one worker
+		for (std::size_t width = 1; width < chunk_count; width *= 2)
+		{
+			pool.run((chunk_count + 2 * width - 1) / (2 * width), [&](task_pool::task_source& tasks) {
+				std::size_t task;
+				while (tasks.next(task))
+				{
+					std::size_t first = task * 2 * width;
+					std::size_t middle = std::min(first + width, chunk_count);
+					std::size_t last = std::min(first + 2 * width, chunk_count);
+
+					if (middle < last)
+						std::inplace_merge(values.begin() + bounds[first], values.begin() + bounds[middle], values.begin() + bounds[last], compare);
+				}
+			});
+		}
+	}
+
+	// the records of data in order
+	template<typename T, typename CharT, typename HashPolicy>
+	std::vector<uint32_t> sort_number_sets(const number_sets_data<T, CharT, HashPolicy> &data, export_order order, task_pool &pool)
+	{
+		std::vector<uint32_t> records(data.records.size());
+		for (std::size_t i = 0; i < records.size(); ++i)
+			records[i] = static_cast<uint32_t>(i);
+
+		auto less_numbers = [&data](uint32_t lhs, uint32_t rhs) {
+			array_ref<T> lhs_numbers = data.get_numbers(lhs), rhs_numbers = data.get_numbers(rhs);
+			return std::lexicographical_compare(lhs_numbers.begin(), lhs_numbers.end(), rhs_numbers.begin(), rhs_numbers.end());
+		};
+
+		if (order == export_order::occurences)
+		{
+			parallel_sort(records, [&data, &less_numbers](uint32_t lhs, uint32_t rhs) {
+				int lhs_occurences = data.records[lhs].occurences, rhs_occurences = data.records[rhs].occurences;
+				return lhs_occurences != rhs_occurences ? lhs_occurences > rhs_occurences : less_numbers(lhs, rhs);
+			}, pool);
+		}
+		else
+			parallel_sort(records, less_numbers, pool);
+
+		return records;
+	}
+
+	// appends the lines of records [first, last) to text
+	template<typename T, typename CharT, typename HashPolicy>
+	void format_number_sets(const number_sets_data<T, CharT, HashPolicy> &data, const uint32_t* first, const uint32_t* last, std::string &text)
+	{
+		std::vector<char> line;
+
+		for (; first != last; ++first)
+		{
+			array_ref<T> numbers = data.get_numbers(*first);
+
+			line.resize(max_integer_chars + 1 + numbers.size() * (max_integer_chars + 2) + 1);
+			char* out = format_integer(data.records[*first].occurences, line.data());
+			*out++ = '\t';
+
+			for (std::size_t i = 0; i < numbers.size(); ++i)
+			{
+				if (i != 0)
+				{
+					*out++ = ',';
+					*out++ = ' ';
+				}
+				out = format_integer(numbers[i], out);
+			}
+
+			*out++ = '\n';
+			text.append(line.data(), out);
+		}
+	}
+
+	// writes all the sets of data to out, one per line in the given order, see the top of the file
+	// invalid inputs aren't written
+	template<typename T, typename CharT, typename HashPolicy>
+	void export_number_sets(const number_sets_data<T, CharT, HashPolicy> &data, std::ostream &out, export_order order, task_pool &pool)
+	{
+		const std::size_t block_size = 1 << 14; // records formatted by one task
+
+		std::vector<uint32_t> records = sort_number_sets(data, order, pool);
+		std::vector<std::string> blocks(pool.size() * 2);
+
+		for (std::size_t begin = 0; begin < records.size(); begin += blocks.size() * block_size)
+		{
+			std::size_t block_count = std::min(blocks.size(), (records.size() - begin + block_size - 1) / block_size);
+
+			pool.run(block_count, [&](task_pool::task_source& tasks) {
+				std::size_t task;
+				while (tasks.next(task))
+				{
+					std::size_t first = begin + task * block_size;
+					blocks[task].clear();
+					format_number_sets(data, records.data() + first, records.data() + std::min(first + block_size, records.size()), blocks[task]);
+				}
+			});
+
+			for (std::size_t i = 0; i < block_count; ++i)
+				out.write(blocks[i].data(), blocks[i].size());
+		}
+	}
+
+	// export_number_sets to a file, replaced if it exists
+	template<typename T, typename CharT, typename HashPolicy>
+	void export_number_sets(const number_sets_data<T, CharT, HashPolicy> &data, const std::string &filename, export_order order, task_pool &pool)
+	{
+		std::ofstream ofile(filename, std::ios::binary | std::ios::trunc);
+		if (!ofile)
+			throw std::runtime_error("Unable to open file: " + filename);
+
+		export_number_sets(data, ofile, order, pool);
+
+		if (!ofile.flush())
+			throw std::runtime_error("Unable to write file: " + filename);
+	}
+}
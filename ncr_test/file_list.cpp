@@ -0,0 +1,121 @@
+#include "file_list.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+	// splits pattern in the directory, with its separator, and the name pattern
+	void split_pattern(const string& pattern, string& directory, string& name)
+	{
+#ifdef _WIN32
+		size_t separator = pattern.find_last_of("/\\");
+#else
+		size_t separator = pattern.find_last_of('/');
+#endif
+		directory = separator != string::npos ? pattern.substr(0, separator + 1) : string();
+		name = pattern.substr(directory.size());
+	}
+}
+
+namespace ncr_test
+{
+#ifdef _WIN32
+
+	vector<string> list_files(const string& pattern)
+	{
+		string directory, name;
+		split_pattern(pattern, directory, name);
+
+		vector<string> files;
+
+		WIN32_FIND_DATAA found;
+		HANDLE find_handle = FindFirstFileA(pattern.c_str(), &found);
+
+		if (find_handle == INVALID_HANDLE_VALUE)
+		{
+			if (GetLastError() == ERROR_FILE_NOT_FOUND)
+				return files;
+
+			throw runtime_error("Unable to list files: " + pattern);
+		}
+
+		do
+		{
+			if (!(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+				files.push_back(directory + found.cFileName);
+		} while (FindNextFileA(find_handle, &found));
+
+		FindClose(find_handle);
+
+		sort(files.begin(), files.end());
+		return files;
+	}
+
+	size_t get_file_size(const string& filename)
+	{
+		WIN32_FILE_ATTRIBUTE_DATA attributes;
+		if (!GetFileAttributesExA(filename.c_str(), GetFileExInfoStandard, &attributes))
+			throw runtime_error("Unable to get file size: " + filename);
+
+		ULARGE_INTEGER file_size;
+		file_size.LowPart = attributes.nFileSizeLow;
+		file_size.HighPart = attributes.nFileSizeHigh;
+
+		return static_cast<size_t>(file_size.QuadPart);
+	}
+
+#else
+
+	vector<string> list_files(const string& pattern)
+	{
+		string directory, name;
+		split_pattern(pattern, directory, name);
+
+		DIR* dir = opendir(directory.empty() ? "." : directory.c_str());
+		if (!dir)
+			throw runtime_error("Unable to list files: " + pattern);
+
+		vector<string> files;
+
+		while (dirent* entry = readdir(dir))
+		{
+			if (fnmatch(name.c_str(), entry->d_name, FNM_PERIOD) != 0)
+				continue;
+
+			string filename = directory + entry->d_name;
+
+			struct stat file_status;
+			if (stat(filename.c_str(), &file_status) == 0 && S_ISREG(file_status.st_mode))
+				files.push_back(filename);
+		}
+
+		closedir(dir);
+
+		sort(files.begin(), files.end());
+		return files;
+	}
+
+	size_t get_file_size(const string& filename)
+	{
+		struct stat file_status;
+		if (stat(filename.c_str(), &file_status) != 0)
+			throw runtime_error("Unable to get file size: " + filename);
+
+		return static_cast<size_t>(file_status.st_size);
+	}
+
+#endif
+}
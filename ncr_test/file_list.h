@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+/*
+	functions for the input files of a batch run
+	* list_files - the files matching a pattern, e.g. "logs/*.txt"
+	* get_file_size - the size of a file, without opening it
+*/
+
+namespace ncr_test
+{
+	// the regular files of a directory whose name matches the last component of pattern
+	// '*' matches any sequence of characters and '?' any single one, the directory part is taken as is
+	// names are in lexicographic order, with the directory prepended
+	// throws std::runtime_error if the directory can't be read
+	std::vector<std::string> list_files(const std::string& pattern);
+
+	// throws std::runtime_error if the file doesn't exist
+	std::size_t get_file_size(const std::string& filename);
+}
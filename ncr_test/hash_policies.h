@@ -0,0 +1,243 @@
+#pragma once
+
+#include "routines.h"
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NCR_STRIPE_HASH_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+/*
+	Hash policies for number sets
+	a policy is a struct with a static function: uint64_t hash(const array_ref<T>&)
+	and a unique id
+	* combine_hash_policy - boost style hash_combine over std::hash of each number
+	* stripe_hash_policy - xxh3 style hash over the bytes of the numbers (default)
+	* commutative_hash_policy - sum of the hashes of the numbers, the same for any order of them
+	  is_order_independent is true for it, so number sets are only sorted when they need to be stored, see number_sets_impl.h
+*/
+
+namespace ncr_test
+{
+	/*
+		stripe_hash
+		* 4 independent 64 bit lanes, a stripe of 32 bytes (8 ints) is consumed per step
+		* each lane adds the 32 x 32 bit product of the halves of (data ^ secret), and the data of its neighbour
+		* sse2 processes 2 lanes per instruction, the scalar version gives the same results
+		* the remaining tail is folded in 8 bytes at a time
+	*/
+
+	// source: xxh3 (https://github.com/Cyan4973/xxHash)
+
+	namespace stripe_hash_constants
+	{
+		const uint64_t prime_1 = 0x9E3779B185EBCA87ull;
+		const uint64_t prime_2 = 0xC2B2AE3D27D4EB4Full;
+		const uint64_t prime_3 = 0x165667B19E3779F9ull;
+		const uint64_t prime_4 = 0x85EBCA77C2B2AE63ull;
+
+		const uint64_t stripe_secret[4] = { 0xbe4ba423396cfeb8ull, 0x1cad21f72c81017cull, 0xdb979083e96dd4deull, 0x1f67b3b7a4a44072ull };
+		const uint64_t merge_secret[4] = { 0x78e5c0cc4ee679cbull, 0x2172ffcc7dd05a82ull, 0x8e2443f7744608b8ull, 0x4c263a81e69035e0ull };
+		const uint64_t tail_secret[4] = { 0xcb00c391bb52283cull, 0xa32e531b8b65d088ull, 0x4ef90da297486471ull, 0xd8acdea946ef1938ull };
+	}
+
+	inline uint64_t read_uint64(const unsigned char* p)
+	{
+		uint64_t value;
+		memcpy(&value, p, sizeof(value));
+		return value;
+	}
+
+	// xor of the high and low halves of the 128 bit product
+	inline uint64_t mul128_fold64(uint64_t lhs, uint64_t rhs)
+	{
+#if defined(_MSC_VER) && defined(_M_X64)
+		uint64_t high;
+		uint64_t low = _umul128(lhs, rhs, &high);
+		return low ^ high;
+#elif defined(__SIZEOF_INT128__)
+		unsigned __int128 product = static_cast<unsigned __int128>(lhs) * rhs;
+		return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+#else
+		uint64_t lo_lo = (lhs & 0xFFFFFFFF) * (rhs & 0xFFFFFFFF);
+		uint64_t hi_lo = (lhs >> 32) * (rhs & 0xFFFFFFFF);
+		uint64_t lo_hi = (lhs & 0xFFFFFFFF) * (rhs >> 32);
+		uint64_t hi_hi = (lhs >> 32) * (rhs >> 32);
+		uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+		uint64_t high = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+		uint64_t low = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+		return low ^ high;
+#endif
+	}
+
+	inline uint64_t stripe_hash_avalanche(uint64_t hash)
+	{
+		hash ^= hash >> 37;
+		hash *= 0x165667919E3779F9ull;
+		hash ^= hash >> 32;
+		return hash;
+	}
+
+	inline void accumulate_stripes(uint64_t acc[4], const unsigned char* p, std::size_t stripe_count)
+	{
+		using namespace stripe_hash_constants;
+
+#ifdef NCR_STRIPE_HASH_SSE2
+		__m128i acc_low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc));
+		__m128i acc_high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + 2));
+		const __m128i secret_low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(stripe_secret));
+		const __m128i secret_high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(stripe_secret + 2));
+
+		auto accumulate = [](__m128i acc_lanes, __m128i value, __m128i secret) {
+			__m128i key = _mm_xor_si128(value, secret);
+			__m128i product = _mm_mul_epu32(key, _mm_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1)));
+			__m128i swapped = _mm_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+			return _mm_add_epi64(acc_lanes, _mm_add_epi64(product, swapped));
+		};
+
+		for (; stripe_count; --stripe_count, p += 32)
+		{
+			acc_low = accumulate(acc_low, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), secret_low);
+			acc_high = accumulate(acc_high, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16)), secret_high);
+		}
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(acc), acc_low);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(acc + 2), acc_high);
+#else
+		for (; stripe_count; --stripe_count, p += 32)
+		{
+			for (int i = 0; i < 4; ++i)
+			{
+				uint64_t value = read_uint64(p + 8 * i);
+				uint64_t key = value ^ stripe_secret[i];
+				acc[i ^ 1] += value;
+				acc[i] += (key & 0xFFFFFFFF) * (key >> 32);
+			}
+		}
+#endif
+	}
+
+	inline uint64_t stripe_hash(const void* data, std::size_t length)
+	{
+		using namespace stripe_hash_constants;
+
+		const unsigned char* p = static_cast<const unsigned char*>(data);
+		uint64_t hash = length * prime_1;
+
+		std::size_t stripe_count = length / 32;
+		if (stripe_count)
+		{
+			uint64_t acc[4] = { prime_1, prime_2, prime_3, prime_4 };
+			accumulate_stripes(acc, p, stripe_count);
+
+			hash += mul128_fold64(acc[0] ^ merge_secret[0], acc[1] ^ merge_secret[1]);
+			hash += mul128_fold64(acc[2] ^ merge_secret[2], acc[3] ^ merge_secret[3]);
+
+			p += stripe_count * 32;
+			length -= stripe_count * 32;
+		}
+
+		for (int i = 0; length >= 8; length -= 8, p += 8, ++i)
+			hash = mul128_fold64(hash ^ read_uint64(p) ^ tail_secret[i], prime_1);
+
+		// less than 8 bytes left... only for numbers smaller than 8 bytes
+		// read as a fixed 4 byte load and single bytes, a memcpy of variable length is a library call
+		// the value is the same as the bytes copied into the low end of rest, on little endian
+		if (length)
+		{
+			uint64_t rest = 0;
+			std::size_t i = 0;
+
+			if (length >= 4)
+			{
+				uint32_t low;
+				memcpy(&low, p, sizeof(low));
+				rest = low;
+				i = 4;
+			}
+
+			for (; i < length; ++i)
+				rest |= static_cast<uint64_t>(p[i]) << (8 * i);
+
+			hash = mul128_fold64(hash ^ rest ^ tail_secret[3], prime_2);
+		}
+
+		return stripe_hash_avalanche(hash);
+	}
+
+
+
+	/*
+		policies
+		id identifies the policy in snapshots, as stored hashes are only valid for the policy that made them
+	*/
+
+	struct combine_hash_policy
+	{
+		enum { id = 1 };
+
+		template<typename T>
+		static uint64_t hash(const array_ref<T>& numbers) {
+			return hash_value(numbers);
+		}
+	};
+
+	struct stripe_hash_policy
+	{
+		enum { id = 2 };
+
+		template<typename T>
+		static uint64_t hash(const array_ref<T>& numbers) {
+			return stripe_hash(numbers.data(), numbers.size() * sizeof(T));
+		}
+	};
+
+	// a multiset hash: the numbers are mixed one by one and summed up, a sum keeps repeated numbers apart unlike a xor
+	// the sum is then mixed with the count, so that sets of different sizes don't share their sums
+	struct commutative_hash_policy
+	{
+		enum { id = 3 };
+
+		template<typename T>
+		static uint64_t hash(const array_ref<T>& numbers) {
+			using namespace stripe_hash_constants;
+
+			uint64_t sum = 0;
+			for (T number : numbers)
+				sum += mul128_fold64(static_cast<uint64_t>(number) ^ stripe_secret[0], prime_1);
+
+			return stripe_hash_avalanche(mul128_fold64(sum ^ stripe_secret[1], numbers.size() * prime_2 + prime_3));
+		}
+	};
+
+	// true if the hash of a set doesn't depend on the order of its numbers
+	template<typename HashPolicy>
+	struct is_order_independent : std::false_type
+	{};
+
+	template<>
+	struct is_order_independent<commutative_hash_policy> : std::true_type
+	{};
+
+	using default_hash_policy = stripe_hash_policy;
+
+	/*
+		function shard_index
+		picks the shard of a number set from the high bits of a multiplicative hash
+		the low bits of the hash are used by the tables of the shards to pick buckets
+	*/
+	inline std::size_t shard_index(uint64_t hash, std::size_t shard_count)
+	{
+		uint64_t mixed = (hash * 0x9E3779B97F4A7C15ull) >> 32;
+		return static_cast<std::size_t>((mixed * shard_count) >> 32);
+	}
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+#include "space_saving.h"
+#include "count_min_sketch.h"
+#include "number_sets_impl.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <algorithm>
+
+/*
+	Approximate counting of number sets in fixed memory
+	* space_saving monitors the most frequent sets, count_min_sketch estimates the occurences of any set
+	* duplicate and non duplicate counts are estimated from the sketch, as sets aren't stored:
+	  a set is new if its estimate was 0, a duplicate otherwise... sketch collisions make new sets look like duplicates
+	* invalid inputs are only counted
+	* memory: depth x width 4 byte counters, plus capacity entries holding the numbers of a set
+*/
+
+namespace ncr_test
+{
+	/*
+		heavy_hitter structure
+		a frequent number set, its occurences are known within [min_occurences, occurences]
+	*/
+	template<typename T>
+	struct heavy_hitter
+	{
+		std::vector<T> numbers;
+		int occurences; // never less than the real occurences
+		int min_occurences; // never more than the real occurences
+
+		heavy_hitter(const std::vector<T>& _numbers, int _occ, int _min_occ) :
+			numbers(_numbers),
+			occurences(_occ),
+			min_occurences(_min_occ)
+		{}
+	};
+
+	struct heavy_hitters_config
+	{
+		std::size_t capacity; // number of sets monitored
+		std::size_t sketch_width;
+		std::size_t sketch_depth;
+
+		heavy_hitters_config(std::size_t _capacity = 1024, std::size_t _sketch_width = 1 << 16, std::size_t _sketch_depth = 4) :
+			capacity(_capacity),
+			sketch_width(_sketch_width),
+			sketch_depth(_sketch_depth)
+		{}
+	};
+
+
+	/*
+		struct heavy_hitters_data
+	*/
+
+	template<typename T, typename CharT = char, typename HashPolicy = default_hash_policy>
+	struct heavy_hitters_data : private noncopyable
+	{
+		// type definitions
+		using value_type = T;
+		using char_type = CharT;
+		using hash_policy = HashPolicy;
+		using hasher_type = hasher<T, HashPolicy>;
+		using string_type = std::basic_string<CharT>;
+
+		// variables
+		heavy_hitters_config config;
+		space_saving<T> frequent;
+		count_min_sketch sketch;
+		int64_t duplicate_count; // estimated
+		int64_t non_duplicate_count; // estimated
+		int64_t invalid_count;
+
+		// ctor
+		explicit heavy_hitters_data(const heavy_hitters_config& _config = heavy_hitters_config()) :
+			config(_config),
+			frequent(_config.capacity),
+			sketch(_config.sketch_width, _config.sketch_depth),
+			duplicate_count(0),
+			non_duplicate_count(0),
+			invalid_count(0)
+		{}
+
+		void clear() {
+			frequent.clear();
+			sketch.clear();
+			duplicate_count = 0;
+			non_duplicate_count = 0;
+			invalid_count = 0;
+		}
+	};
+
+
+	// adds one occurence of a number set, hash must be the hasher_type value of numbers
+	// numbers may be in any order if the hash policy is order independent
+	// returns false if the set is estimated to be a duplicate
+	template<typename T, typename CharT, typename HashPolicy>
+	bool add_heavy_hitter_occurence(const array_ref<T>& numbers, uint64_t hash, heavy_hitters_data<T, CharT, HashPolicy> &data)
+	{
+		data.frequent.add(hash, numbers);
+		uint32_t prev_occurences = data.sketch.add(hash, 1);
+
+		// same bookkeeping as add_number_set_occurences, with the estimate as previous occurences
+		if (prev_occurences == 0)
+			data.non_duplicate_count++;
+		else if (prev_occurences == 1)
+		{
+			data.non_duplicate_count--;
+			data.duplicate_count += 2;
+		}
+		else
+			data.duplicate_count++;
+
+		return prev_occurences == 0;
+	}
+
+	template<typename T, typename CharT, typename HashPolicy>
+	bool consume_number_set(const array_ref<T>& input, uint64_t hash, heavy_hitters_data<T, CharT, HashPolicy> &data)
+	{
+		return add_heavy_hitter_occurence(input, hash, data);
+	}
+
+	template<typename T, typename CharT, typename HashPolicy>
+	bool consume_number_set(const std::vector<T>& input, uint64_t hash, heavy_hitters_data<T, CharT, HashPolicy> &data)
+	{
+		return add_heavy_hitter_occurence(array_ref<T>(input), hash, data);
+	}
+
+	template<typename T, typename CharT, typename HashPolicy>
+	bool consume_number_set(const std::vector<T>& input, heavy_hitters_data<T, CharT, HashPolicy> &data)
+	{
+		return consume_number_set(input, hasher<T, HashPolicy>()(input), data);
+	}
+
+	// moves the content of source into target, both must have the same config
+	// source and target must count different sets, e.g. shards split by hash, as the duplicate estimates are summed up
+	template<typename T, typename CharT, typename HashPolicy>
+	void merge_heavy_hitters_data(heavy_hitters_data<T, CharT, HashPolicy> &&source, heavy_hitters_data<T, CharT, HashPolicy> &target)
+	{
+		target.frequent.merge(std::move(source.frequent));
+		target.sketch.merge(source.sketch);
+		target.duplicate_count += source.duplicate_count;
+		target.non_duplicate_count += source.non_duplicate_count;
+		target.invalid_count += source.invalid_count;
+
+		source.clear();
+	}
+
+	// the k most frequent sets monitored, most frequent first
+	// occurences are the smaller of the two upper bounds, of space_saving and of the sketch
+	template<typename T, typename CharT, typename HashPolicy>
+	std::vector<heavy_hitter<T>> get_heavy_hitters(const heavy_hitters_data<T, CharT, HashPolicy> &data, std::size_t k)
+	{
+		std::vector<heavy_hitter<T>> res;
+
+		for (uint32_t pos : data.frequent.top(k))
+		{
+			const auto& monitored = data.frequent.get(pos);
+			int occurences = static_cast<int>(std::min<uint64_t>(monitored.occurences, data.sketch.estimate(monitored.hash)));
+			res.push_back(heavy_hitter<T>(monitored.numbers, occurences, monitored.occurences - monitored.error));
+
+			// with an order independent hash policy, a set is monitored in the order of the line that brought it in
+			sort_numbers(res.back().numbers);
+		}
+
+		return res;
+	}
+
+	// batch mode for heavy_hitters_data, see add_number_sets_concurrent of number_sets_data
+	// every shard has its own space_saving and sketch of the size given by the config of data
+	// instantiated for the same types as the one of number_sets_data
+	template<typename T, typename CharT, typename HashPolicy>
+	std::size_t add_number_sets_concurrent(const std::string& filename, heavy_hitters_data<T, CharT, HashPolicy> &data, task_pool &producers,
+		const batch_options& options = batch_options());
+
+	template<typename T, typename CharT, typename HashPolicy>
+	void add_number_sets_concurrent(const std::vector<std::string>& filenames, heavy_hitters_data<T, CharT, HashPolicy> &data, task_pool &producers,
+		const batch_options& options = batch_options());
+}
@@ -0,0 +1,140 @@
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+namespace ncr_test
+{
+#ifdef _WIN32
+
+	mapped_file::mapped_file(const string& filename) :
+		content(nullptr),
+		content_size(0),
+		file_handle(INVALID_HANDLE_VALUE),
+		mapping_handle(nullptr)
+	{
+		file_handle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+		if (file_handle == INVALID_HANDLE_VALUE)
+			throw runtime_error("Unable to open file: " + filename);
+
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(file_handle, &file_size))
+		{
+			close();
+			throw runtime_error("Unable to get file size: " + filename);
+		}
+
+		content_size = static_cast<size_t>(file_size.QuadPart);
+
+		// an empty file can't be mapped... and there is nothing to read anyway
+		if (content_size == 0)
+			return;
+
+		mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping_handle)
+			content = static_cast<const char*>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+
+		if (!content)
+		{
+			close();
+			throw runtime_error("Unable to map file: " + filename);
+		}
+	}
+
+	void mapped_file::close()
+	{
+		if (content)
+			UnmapViewOfFile(content);
+		if (mapping_handle)
+			CloseHandle(mapping_handle);
+		if (file_handle != INVALID_HANDLE_VALUE)
+			CloseHandle(file_handle);
+
+		content = nullptr;
+		mapping_handle = nullptr;
+		file_handle = INVALID_HANDLE_VALUE;
+	}
+
+#else
+
+	mapped_file::mapped_file(const string& filename) :
+		content(nullptr),
+		content_size(0),
+		file_descriptor(-1)
+	{
+		file_descriptor = open(filename.c_str(), O_RDONLY);
+
+		if (file_descriptor == -1)
+			throw runtime_error("Unable to open file: " + filename);
+
+		struct stat file_stat;
+		if (fstat(file_descriptor, &file_stat) == -1)
+		{
+			close();
+			throw runtime_error("Unable to get file size: " + filename);
+		}
+
+		content_size = static_cast<size_t>(file_stat.st_size);
+
+		// an empty file can't be mapped... and there is nothing to read anyway
+		if (content_size == 0)
+			return;
+
+		void* mapping = mmap(nullptr, content_size, PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+
+		if (mapping == MAP_FAILED)
+		{
+			close();
+			throw runtime_error("Unable to map file: " + filename);
+		}
+
+		// the file is scanned front to back, let the kernel read ahead aggressively
+		madvise(mapping, content_size, MADV_SEQUENTIAL);
+
+		content = static_cast<const char*>(mapping);
+	}
+
+	void mapped_file::close()
+	{
+		if (content)
+			munmap(const_cast<char*>(content), content_size);
+		if (file_descriptor != -1)
+			::close(file_descriptor);
+
+		content = nullptr;
+		file_descriptor = -1;
+	}
+
+#endif
+
+	mapped_file::~mapped_file()
+	{
+		close();
+	}
+
+	size_t mapped_file::estimate_line_count() const
+	{
+		size_t sample_size = min<size_t>(content_size, 1 << 20);
+		size_t sample_lines = static_cast<size_t>(count(content, content + sample_size, '\n'));
+
+		if (sample_size == content_size)
+			return sample_lines + 1;
+
+		return static_cast<size_t>(static_cast<double>(sample_lines + 1) * content_size / sample_size);
+	}
+}
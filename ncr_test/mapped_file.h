@@ -0,0 +1,42 @@
+#pragma once
+
+#include "routines.h"
+
+#include <string>
+#include <cstddef>
+
+/*
+	class mapped_file
+	maps a whole file read only into the address space of the process
+	so that its content can be parsed in place, without copying it into buffers
+*/
+
+namespace ncr_test
+{
+	class mapped_file : private noncopyable
+	{
+		const char* content;
+		std::size_t content_size;
+
+#ifdef _WIN32
+		void* file_handle;
+		void* mapping_handle;
+#else
+		int file_descriptor;
+#endif
+
+	private:
+		void close();
+
+	public:
+		// throws std::runtime_error if the file can't be opened or mapped
+		explicit mapped_file(const std::string& filename);
+		~mapped_file();
+
+		const char* data() const { return content; }
+		std::size_t size() const { return content_size; }
+
+		// extrapolates the number of lines from the first MB of the file
+		std::size_t estimate_line_count() const;
+	};
+}
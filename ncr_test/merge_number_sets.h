@@ -0,0 +1,167 @@
+#pragma once
+
+#include "task_pool.h"
+#include "number_sets_impl.h"
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <iterator>
+#include <algorithm>
+
+/*
+	Parallel k-way merge of number_sets_data
+	* the records of the sources are split in partitions by their hash, in chunks processed by the tasks of a task_pool
+	* every partition is then merged by one task: occurences of a set found in several sources are summed up
+	  and the set is looked up in the target, which is only read at that point
+	* the partitions are finally added to the target one after the other: sets already there only get their occurences updated
+	  new ones are appended without being compared again, so this sequential part does no hashing or comparisons
+	* new sets come after the ones of the target, grouped by partition
+*/
+
+namespace ncr_test
+{
+	template<typename T, typename CharT, typename HashPolicy>
+	class number_sets_merge : private noncopyable
+	{
+		using data_type = number_sets_data<T, CharT, HashPolicy>;
+
+		enum : std::size_t
+		{
+			chunk_size = 1 << 16, // records of a source split by one task
+			partitions_per_thread = 4
+		};
+
+		struct chunk
+		{
+			const data_type* source;
+			std::size_t begin;
+			std::size_t end;
+			std::vector<std::vector<uint32_t>> records; // of the chunk, per partition
+		};
+
+		struct partition
+		{
+			data_type sets; // the sets of the partition, with their occurences summed over the sources
+			std::vector<uint32_t> target_records; // per record of sets, the record of the same set in the target, or not_found
+		};
+
+		const std::vector<data_type*>& sources;
+		data_type& target;
+		task_pool& pool;
+		std::vector<chunk> chunks;
+		std::vector<std::unique_ptr<partition>> partitions;
+
+	private:
+		void split(chunk& c) {
+			c.records.resize(partitions.size());
+
+			for (std::size_t i = c.begin; i < c.end; ++i)
+				c.records[shard_index(c.source->records[i].hash, partitions.size())].push_back(static_cast<uint32_t>(i));
+		}
+
+		// in chunk order, so that new sets keep the order of the sources within a partition
+		void merge_partition(std::size_t index) {
+			partition& p = *partitions[index];
+
+			for (const auto& c : chunks)
+			{
+				for (uint32_t record : c.records[index])
+					add_number_set_occurences(c.source->get_numbers(record), c.source->records[record].hash, c.source->records[record].occurences, p.sets);
+			}
+
+			p.target_records.reserve(p.sets.records.size());
+
+			for (std::size_t i = 0; i < p.sets.records.size(); ++i)
+			{
+				array_ref<T> numbers = p.sets.get_numbers(i);
+				p.target_records.push_back(target.index.find(p.sets.records[i].hash, [&](uint32_t record) {
+					return target.get_numbers(record) == numbers;
+				}));
+			}
+		}
+
+		void add_to_target() {
+			std::size_t new_count = 0;
+			for (const auto& p : partitions)
+				new_count += static_cast<std::size_t>(std::count_if(p->target_records.begin(), p->target_records.end(),
+					[](uint32_t record) { return record == set_index::not_found; }));
+
+			target.reserve(target.records.size() + new_count);
+
+			for (const auto& p : partitions)
+			{
+				for (std::size_t i = 0; i < p->sets.records.size(); ++i)
+				{
+					const set_record& record = p->sets.records[i];
+					std::size_t target_record = p->target_records[i];
+
+					if (target_record == set_index::not_found)
+					{
+						target_record = target.records.size();
+						target.index.insert(record.hash, static_cast<uint32_t>(target_record));
+						target.records.push_back(set_record{ target.arena.append(p->sets.get_numbers(i)), record.length, record.hash, 0 });
+					}
+
+					count_number_set_occurences(target_record, record.occurences, target);
+				}
+
+				// done with it, its memory can go
+				p->sets.clear();
+			}
+		}
+
+	public:
+		number_sets_merge(const std::vector<data_type*>& _sources, data_type& _target, task_pool& _pool) :
+			sources(_sources),
+			target(_target),
+			pool(_pool)
+		{}
+
+		void run() {
+			for (data_type* source : sources)
+			{
+				for (std::size_t begin = 0; begin < source->records.size(); begin += chunk_size)
+					chunks.push_back(chunk{ source, begin, std::min<std::size_t>(begin + chunk_size, source->records.size()), {} });
+			}
+
+			for (std::size_t i = 0; i < pool.size() * partitions_per_thread; ++i)
+			{
+				partitions.push_back(std::make_unique<partition>());
+				partitions.back()->sets.arena.set_allocator(target.arena.get_allocator());
+			}
+
+			pool.run(chunks.size(), [this](task_pool::task_source& tasks) {
+				std::size_t task;
+				while (tasks.next(task))
+					split(chunks[task]);
+			});
+
+			pool.run(partitions.size(), [this](task_pool::task_source& tasks) {
+				std::size_t task;
+				while (tasks.next(task))
+					merge_partition(task);
+			});
+
+			add_to_target();
+
+			for (data_type* source : sources)
+			{
+				target.invalid_inputs.insert(target.invalid_inputs.end(),
+					std::make_move_iterator(source->invalid_inputs.begin()), std::make_move_iterator(source->invalid_inputs.end()));
+
+				source->clear();
+			}
+		}
+	};
+
+	// moves all number sets and invalid inputs from sources into target, see merge_number_sets_data for two of them
+	// the sources are merged in parallel by the workers of pool, and left empty
+	// the sources must all be different from target
+	template<typename T, typename CharT, typename HashPolicy>
+	void merge_number_sets_data(const std::vector<number_sets_data<T, CharT, HashPolicy>*>& sources, number_sets_data<T, CharT, HashPolicy> &target, task_pool &pool)
+	{
+		number_sets_merge<T, CharT, HashPolicy>(sources, target, pool).run();
+	}
+}
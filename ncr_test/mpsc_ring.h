@@ -0,0 +1,271 @@
+#pragma once
+
+#include "routines.h"
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <condition_variable>
+
+#ifdef __linux__
+#include <climits>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+/*
+	class event_count
+	lets a thread sleep until some condition, checked outside of any lock, may have changed
+	* a waiter calls prepare_wait, rechecks its condition, and then either wait or cancel_wait
+	* notify_all only costs a fence and a load while nobody is waiting
+	* waiting uses a futex on linux, a mutex and condition_variable everywhere else
+*/
+
+namespace ncr_test
+{
+	class event_count : private noncopyable
+	{
+		std::atomic<uint32_t> epoch;
+		std::atomic<uint32_t> waiters;
+
+#ifndef __linux__
+		std::mutex epoch_mutex;
+		std::condition_variable epoch_changed;
+#endif
+
+	public:
+		event_count() :
+			epoch(0),
+			waiters(0)
+		{}
+
+		// returns the key to pass to wait
+		uint32_t prepare_wait() {
+			waiters.fetch_add(1);
+			return epoch.load();
+		}
+
+		void cancel_wait() {
+			waiters.fetch_sub(1);
+		}
+
+		// returns once notify_all has been called after prepare_wait returned key
+		void wait(uint32_t key) {
+#ifdef __linux__
+			// futex returns early on spurious wakeups and if epoch isn't key anymore
+			while (epoch.load() == key)
+				syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch), FUTEX_WAIT_PRIVATE, key, nullptr, nullptr, 0);
+#else
+			std::unique_lock<std::mutex> lock(epoch_mutex);
+			epoch_changed.wait(lock, [&] { return epoch.load() != key; });
+#endif
+			waiters.fetch_sub(1);
+		}
+
+		// must be called after the change to the condition has been made visible
+		void notify_all() {
+			// pairs with the increment in prepare_wait... either the waiter sees the change, or waiters is seen
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+
+			if (waiters.load(std::memory_order_relaxed) == 0)
+				return;
+
+			epoch.fetch_add(1);
+
+#ifdef __linux__
+			syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#else
+			// taking the lock makes sure a waiter is either before its check or already waiting
+			{
+				std::lock_guard<std::mutex> guard(epoch_mutex);
+			}
+			epoch_changed.notify_all();
+#endif
+		}
+	};
+
+
+	/*
+		class mpsc_ring
+		bounded lock free queue with many producers and a single consumer
+		* every slot has a sequence number telling whether it is free for the push of a given round, or holds a value to pop
+		* producers claim slots with a compare exchange on the push position, the consumer owns the pop position
+		* push blocks while the ring is full, pop blocks while it is empty... after a short spin both sleep on an event_count
+		* close wakes the consumer, pop returns false once the ring is closed and drained
+	*/
+
+	// source: http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+
+	template<typename T>
+	class mpsc_ring : private noncopyable
+	{
+		enum { spin_count = 64 };
+
+		struct slot
+		{
+			std::atomic<std::size_t> sequence;
+			T value;
+		};
+
+		std::unique_ptr<slot[]> slots;
+		std::size_t mask; // slot count - 1, slot count is a power of two
+
+		// padded apart, they are written by different threads
+		char padding_1[64];
+		std::atomic<std::size_t> push_pos;
+		char padding_2[64];
+		std::size_t pop_pos;
+		char padding_3[64];
+		std::atomic<bool> closed;
+
+		event_count not_empty;
+		event_count not_full;
+
+	private:
+		static std::size_t round_up_capacity(std::size_t capacity) {
+			std::size_t slot_count = 2;
+			while (slot_count < capacity)
+				slot_count *= 2;
+			return slot_count;
+		}
+
+		// spins a little first, the other side is usually quick to catch up
+		template<typename TryFunc>
+		static bool spin(TryFunc try_func) {
+			for (int i = 0; i < spin_count; ++i)
+			{
+				if (try_func())
+					return true;
+				std::this_thread::yield();
+			}
+			return false;
+		}
+
+	public:
+		// capacity is rounded up to a power of two
+		explicit mpsc_ring(std::size_t capacity) :
+			slots(new slot[round_up_capacity(capacity)]),
+			mask(round_up_capacity(capacity) - 1),
+			push_pos(0),
+			pop_pos(0),
+			closed(false)
+		{
+			for (std::size_t i = 0; i <= mask; ++i)
+				slots[i].sequence.store(i, std::memory_order_relaxed);
+		}
+
+		// value is moved from only on success
+		bool try_push(T& value) {
+			std::size_t pos = push_pos.load(std::memory_order_relaxed);
+
+			for (;;)
+			{
+				slot& s = slots[pos & mask];
+				std::size_t sequence = s.sequence.load(std::memory_order_acquire);
+				std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos);
+
+				if (diff == 0)
+				{
+					if (push_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					{
+						s.value = std::move(value);
+						s.sequence.store(pos + 1, std::memory_order_release);
+						return true;
+					}
+				}
+				else if (diff < 0)
+					return false; // the slot still holds the value of the previous round... full
+				else
+					pos = push_pos.load(std::memory_order_relaxed);
+			}
+		}
+
+		// only to be called from the consumer thread
+		bool try_pop(T& value) {
+			slot& s = slots[pop_pos & mask];
+
+			if (s.sequence.load(std::memory_order_acquire) != pop_pos + 1)
+				return false;
+
+			value = std::move(s.value);
+			s.sequence.store(pop_pos + mask + 1, std::memory_order_release);
+			++pop_pos;
+			return true;
+		}
+
+		void push(T value) {
+			if (!spin([&] { return try_push(value); }))
+			{
+				for (;;)
+				{
+					uint32_t key = not_full.prepare_wait();
+
+					if (try_push(value))
+					{
+						not_full.cancel_wait();
+						break;
+					}
+
+					not_full.wait(key);
+
+					if (try_push(value))
+						break;
+				}
+			}
+
+			not_empty.notify_all();
+		}
+
+		// only to be called from the consumer thread
+		// returns false if the ring is closed and empty
+		bool pop(T& value) {
+			if (!spin([&] { return try_pop(value); }))
+			{
+				for (;;)
+				{
+					uint32_t key = not_empty.prepare_wait();
+
+					if (try_pop(value))
+					{
+						not_empty.cancel_wait();
+						break;
+					}
+
+					if (closed.load())
+					{
+						not_empty.cancel_wait();
+						// pushes that finished before close are visible now
+						if (!try_pop(value))
+							return false;
+						break;
+					}
+
+					not_empty.wait(key);
+
+					if (try_pop(value))
+						break;
+				}
+			}
+
+			not_full.notify_all();
+			return true;
+		}
+
+		// values waiting in the ring, may be off while pushes are in progress
+		// only to be called from the consumer thread
+		std::size_t size() const {
+			return push_pos.load(std::memory_order_relaxed) - pop_pos;
+		}
+
+		// no push may be started after close
+		void close() {
+			closed.store(true);
+			not_empty.notify_all();
+		}
+	};
+}
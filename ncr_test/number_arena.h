@@ -0,0 +1,148 @@
+#pragma once
+
+#include "routines.h"
+
+#include <new>
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+
+/*
+	class number_arena
+	append only storage for the numbers of all the sets of a number_sets_data
+	* memory is allocated in blocks, which never move... so growing doesn't copy
+	* elements are addressed by a single offset, as if all the blocks were concatenated
+	* every appended range is contiguous, a range larger than a block gets a multi block allocation
+	* allocations go through an arena_allocator, operator new by default
+*/
+
+namespace ncr_test
+{
+	/*
+		arena_allocator structure
+		where number_arena gets its memory from, e.g. a mimalloc heap or a jemalloc arena
+		* allocate must return memory aligned for any integral type, or throw std::bad_alloc
+		* deallocate is given back the size that was allocated
+		* context is passed to both, it must outlive the memory allocated through it
+	*/
+	struct arena_allocator
+	{
+		void* (*allocate)(std::size_t bytes, void* context);
+		void (*deallocate)(void* memory, std::size_t bytes, void* context);
+		void* context;
+
+		// the default allocator, operator new and delete
+		arena_allocator() :
+			allocate([](std::size_t bytes, void*) { return ::operator new(bytes); }),
+			deallocate([](void* memory, std::size_t, void*) { ::operator delete(memory); }),
+			context(nullptr)
+		{}
+
+		arena_allocator(void* (*_allocate)(std::size_t, void*), void (*_deallocate)(void*, std::size_t, void*), void* _context = nullptr) :
+			allocate(_allocate),
+			deallocate(_deallocate),
+			context(_context)
+		{}
+	};
+
+	template<typename T>
+	class number_arena : private noncopyable
+	{
+		static constexpr std::size_t block_shift = 16;
+		static constexpr std::size_t block_size = std::size_t(1) << block_shift;
+
+		struct allocation
+		{
+			T* memory;
+			std::size_t bytes;
+			arena_allocator allocator; // the one it came from, the allocator of the arena may have changed since
+		};
+
+		std::vector<allocation> allocations;
+		std::vector<T*> blocks; // start of every block_size elements of the address space
+		std::size_t used; // offset of the first free element
+		arena_allocator allocator;
+
+	private:
+		std::size_t capacity() const {
+			return blocks.size() << block_shift;
+		}
+
+		void allocate(std::size_t count) {
+			std::size_t block_count = std::max<std::size_t>(1, (count + block_size - 1) >> block_shift);
+			std::size_t bytes = (block_count << block_shift) * sizeof(T);
+
+			// reserved first, so that a failure doesn't leave the allocation behind
+			allocations.reserve(allocations.size() + 1);
+			blocks.reserve(blocks.size() + block_count);
+
+			T* memory = static_cast<T*>(allocator.allocate(bytes, allocator.context));
+			allocations.push_back(allocation{ memory, bytes, allocator });
+
+			for (std::size_t i = 0; i < block_count; ++i)
+				blocks.push_back(memory + (i << block_shift));
+		}
+
+		void deallocate_all() {
+			for (const auto& a : allocations)
+				a.allocator.deallocate(a.memory, a.bytes, a.allocator.context);
+			allocations.clear();
+		}
+
+	public:
+		number_arena() :
+			used(0)
+		{}
+
+		~number_arena() {
+			deallocate_all();
+		}
+
+		// used for the next allocations, the current ones are given back to the allocator they came from
+		void set_allocator(const arena_allocator& _allocator) {
+			allocator = _allocator;
+		}
+
+		const arena_allocator& get_allocator() const {
+			return allocator;
+		}
+
+		// returns the offset of the first appended element
+		std::size_t append(const array_ref<T>& values) {
+			if (values.empty())
+				return used;
+
+			// the rest of the last allocation is skipped if values don't fit in it
+			if (used + values.size() > capacity())
+			{
+				used = capacity();
+				allocate(values.size());
+			}
+
+			std::copy(values.begin(), values.end(), blocks[used >> block_shift] + (used & (block_size - 1)));
+
+			std::size_t offset = used;
+			used += values.size();
+			return offset;
+		}
+
+		// removes the last count elements, they must have been appended by the last call to append
+		void truncate(std::size_t count) {
+			used -= count;
+		}
+
+		array_ref<T> get(std::size_t offset, std::size_t count) const {
+			if (count == 0)
+				return array_ref<T>();
+
+			return array_ref<T>(blocks[offset >> block_shift] + (offset & (block_size - 1)), count);
+		}
+
+		void clear() {
+			deallocate_all();
+			blocks.clear();
+			used = 0;
+		}
+	};
+}
@@ -1,14 +1,23 @@
 #pragma once
 
 #include "routines.h"
+#include "task_pool.h"
+#include "snapshot.h"
+#include "file_list.h"
+#include "mapped_file.h"
+#include "export_number_sets.h"
 #include "number_sets_impl.h"
+#include "merge_number_sets.h"
 
 #include <string>
 #include <vector>
+#include <memory>
 #include <sstream>
 #include <iostream>
+#include <stdexcept>
 #include <algorithm>
 #include <type_traits>
+#include <unordered_map>
 #include <unordered_set>
 
 /*
@@ -17,17 +26,43 @@
 
 namespace ncr_test
 {
-	template<typename T, typename CharT = char>
+	// HashPolicy: see hash_policies.h
+	template<typename T, typename CharT = char, typename HashPolicy = default_hash_policy>
 	class number_sets
 	{
 	public:
-		using data_type = number_sets_data<T, CharT>;
+		using data_type = number_sets_data<T, CharT, HashPolicy>;
 		using string_type = typename data_type::string_type;
 		using const_ref_invalid_inputs_type = typename data_type::const_ref_invalid_inputs_type;
-		using const_ref_data_container_type = typename data_type::const_ref_data_container_type;
+		using data_view_type = typename data_type::data_view_type;
 
 	private:
 		data_type data;
+		std::unique_ptr<task_pool> producers; // created by the first add_batch_mode, reused by the next ones
+		std::unordered_map<std::string, std::size_t> appended_offsets; // per file, the offset up to which add_batch_mode_appended has processed it
+		bool stats_enabled;
+		pipeline_stats stats; // of the last batch mode call
+		read_options file_read_options;
+		std::size_t memory_limit; // of batch mode calls
+
+	private:
+		task_pool& get_producers(int producer_count) {
+			std::size_t thread_count = static_cast<std::size_t>(std::max(producer_count, 1));
+
+			if (!producers || producers->size() != thread_count)
+				producers = std::make_unique<task_pool>(thread_count);
+
+			return *producers;
+		}
+
+		batch_options get_batch_options(int shard_count) {
+			batch_options options;
+			options.shard_count = shard_count;
+			options.stats = stats_enabled ? &stats : nullptr;
+			options.read = file_read_options;
+			options.memory_limit = memory_limit;
+			return options;
+		}
 
 	public:
 
@@ -35,7 +70,10 @@ namespace ncr_test
 			ctors
 		*/
 
-		number_sets() {
+		number_sets() :
+			stats_enabled(false),
+			memory_limit(batch_options::default_memory_limit)
+		{
 			static_assert(std::is_integral<T>::value, "Integral type required.");
 		}
 
@@ -44,29 +82,127 @@ namespace ncr_test
 		*/
 
 		// returns false for duplicate... true otherwise
+		// throws std::runtime_error for invalid input, which is kept in the invalid inputs
 		bool add(const string_type& input) {
-			bool ret;
+			parse_error error;
+			bool ret = try_add(input, error);
 
-			try
-			{
-				ret = consume_number_set<T, CharT>(
-					produce_number_set<T, CharT>(input), data);
-			}
-			catch (...)
+			if (error)
+				throw std::runtime_error("Invalid input");
+
+			return ret;
+		}
+
+		// add without exceptions for invalid input
+		// error tells why input is invalid, it is kept in the invalid inputs as with add
+		// returns false for duplicate or invalid input... true otherwise
+		bool try_add(const string_type& input, parse_error& error) {
+			std::vector<T> numbers;
+			uint64_t hash;
+			error = try_produce_hashed_number_set<T, CharT, HashPolicy>(input, numbers, hash);
+
+			if (error)
 			{
 				data.invalid_inputs.push_back(input);
-				throw;
+				return false;
 			}
 
-			return ret;
+			return consume_number_set(numbers, hash, data);
+		}
+
+		// makes room for set_count unique sets
+		// so that the table doesn't need to grow during a large run
+		void reserve(std::size_t set_count) {
+			data.reserve(set_count);
+		}
+
+		// reserves for as many unique sets as there are lines in the file
+		// an upper bound, as duplicates and invalid lines don't need room
+		void reserve_for_file(const std::string& filename) {
+			reserve(mapped_file(filename).estimate_line_count());
 		}
 
 		// another add mechanism that works on the whole input file
 		// uses concurrency to improve performance
-		// supported for T = int and CharT = char
-		void add_batch_mode(const string_type& filename, int producer_count) {
-			static_assert(std::is_same<T, int>::value && std::is_same<CharT, char>::value, "only T = int and CharT = char is accepted");
-			add_number_sets_concurrent(filename, data, producer_count);
+		// producer_count is the size of the thread pool parsing the file, the pool is kept for the next calls
+		// shard_count > 1 splits the table over several consumer threads
+		// supported for the T and CharT accepted by is_fast_parsed, see add_number_sets_concurrent for the file format
+		void add_batch_mode(const std::string& filename, int producer_count, int shard_count = 1) {
+			static_assert(is_fast_parsed<T, CharT>::value, "batch mode needs CharT = char or wchar_t, and an integral T other than character types");
+			add_number_sets_concurrent(filename, data, get_producers(producer_count), get_batch_options(shard_count));
+		}
+
+		// add_batch_mode for several files at once, e.g. list_files("logs/*.txt")
+		// the files go through the same pipeline run, which is faster than one call per file when there are many small ones
+		void add_batch_mode_files(const std::vector<std::string>& filenames, int producer_count, int shard_count = 1) {
+			static_assert(is_fast_parsed<T, CharT>::value, "batch mode needs CharT = char or wchar_t, and an integral T other than character types");
+			add_number_sets_concurrent(filenames, data, get_producers(producer_count), get_batch_options(shard_count));
+		}
+
+		// add_batch_mode for append only files, e.g. logs
+		// only processes what has been appended to the file since the last call for the same filename
+		// a last line without newline is left for the next call, as it may still be being written
+		// throws std::runtime_error if the file got shorter than what has been processed
+		void add_batch_mode_appended(const std::string& filename, int producer_count, int shard_count = 1) {
+			static_assert(is_fast_parsed<T, CharT>::value, "batch mode needs CharT = char or wchar_t, and an integral T other than character types");
+
+			std::size_t& offset = appended_offsets[filename];
+
+			batch_options options = get_batch_options(shard_count);
+			options.start_offset = offset;
+			options.whole_lines_only = true;
+
+			offset = add_number_sets_concurrent(filename, data, get_producers(producer_count), options);
+		}
+
+		// batch mode calls collect statistics while enabled, see get_stats
+		void enable_stats(bool enable = true) {
+			stats_enabled = enable;
+		}
+
+		// how batch mode calls read the file, memory mapped by default
+		// read.async reads it in chunks with several reads in flight, see chunk_reader.h
+		void set_read_options(const read_options& read) {
+			file_read_options = read;
+		}
+
+		// the memory batch mode calls may use, in bytes, for the parsed sets on their way to the table
+		// producers wait while the limit is reached, the table itself isn't counted
+		void set_memory_limit(std::size_t bytes) {
+			memory_limit = bytes;
+		}
+
+		// where the numbers of the sets are stored from now on, see arena_allocator
+		// e.g. to keep them in an arena of mimalloc or jemalloc
+		void set_allocator(const arena_allocator& allocator) {
+			data.arena.set_allocator(allocator);
+		}
+
+		// adds all the sets and invalid inputs of other, which is left empty
+		// occurences of the sets found in both are summed up, the sets only in other come after the ones already here
+		// e.g. to combine the number sets built for several partitions of the input
+		void merge(number_sets&& other) {
+			if (&other != this)
+				merge_number_sets_data(std::move(other.data), data);
+		}
+
+		// merge for many instances at once, split by hash in partitions merged in parallel by thread_count threads
+		// the thread pool is the one of add_batch_mode
+		void merge(const std::vector<number_sets*>& others, int thread_count) {
+			std::vector<data_type*> sources;
+			for (number_sets* other : others)
+			{
+				if (other != this && std::find(sources.begin(), sources.end(), &other->data) == sources.end())
+					sources.push_back(&other->data);
+			}
+
+			merge_number_sets_data(sources, data, get_producers(thread_count));
+		}
+
+		// replaces the content with a snapshot written by save
+		// throws std::runtime_error if the file isn't a snapshot of the same T, CharT and HashPolicy
+		void load(const std::string& filename) {
+			load_snapshot(filename, data);
 		}
 
 		/*
@@ -77,9 +213,9 @@ namespace ncr_test
 			return data.invalid_inputs;
 		}
 		const number_set<T> get_most_frequent_data() const {
-			return data.most_frequent ?
-				*data.most_frequent :
-				number_set<T>{ vector<T>{}, 0 };
+			return data.most_frequent != data.npos ?
+				number_set<T>{ data.get_numbers(data.most_frequent), data.records[data.most_frequent].occurences } :
+				number_set<T>{ std::vector<T>{}, 0 };
 		}
 		int get_duplicate_count() const {
 			return data.duplicate_count;
@@ -87,8 +223,39 @@ namespace ncr_test
 		int get_non_duplicate_count() const {
 			return data.non_duplicate_count;
 		}
-		const_ref_data_container_type get_data() const {
-			return data.number_sets;
+		// writes all the content to a binary snapshot, see snapshot.h
+		void save(const std::string& filename) const {
+			save_snapshot(data, filename);
+		}
+
+		// writes every set with its occurences to out, one "occurences<tab>n1, n2, ..." line per set, see export_number_sets.h
+		// the sets are sorted and formatted by thread_count threads, the thread pool is the one of add_batch_mode
+		void export_sets(std::ostream& out, export_order order = export_order::occurences, int thread_count = 1) {
+			export_number_sets(data, out, order, get_producers(thread_count));
+		}
+		// export_sets to a file, throws std::runtime_error if it can't be written
+		void export_sets(const std::string& filename, export_order order = export_order::occurences, int thread_count = 1) {
+			export_number_sets(data, filename, order, get_producers(thread_count));
+		}
+		// the k sets with the most occurences, most frequent first, O(k)
+		// sets with the same occurences are in the order they reached that count
+		// views are invalidated by any modifier
+		std::vector<number_set_view<T>> get_top_k(std::size_t k) const {
+			std::vector<number_set_view<T>> top;
+
+			for (uint32_t record : data.ranking.top(k))
+				top.push_back(number_set_view<T>{ data.get_numbers(record), data.records[record].occurences });
+
+			return top;
+		}
+		// statistics of the last batch mode call made while enable_stats was on
+		const pipeline_stats& get_stats() const {
+			return stats;
+		}
+		// lightweight view, number sets are not copied
+		// invalidated by any modifier
+		data_view_type get_data() const {
+			return data.get_view();
 		}
 	};
 }
@@ -1,8 +1,20 @@
 #pragma once
 
 #include "routines.h"
-
-#include <unordered_set>
+#include "hash_policies.h"
+#include "set_index.h"
+#include "number_arena.h"
+#include "sort_numbers.h"
+#include "occurence_ranking.h"
+#include "chunk_reader.h"
+#include "pipeline_stats.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <type_traits>
 
 /*
 	Contains implementation details for number_sets class
@@ -12,29 +24,41 @@ namespace ncr_test
 {
 	/*
 		number_set structure
+		an owning copy of a number set, handed out to the users of number_sets
 	*/
 	template<typename T>
 	struct number_set
 	{
 		std::vector<T> numbers;
-
-		// unordered_set doesn't allow modifying content
-		// but as we know, occurances don't participate in hash key generation,
-		// so we can safely make it mutable
-		mutable int occurences;
+		int occurences;
 
 		number_set(const std::vector<T>& _numbers, int _occ = 1) :
 			numbers(_numbers),
 			occurences(_occ)
 		{}
+
+		number_set(const array_ref<T>& _numbers, int _occ = 1) :
+			numbers(_numbers.to_vector()),
+			occurences(_occ)
+		{}
 	};
 
-	template<typename T>
+	template<typename T, typename HashPolicy = default_hash_policy>
 	struct hasher
 	{
-		std::size_t operator()(number_set<T> const& s) const
+		uint64_t operator()(array_ref<T> const& numbers) const
 		{
-			return hash_value(s.numbers);
+			return HashPolicy::hash(numbers);
+		}
+
+		uint64_t operator()(std::vector<T> const& numbers) const
+		{
+			return HashPolicy::hash(array_ref<T>(numbers));
+		}
+
+		uint64_t operator()(number_set<T> const& s) const
+		{
+			return HashPolicy::hash(array_ref<T>(s.numbers));
 		}
 	};
 
@@ -44,70 +68,287 @@ namespace ncr_test
 		return lhs.numbers == rhs.numbers;
 	}
 
+	/*
+		number_set_view structure
+		a non owning view of a number set stored inside number_sets_data
+	*/
+	template<typename T>
+	struct number_set_view
+	{
+		array_ref<T> numbers;
+		int occurences;
+	};
+
+
+
+	/*
+		set_record structure
+		numbers of all the sets are stored back to back in a single arena
+		a record locates one set in the arena, and caches its hash
+	*/
+	struct set_record
+	{
+		std::size_t offset;
+		std::size_t length;
+		uint64_t hash;
+		int occurences;
+	};
+
+	/*
+		class number_sets_view
+		read only range over the number sets, in insertion order
+		iterating yields number_set_view objects pointing into the arena
+	*/
+	template<typename T>
+	class number_sets_view
+	{
+		const std::vector<set_record>* records;
+		const number_arena<T>* arena;
+
+	public:
+		class const_iterator
+		{
+			std::vector<set_record>::const_iterator pos;
+			const number_arena<T>* arena;
+
+		public:
+			using iterator_category = std::input_iterator_tag;
+			using value_type = number_set_view<T>;
+			using difference_type = std::ptrdiff_t;
+			using pointer = const number_set_view<T>*;
+			using reference = number_set_view<T>;
+
+			// views are created on the fly, so operator-> needs something to point to
+			struct arrow_proxy
+			{
+				number_set_view<T> view;
+				const number_set_view<T>* operator->() const { return &view; }
+			};
+
+			const_iterator(std::vector<set_record>::const_iterator _pos, const number_arena<T>* _arena) :
+				pos(_pos),
+				arena(_arena)
+			{}
+
+			number_set_view<T> operator*() const {
+				return number_set_view<T>{ arena->get(pos->offset, pos->length), pos->occurences };
+			}
+			arrow_proxy operator->() const { return arrow_proxy{ **this }; }
+			const_iterator& operator++() { ++pos; return *this; }
+			const_iterator operator++(int) { const_iterator res(*this); ++pos; return res; }
+			bool operator==(const const_iterator& other) const { return pos == other.pos; }
+			bool operator!=(const const_iterator& other) const { return pos != other.pos; }
+		};
+
+		number_sets_view(const std::vector<set_record>& _records, const number_arena<T>& _arena) :
+			records(&_records),
+			arena(&_arena)
+		{}
+
+		const_iterator begin() const { return const_iterator(records->begin(), arena); }
+		const_iterator end() const { return const_iterator(records->end(), arena); }
+		std::size_t size() const { return records->size(); }
+		bool empty() const { return records->empty(); }
+	};
+
 
 
 	/*
 		struct number_sets_data
 	*/
 
-	template<typename T, typename CharT = char>
+	template<typename T, typename CharT = char, typename HashPolicy = default_hash_policy>
 	struct number_sets_data : private noncopyable
 	{
 		// type definitions
+		using value_type = T;
+		using char_type = CharT;
+		using hash_policy = HashPolicy;
+		using hasher_type = hasher<T, HashPolicy>;
 		using string_type = std::basic_string<CharT>;
-		using data_container_type = std::unordered_set<number_set<T>, hasher<T>>;
-		using const_ref_data_container_type = const std::unordered_set<number_set<T>, hasher<T>>&;
+		using arena_type = number_arena<T>;
+		using records_type = std::vector<set_record>;
+		using index_type = set_index;
+		using ranking_type = occurence_ranking;
+		using data_view_type = number_sets_view<T>;
 		using invalid_inputs_type = std::vector<std::basic_string<CharT>>;
 		using const_ref_invalid_inputs_type = const std::vector<std::basic_string<CharT>>&;
 
+		static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
 
 		// variables
-		data_container_type number_sets;
+		arena_type arena;
+		records_type records;
+		index_type index;
+		ranking_type ranking;
 		invalid_inputs_type invalid_inputs;
-		const number_set<T>* most_frequent;
+		std::size_t most_frequent; // index of the record, npos if there is no data
 		int duplicate_count;
 		int non_duplicate_count;
 
 		// ctor
 		number_sets_data() :
-			most_frequent(nullptr),
+			most_frequent(npos),
 			duplicate_count(0),
 			non_duplicate_count(0)
 		{}
+
+		array_ref<T> get_numbers(std::size_t record) const {
+			return arena.get(records[record].offset, records[record].length);
+		}
+
+		// makes room for set_count unique sets without growing the index
+		void reserve(std::size_t set_count) {
+			records.reserve(set_count);
+			index.reserve(set_count);
+			ranking.reserve(set_count);
+		}
+
+		data_view_type get_view() const {
+			return data_view_type(records, arena);
+		}
+
+		void clear() {
+			arena.clear();
+			records.clear();
+			index.clear();
+			ranking.clear();
+			invalid_inputs.clear();
+			most_frequent = npos;
+			duplicate_count = 0;
+			non_duplicate_count = 0;
+		}
 	};
 
 
-	template<typename T, typename CharT>
-	bool consume_number_set(const std::vector<T>& input, number_sets_data<T, CharT> &data)
+	// adds occurences to the record of a set, and updates the counters
+	template<typename T, typename CharT, typename HashPolicy>
+	void count_number_set_occurences(std::size_t record_index, int occurences, number_sets_data<T, CharT, HashPolicy> &data)
 	{
-		bool ret = false;
-
-		auto res = data.number_sets.emplace(input);
-		if (!res.second)
-			res.first->occurences++;
+		set_record& record = data.records[record_index];
+		int prev_occurences = record.occurences;
+		record.occurences += occurences;
 
-		if (!data.most_frequent || data.most_frequent->occurences < res.first->occurences)
-			data.most_frequent = &(*res.first);
+		// remove the contribution of the previous occurences...
+		if (prev_occurences == 1)
+			data.non_duplicate_count--;
+		else if (prev_occurences > 1)
+			data.duplicate_count -= prev_occurences;
 
-		if (res.first->occurences == 1)
+		// ...and add the contribution of the new ones
+		if (record.occurences == 1)
 			data.non_duplicate_count++;
-		else if (res.first->occurences == 2)
+		else
+			data.duplicate_count += record.occurences;
+
+		if (data.most_frequent == data.npos || data.records[data.most_frequent].occurences < record.occurences)
+			data.most_frequent = record_index;
+
+		const auto& records = data.records;
+		data.ranking.add_occurences(static_cast<uint32_t>(record_index), prev_occurences, record.occurences, [&records](uint32_t r) { return records[r].occurences; });
+	}
+
+	// adds occurences of a number set to data, storing the set if it is new
+	// hash must be the hasher_type value of numbers
+	// returns the index of the record of the set
+	template<typename T, typename CharT, typename HashPolicy>
+	std::size_t add_number_set_occurences(const array_ref<T>& numbers, uint64_t hash, int occurences, number_sets_data<T, CharT, HashPolicy> &data)
+	{
+		auto res = data.index.find_or_insert(hash, static_cast<uint32_t>(data.records.size()), [&](uint32_t record) {
+			return data.get_numbers(record) == numbers;
+		});
+
+		// only new sets are copied into the arena
+		if (res.second)
+			data.records.push_back(set_record{ data.arena.append(numbers), numbers.size(), hash, 0 });
+
+		count_number_set_occurences(res.first, occurences, data);
+
+		return res.first;
+	}
+
+	// add_number_set_occurences for numbers in any order, the hash policy must be order independent
+	// a match is verified without sorting numbers, they are only sorted if the set is new
+	template<typename T, typename CharT, typename HashPolicy>
+	std::size_t add_unsorted_number_set_occurences(const array_ref<T>& numbers, uint64_t hash, int occurences, number_sets_data<T, CharT, HashPolicy> &data)
+	{
+		static_assert(is_order_independent<HashPolicy>::value, "Order independent hash policy required.");
+
+		auto res = data.index.find_or_insert(hash, static_cast<uint32_t>(data.records.size()), [&](uint32_t record) {
+			return is_permutation_of_sorted(data.get_numbers(record), numbers);
+		});
+
+		if (res.second)
 		{
-			data.duplicate_count += 2;
-			data.non_duplicate_count--;
+			thread_local std::vector<T> sorted;
+			sorted.assign(numbers.begin(), numbers.end());
+			sort_numbers(sorted);
+
+			data.records.push_back(set_record{ data.arena.append(array_ref<T>(sorted)), numbers.size(), hash, 0 });
 		}
-		else
-			data.duplicate_count++;
 
-		ret = (res.first->occurences == 1);
+		count_number_set_occurences(res.first, occurences, data);
+
+		return res.first;
+	}
+
+	template<typename T, typename CharT, typename HashPolicy>
+	std::size_t add_number_set_occurence(const array_ref<T>& numbers, uint64_t hash, number_sets_data<T, CharT, HashPolicy> &data, std::false_type)
+	{
+		return add_number_set_occurences(numbers, hash, 1, data);
+	}
+
+	template<typename T, typename CharT, typename HashPolicy>
+	std::size_t add_number_set_occurence(const array_ref<T>& numbers, uint64_t hash, number_sets_data<T, CharT, HashPolicy> &data, std::true_type)
+	{
+		return add_unsorted_number_set_occurences(numbers, hash, 1, data);
+	}
+
+	// hash must be the hasher_type value of input
+	// input must be sorted, unless the hash policy is order independent
+	// input is only copied, into the arena, if the set is new
+	template<typename T, typename CharT, typename HashPolicy>
+	bool consume_number_set(const array_ref<T>& input, uint64_t hash, number_sets_data<T, CharT, HashPolicy> &data)
+	{
+		std::size_t record = add_number_set_occurence(input, hash, data, is_order_independent<HashPolicy>());
+
+		return data.records[record].occurences == 1;
+	}
+
+	template<typename T, typename CharT, typename HashPolicy>
+	bool consume_number_set(const std::vector<T>& input, uint64_t hash, number_sets_data<T, CharT, HashPolicy> &data)
+	{
+		return consume_number_set(array_ref<T>(input), hash, data);
+	}
 
-		return ret;
+	template<typename T, typename CharT, typename HashPolicy>
+	bool consume_number_set(const std::vector<T>& input, number_sets_data<T, CharT, HashPolicy> &data)
+	{
+		return consume_number_set(input, hasher<T, HashPolicy>()(input), data);
+	}
+
+	// moves all number sets and invalid inputs from source into target
+	// occurences of sets present in both are summed up, counters are kept consistent
+	// hashes are taken from the records of source, source is left empty
+	template<typename T, typename CharT, typename HashPolicy>
+	void merge_number_sets_data(number_sets_data<T, CharT, HashPolicy> &&source, number_sets_data<T, CharT, HashPolicy> &target)
+	{
+		target.reserve(target.records.size() + source.records.size());
+
+		for (std::size_t i = 0; i < source.records.size(); ++i)
+			add_number_set_occurences(source.get_numbers(i), source.records[i].hash, source.records[i].occurences, target);
+
+		target.invalid_inputs.insert(target.invalid_inputs.end(),
+			std::make_move_iterator(source.invalid_inputs.begin()), std::make_move_iterator(source.invalid_inputs.end()));
+
+		source.clear();
 	}
 
 
 	// default parsing using C++ stringstream
 	template<typename T, typename CharT>
-	std::vector<T> get_numbers(const std::basic_string<CharT>& input)
+	std::vector<T> get_numbers_stringstream(const std::basic_string<CharT>& input)
 	{
 		std::vector<T> numbers;
 
@@ -121,33 +362,170 @@ namespace ncr_test
 		return numbers;
 	}
 
-	template<>
-	std::vector<int> get_numbers<int, char>(const std::string& input);
+	template<typename T>
+	struct is_char_type : std::integral_constant<bool,
+		std::is_same<T, char>::value || std::is_same<T, signed char>::value || std::is_same<T, unsigned char>::value ||
+		std::is_same<T, wchar_t>::value || std::is_same<T, char16_t>::value || std::is_same<T, char32_t>::value>
+	{};
 
+	// the types parsed by parse_integers, all the others use the stringstream parsing
+	// character types (and bool) are read as such by streams, not as numbers, so they are left to it
 	template<typename T, typename CharT>
-	std::vector<T> produce_number_set(const std::basic_string<CharT>& input)
+	struct is_fast_parsed : std::integral_constant<bool,
+		std::is_integral<T>::value && !std::is_same<T, bool>::value && !is_char_type<T>::value &&
+		(std::is_same<CharT, char>::value || std::is_same<CharT, wchar_t>::value)>
+	{};
+
+	/*
+		parse_error structure
+		why a line isn't a valid number set, and where
+	*/
+	enum class parse_error_kind
 	{
-		std::vector<T> numbers;
-		bool add_failed = false;
+		none,
+		empty, // no numbers at all
+		invalid_character, // anything but digits, commas, minus signs and whitespace
+		missing_number, // a comma or minus sign without digits
+		missing_comma, // numbers not separated by a comma
+		out_of_range, // a number not fitting in T, or a negative one for an unsigned T
+		invalid_number // rejected by the stringstream parsing, which doesn't tell where
+	};
+
+	struct parse_error
+	{
+		parse_error_kind kind;
+		std::size_t offset; // in bytes from the start of the line
+
+		parse_error(parse_error_kind _kind = parse_error_kind::none, std::size_t _offset = 0) :
+			kind(_kind),
+			offset(_offset)
+		{}
+
+		// true if there is an error
+		explicit operator bool() const { return kind != parse_error_kind::none; }
+	};
+
+	// fast parsing of [first, last) into numbers, see parse_ints_fast.cpp
+	// numbers is cleared first, and left empty on error
+	template<typename T, typename CharT>
+	parse_error parse_integers(const CharT* first, const CharT* last, std::vector<T>& numbers);
 
+	template<typename T, typename CharT>
+	parse_error parse_numbers(const basic_string_ref<CharT>& input, std::vector<T>& numbers, std::true_type)
+	{
+		return parse_integers<T, CharT>(input.begin(), input.end(), numbers);
+	}
+
+	// not on any hot path, the types parsed by streams aren't supported by batch mode
+	template<typename T, typename CharT>
+	parse_error parse_numbers(const basic_string_ref<CharT>& input, std::vector<T>& numbers, std::false_type)
+	{
 		try
 		{
-			numbers = get_numbers<T, CharT>(input);
+			numbers = get_numbers_stringstream<T, CharT>(input.to_string());
 		}
 		catch (std::runtime_error&)
 		{
-			add_failed = true;
+			numbers.clear();
+			return parse_error(parse_error_kind::invalid_number);
 		}
 
-		if (numbers.empty())
-			add_failed = true;
+		return parse_error();
+	}
 
-		if (add_failed)
-		{
+	// parses the numbers of input, in the order they appear
+	// invalid input is reported through the result, nothing is thrown
+	// the capacity of numbers is reused, so a single vector can serve many lines
+	template<typename T, typename CharT>
+	parse_error parse_numbers(const basic_string_ref<CharT>& input, std::vector<T>& numbers)
+	{
+		return parse_numbers<T, CharT>(input, numbers, is_fast_parsed<T, CharT>());
+	}
+
+	// throwing version of parse_numbers
+	template<typename T, typename CharT>
+	std::vector<T> get_numbers(const basic_string_ref<CharT>& input)
+	{
+		std::vector<T> numbers;
+
+		if (parse_numbers<T, CharT>(input, numbers))
 			throw std::runtime_error("Invalid input");
-		}
 
-		sort(numbers.begin(), numbers.end());
+		return numbers;
+	}
+
+	template<typename T, typename CharT>
+	std::vector<T> get_numbers(const std::basic_string<CharT>& input)
+	{
+		return get_numbers<T, CharT>(basic_string_ref<CharT>(input.data(), input.data() + input.size()));
+	}
+
+	// numbers is set to the sorted number set of input
+	// a line without numbers is invalid too
+	template<typename T, typename CharT>
+	parse_error try_produce_number_set(const basic_string_ref<CharT>& input, std::vector<T>& numbers)
+	{
+		parse_error error = parse_numbers<T, CharT>(input, numbers);
+
+		if (!error && numbers.empty())
+			error = parse_error(parse_error_kind::empty);
+
+		if (!error)
+			sort_numbers(numbers);
+
+		return error;
+	}
+
+	template<typename HashPolicy, typename T>
+	uint64_t canonical_hash(std::vector<T>& numbers, std::false_type)
+	{
+		return sort_and_hash<HashPolicy>(numbers);
+	}
+
+	// order independent hashes are taken as the numbers were parsed, they are left unsorted
+	template<typename HashPolicy, typename T>
+	uint64_t canonical_hash(std::vector<T>& numbers, std::true_type)
+	{
+		return HashPolicy::hash(array_ref<T>(numbers));
+	}
+
+	// try_produce_number_set, also giving the HashPolicy hash of the set
+	// numbers are left in input order by order independent hash policies, see consume_number_set
+	template<typename T, typename CharT, typename HashPolicy>
+	parse_error try_produce_hashed_number_set(const basic_string_ref<CharT>& input, std::vector<T>& numbers, uint64_t& hash)
+	{
+		parse_error error = parse_numbers<T, CharT>(input, numbers);
+
+		if (!error && numbers.empty())
+			error = parse_error(parse_error_kind::empty);
+
+		if (!error)
+			hash = canonical_hash<HashPolicy>(numbers, is_order_independent<HashPolicy>());
+
+		return error;
+	}
+
+	template<typename T, typename CharT, typename HashPolicy>
+	parse_error try_produce_hashed_number_set(const std::basic_string<CharT>& input, std::vector<T>& numbers, uint64_t& hash)
+	{
+		return try_produce_hashed_number_set<T, CharT, HashPolicy>(basic_string_ref<CharT>(input.data(), input.data() + input.size()), numbers, hash);
+	}
+
+	template<typename T, typename CharT>
+	parse_error try_produce_number_set(const std::basic_string<CharT>& input, std::vector<T>& numbers)
+	{
+		return try_produce_number_set<T, CharT>(basic_string_ref<CharT>(input.data(), input.data() + input.size()), numbers);
+	}
+
+	// throwing version of try_produce_number_set
+	// InputT is either std::basic_string<CharT> or basic_string_ref<CharT>
+	template<typename T, typename CharT, typename InputT>
+	std::vector<T> produce_number_set(const InputT& input)
+	{
+		std::vector<T> numbers;
+
+		if (try_produce_number_set<T, CharT>(input, numbers))
+			throw std::runtime_error("Invalid input");
 
 		return numbers;
 	}
@@ -156,5 +534,47 @@ namespace ncr_test
 	Concurrent implementation to add numbers sets
 	*/
 
-	void add_number_sets_concurrent(const std::string& filename, number_sets_data<int, char> &data, int producers_count);
+	class task_pool;
+
+	struct batch_options
+	{
+		static constexpr std::size_t default_memory_limit = std::size_t(256) << 20;
+
+		int shard_count; // shard_count > 1 splits the table over several consumer threads
+		std::size_t start_offset; // only the part of the file from start_offset on is processed, must be the start of a line
+		bool whole_lines_only; // leaves out a last line not terminated by a newline
+		pipeline_stats* stats; // filled with the statistics of the run if not null
+		read_options read; // how the file is read, it is memory mapped by default
+		std::size_t memory_limit; // in bytes, for the batches between producers and consumers, see add_number_sets_concurrent
+
+		batch_options() :
+			shard_count(1),
+			start_offset(0),
+			whole_lines_only(false),
+			stats(nullptr),
+			memory_limit(default_memory_limit)
+		{}
+	};
+
+	// the file is parsed by the workers of producers, which can be reused between calls
+	// it is memory mapped, or read in chunks by chunk_reader if options.read.async is set
+	// number sets are distributed over shard_count independent consumers by their hash
+	// each consumer owns a separate table, tables are merged into data at the end
+	// batches of parsed sets are sized in bytes, from the throughput of the consumers
+	// the batches being filled, queued or consumed hold at most options.memory_limit bytes, producers wait while they would go over it
+	// the file holds CharT characters in native byte order, e.g. utf-16 for wchar_t on windows
+	// a byte order mark at the start of a wide file is skipped
+	// returns the offset in bytes up to which the file has been processed
+	// instantiated in add_number_sets_concurrent.cpp for every hash policy, and every T and CharT accepted by is_fast_parsed
+	template<typename T, typename CharT, typename HashPolicy>
+	std::size_t add_number_sets_concurrent(const std::string& filename, number_sets_data<T, CharT, HashPolicy> &data, task_pool &producers,
+		const batch_options& options = batch_options());
+
+	// the same for several files, processed as one input by a single run of the pipeline
+	// the files are cut in ranges of the same size whatever the size of every file, so producers share the work by size
+	// only the files being parsed are mapped at a time, with options.read.async they are read one after the other
+	// options.start_offset and options.whole_lines_only are not used
+	template<typename T, typename CharT, typename HashPolicy>
+	void add_number_sets_concurrent(const std::vector<std::string>& filenames, number_sets_data<T, CharT, HashPolicy> &data, task_pool &producers,
+		const batch_options& options = batch_options());
 }
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "routines.h"
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <algorithm>
+
+/*
+	class occurence_ranking
+	keeps the records of number_sets_data sorted by occurences, so that the top k sets are available in O(k)
+	* records are in descending order of occurences, records with the same occurences form a segment
+	* one more occurence moves a record to the front of its segment, where it becomes the last of the next one... O(1)
+	* so within a segment records are in the order they reached the occurences, the first one matches most_frequent
+	* records are identified by their index, occurences are read through a function given by the caller
+*/
+
+// source: stream summary, Metwally et al. "Efficient Computation of Frequent and Top-k Elements in Data Streams"
+
+namespace ncr_test
+{
+	class occurence_ranking
+	{
+		std::vector<uint32_t> ranked; // records by occurences, descending
+		std::vector<uint32_t> positions; // position of every record in ranked
+		std::vector<uint32_t> segment_starts; // position of the first record with the given occurences, if there is one
+
+	private:
+		void set_segment_start(int occurences, uint32_t pos) {
+			if (segment_starts.size() <= static_cast<std::size_t>(occurences))
+				segment_starts.resize(occurences + 1);
+			segment_starts[occurences] = pos;
+		}
+
+		// record goes from occurences - 1 to occurences
+		template<typename OccurencesOf>
+		void increment(uint32_t record, int occurences, OccurencesOf occurences_of) {
+			uint32_t& first = segment_starts[occurences - 1];
+			uint32_t pos = positions[record];
+
+			std::swap(ranked[pos], ranked[first]);
+			positions[ranked[pos]] = pos;
+			positions[record] = first;
+
+			pos = first++;
+
+			// the record ends the segment before it... or starts a new one
+			if (pos == 0 || occurences_of(ranked[pos - 1]) != occurences)
+				set_segment_start(occurences, pos);
+		}
+
+	public:
+		// the occurences of record went from prev_occurences to occurences
+		// prev_occurences is 0 for a new record, which must be the one following the last record added
+		// occurences_of(record) returns the current occurences of any record
+		template<typename OccurencesOf>
+		void add_occurences(uint32_t record, int prev_occurences, int occurences, OccurencesOf occurences_of) {
+			if (prev_occurences == 0)
+			{
+				// a new record is last, with 1 occurence
+				uint32_t pos = static_cast<uint32_t>(ranked.size());
+				ranked.push_back(record);
+				positions.push_back(pos);
+
+				if (pos == 0 || occurences_of(ranked[pos - 1]) != 1)
+					set_segment_start(1, pos);
+
+				prev_occurences = 1;
+			}
+
+			// one occurence at a time, so that no segment is skipped
+			for (int i = prev_occurences + 1; i <= occurences; ++i)
+				increment(record, i, occurences_of);
+		}
+
+		// rebuilds the ranking from records already in ranked order, e.g. from a snapshot
+		template<typename OccurencesOf>
+		void assign(std::vector<uint32_t> _ranked, OccurencesOf occurences_of) {
+			ranked = std::move(_ranked);
+			positions.assign(ranked.size(), 0);
+			segment_starts.clear();
+
+			for (uint32_t pos = 0; pos < ranked.size(); ++pos)
+			{
+				positions[ranked[pos]] = pos;
+
+				int occurences = occurences_of(ranked[pos]);
+				if (pos == 0 || occurences_of(ranked[pos - 1]) != occurences)
+					set_segment_start(occurences, pos);
+			}
+		}
+
+		// records with the most occurences first
+		array_ref<uint32_t> top(std::size_t k) const {
+			return array_ref<uint32_t>(ranked.data(), std::min(k, ranked.size()));
+		}
+
+		// a record with the fewest occurences, there must be at least one record
+		uint32_t bottom() const {
+			return ranked.back();
+		}
+
+		std::size_t size() const {
+			return ranked.size();
+		}
+
+		void reserve(std::size_t set_count) {
+			ranked.reserve(set_count);
+			positions.reserve(set_count);
+		}
+
+		void clear() {
+			ranked.clear();
+			positions.clear();
+			segment_starts.clear();
+		}
+	};
+}
@@ -1,221 +1,478 @@
 #include "number_sets_impl.h"
 
+#include <array>
 #include <string>
 #include <vector>
+#include <cstdint>
+#include <cstring>
+#include <climits>
+#include <limits>
+#include <type_traits>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define NCR_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// msvc allows using any intrinsic in any function
+// gcc and clang need the target to be enabled per function
+#if defined(NCR_X86) && !defined(_MSC_VER)
+#define NCR_TARGET(features) __attribute__((target(features)))
+#else
+#define NCR_TARGET(features)
+#endif
 
 using namespace std;
 using namespace ncr_test;
 
 /*
-	interface for class parse_ints_fast
+	Parsing is done in two passes over a line:
+	* classify - checks that the line only contains digits, commas, minus signs and whitespace
+	  and counts the commas, so that the result can be reserved up front
+	  done 32 (avx2) or 16 (sse4.2) bytes at a time, picked at runtime using cpuid
+	* tokenize - walks the numbers, digit runs are converted 8 digits at a time
+
+	Accepted input: comma separated integers, each optionally preceded by minus
+	and surrounded by whitespace, a single trailing comma is allowed
+	minus is only accepted for signed T
+
+	wide characters are classified and converted one at a time, only the ascii range is accepted
 */
-class parse_ints_fast
+
+namespace
 {
-private:
-	enum class num_state_enum
+	/*
+		classification
+	*/
+
+	enum char_class : uint8_t
 	{
-		ready_to_start, // can start reading new number
-		started, // reading number
-		finished // finished reading... looking for comma or end of string
+		invalid_class = 0,
+		digit_class = 1,
+		space_class = 2,
+		comma_class = 4,
+		minus_class = 8
 	};
 
-	enum class char_state_enum
+	// same characters as isspace and isdigit in the "C" locale
+	array<uint8_t, 256> make_char_classes()
+	{
+		array<uint8_t, 256> classes;
+		classes.fill(invalid_class);
+
+		for (char ch = '0'; ch <= '9'; ++ch)
+			classes[static_cast<unsigned char>(ch)] = digit_class;
+		for (char ch : { ' ', '\t', '\n', '\v', '\f', '\r' })
+			classes[static_cast<unsigned char>(ch)] = space_class;
+		classes[','] = comma_class;
+		classes['-'] = minus_class;
+
+		return classes;
+	}
+
+	const array<uint8_t, 256> char_classes = make_char_classes();
+
+	inline uint8_t get_char_class(char ch)
+	{
+		return char_classes[static_cast<unsigned char>(ch)];
+	}
+
+	template<typename CharT>
+	inline uint8_t get_char_class(CharT ch)
+	{
+		using unsigned_char_type = typename make_unsigned<CharT>::type;
+		unsigned_char_type code = static_cast<unsigned_char_type>(ch);
+
+		return code < char_classes.size() ? char_classes[code] : static_cast<uint8_t>(invalid_class);
+	}
+
+	struct line_summary
 	{
-		space,
-		comma,
-		minus,
-		digit,
-		invalid
+		bool valid;
+		size_t comma_count;
 	};
 
-	num_state_enum num_state;
-	bool negative;
-	long long int num; // long long used for overflow detection
-	vector<int> result;
+	template<typename CharT>
+	line_summary classify_scalar(const CharT* begin, const CharT* end)
+	{
+		line_summary summary{ true, 0 };
+
+		for (; begin != end; ++begin)
+		{
+			uint8_t ch_class = get_char_class(*begin);
+
+			if (ch_class == invalid_class)
+				return line_summary{ false, 0 };
+
+			summary.comma_count += (ch_class == comma_class);
+		}
+
+		return summary;
+	}
+
+#ifdef NCR_X86
+
+	NCR_TARGET("sse4.2,popcnt")
+	line_summary classify_sse42(const char* begin, const char* end)
+	{
+		// digits, comma and minus, \t to \r, space
+		const __m128i ranges = _mm_setr_epi8('0', '9', ',', '-', '\t', '\r', ' ', ' ', 0, 0, 0, 0, 0, 0, 0, 0);
+		const __m128i commas = _mm_set1_epi8(',');
+
+		size_t comma_count = 0;
+
+		for (; end - begin >= 16; begin += 16)
+		{
+			__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+
+			// carry is set if any byte of block is outside of the ranges
+			if (_mm_cmpestrc(ranges, 8, block, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_NEGATIVE_POLARITY))
+				return line_summary{ false, 0 };
+
+			comma_count += _mm_popcnt_u32(static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(block, commas))));
+		}
+
+		line_summary tail = classify_scalar(begin, end);
+		tail.comma_count += comma_count;
+
+		return tail;
+	}
+
+	NCR_TARGET("avx2,popcnt")
+	line_summary classify_avx2(const char* begin, const char* end)
+	{
+		const __m256i zero_char = _mm256_set1_epi8('0');
+		const __m256i nine = _mm256_set1_epi8(9);
+		const __m256i tab_char = _mm256_set1_epi8('\t');
+		const __m256i four = _mm256_set1_epi8(4);
+		const __m256i spaces = _mm256_set1_epi8(' ');
+		const __m256i commas = _mm256_set1_epi8(',');
+		const __m256i minuses = _mm256_set1_epi8('-');
+
+		size_t comma_count = 0;
+
+		for (; end - begin >= 32; begin += 32)
+		{
+			__m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+
+			// unsigned x - low <= high - low is a range check, min(a, b) == a is a <= b
+			__m256i digit_offset = _mm256_sub_epi8(block, zero_char);
+			__m256i is_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(digit_offset, nine), digit_offset);
+			__m256i space_offset = _mm256_sub_epi8(block, tab_char);
+			__m256i is_control_space = _mm256_cmpeq_epi8(_mm256_min_epu8(space_offset, four), space_offset);
+			__m256i is_comma = _mm256_cmpeq_epi8(block, commas);
+
+			__m256i is_valid = _mm256_or_si256(
+				_mm256_or_si256(is_digit, is_control_space),
+				_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, spaces), is_comma), _mm256_cmpeq_epi8(block, minuses)));
+
+			if (static_cast<unsigned>(_mm256_movemask_epi8(is_valid)) != 0xFFFFFFFFu)
+				return line_summary{ false, 0 };
+
+			comma_count += _mm_popcnt_u32(static_cast<unsigned>(_mm256_movemask_epi8(is_comma)));
+		}
+
+		line_summary tail = classify_scalar(begin, end);
+		tail.comma_count += comma_count;
+
+		return tail;
+	}
+
+	void cpuid(int leaf, int sub_leaf, int regs[4])
+	{
+#ifdef _MSC_VER
+		__cpuidex(regs, leaf, sub_leaf);
+#else
+		__cpuid_count(leaf, sub_leaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+	}
+
+	// ymm registers need to be saved by the os as well
+	bool os_supports_avx()
+	{
+#ifdef _MSC_VER
+		return (_xgetbv(0) & 0x6) == 0x6;
+#else
+		uint32_t eax, edx;
+		__asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+		return (eax & 0x6) == 0x6;
+#endif
+	}
+
+#endif
+
+	using classify_function = line_summary(*)(const char*, const char*);
+
+	classify_function select_classify_function()
+	{
+#ifdef NCR_X86
+		int regs[4];
+
+		cpuid(0, 0, regs);
+		int max_leaf = regs[0];
+
+		cpuid(1, 0, regs);
+		bool has_sse42 = (regs[2] & (1 << 20)) != 0;
+		bool has_popcnt = (regs[2] & (1 << 23)) != 0;
+		bool has_osxsave = (regs[2] & (1 << 27)) != 0;
+
+		bool has_avx2 = false;
+		if (max_leaf >= 7 && has_osxsave && os_supports_avx())
+		{
+			cpuid(7, 0, regs);
+			has_avx2 = (regs[1] & (1 << 5)) != 0;
+		}
+
+		if (has_avx2 && has_popcnt)
+			return classify_avx2;
+		if (has_sse42 && has_popcnt)
+			return classify_sse42;
+#endif
+		return classify_scalar;
+	}
+
+	const classify_function classify_chars = select_classify_function();
+
+	inline line_summary classify(const char* begin, const char* end)
+	{
+		return classify_chars(begin, end);
+	}
+
+	inline line_summary classify(const wchar_t* begin, const wchar_t* end)
+	{
+		return classify_scalar(begin, end);
+	}
+
+
+	/*
+		conversion of digit runs
+	*/
+
+	// converts up to 8 digits at once, 8 bytes must be readable from first
+	// bytes after the digits are shifted out, so they may contain anything
+	// source: https://lemire.me/blog/2022/01/21/swar-explained-parsing-eight-digits/
+	inline uint64_t digits_to_uint_swar(const char* first, size_t count)
+	{
+		uint64_t chunk;
+		memcpy(&chunk, first, sizeof(chunk));
+
+		// little endian... the first digit is the lowest byte
+		// shifting left pads the number with leading zeros
+		chunk -= 0x3030303030303030ull;
+		chunk <<= 8 * (8 - count);
+
+		chunk = (chunk * 10) + (chunk >> 8);
+		chunk = (((chunk & 0x000000FF000000FFull) * (100 + (1000000ull << 32))) +
+			(((chunk >> 16) & 0x000000FF000000FFull) * (1 + (10000ull << 32)))) >> 32;
+
+		return chunk;
+	}
+
+	// value = the digits in [first, last), returns false if it is more than limit
+	// overflow safe for any limit, up to UINT64_MAX
+	template<typename CharT>
+	inline bool digits_to_uint_scalar(const CharT* first, const CharT* last, uint64_t limit, uint64_t& value)
+	{
+		value = 0;
+
+		for (; first != last; ++first)
+		{
+			uint64_t digit = static_cast<uint64_t>(*first - CharT('0'));
+
+			// value * 10 + digit > limit
+			if (value > (limit - digit) / 10)
+				return false;
+
+			value = value * 10 + digit;
+		}
+
+		return true;
+	}
+
+	// digits of narrow characters are converted 8 at a time while enough input is left
+	// up to 16 digits always fit in uint64_t, so only the result needs to be checked
+	inline bool digits_to_uint(const char* first, const char* last, const char* end, uint64_t limit, uint64_t& value)
+	{
+		size_t digit_count = static_cast<size_t>(last - first);
+
+		if (digit_count <= 8 && end - first >= 8)
+			value = digits_to_uint_swar(first, digit_count);
+		else if (digit_count <= 16 && end - first >= 16)
+			value = digits_to_uint_swar(first, digit_count - 8) * 100'000'000 + digits_to_uint_swar(first + digit_count - 8, 8);
+		else
+			return digits_to_uint_scalar(first, last, limit, value);
+
+		return value <= limit;
+	}
+
+	inline bool digits_to_uint(const wchar_t* first, const wchar_t* last, const wchar_t*, uint64_t limit, uint64_t& value)
+	{
+		return digits_to_uint_scalar(first, last, limit, value);
+	}
+}
+
+
+/*
+	interface for class parse_ints_fast
+	T is any integral type accepted by is_fast_parsed, CharT is char or wchar_t
+	invalid input is reported through parse_error, nothing is thrown
+*/
+template<typename T, typename CharT>
+class parse_ints_fast
+{
+private:
+	vector<T> &result;
+	const CharT* line_begin;
+	parse_error error;
 
 private:
-	int char_to_int(char ch);
-	char_state_enum get_char_state(char ch);
-	void handle_char_ready_to_start_state(char ch);
-	void test_overflow();
-	void finalize_reading();
-	void handle_char_started_state(char ch);
-	void handle_char_finished_state(char ch);
-	vector<int> get_values_impl(string::const_iterator begin, string::const_iterator end);
+	const CharT* parse_number(const CharT* begin, const CharT* end);
+	const CharT* fail(parse_error_kind kind, const CharT* pos);
 
 public:
-	parse_ints_fast();
-	vector<int> get_values(const string& s);
+	explicit parse_ints_fast(vector<T> &_result);
+	parse_error get_values(const CharT* begin, const CharT* end);
 };
 
 /*
 	Implementation for class parse_ints_fast
 */
 
-parse_ints_fast::parse_ints_fast() :
-	num_state(num_state_enum::ready_to_start),
-	negative(false)
+template<typename T, typename CharT>
+parse_ints_fast<T, CharT>::parse_ints_fast(vector<T> &_result) :
+	result(_result),
+	line_begin(nullptr)
 {}
 
-vector<int> parse_ints_fast::get_values(const string& s)
+// records the first error, returns nullptr so that the caller stops
+template<typename T, typename CharT>
+const CharT* parse_ints_fast<T, CharT>::fail(parse_error_kind kind, const CharT* pos)
 {
-	result.reserve(count(s.begin(), s.end(), ',') + 1);
-	return get_values_impl(s.begin(), s.end());
+	error = parse_error(kind, static_cast<size_t>(pos - line_begin) * sizeof(CharT));
+	return nullptr;
 }
 
-vector<int> parse_ints_fast::get_values_impl(string::const_iterator begin, string::const_iterator end)
+template<typename T, typename CharT>
+parse_error parse_ints_fast<T, CharT>::get_values(const CharT* begin, const CharT* end)
 {
-	for (; begin != end; ++begin)
+	result.clear();
+	line_begin = begin;
+
+	line_summary summary = classify(begin, end);
+
+	if (!summary.valid)
 	{
-		switch (num_state)
-		{
-		case num_state_enum::ready_to_start:
-			handle_char_ready_to_start_state(*begin);
+		// invalid lines are rare, so the position is only looked for now
+		const CharT* pos = begin;
+		while (get_char_class(*pos) != invalid_class)
+			++pos;
+
+		fail(parse_error_kind::invalid_character, pos);
+		return error;
+	}
+
+	result.reserve(summary.comma_count + 1);
+
+	auto skip_spaces = [end](const CharT* pos) {
+		while (pos != end && get_char_class(*pos) == space_class)
+			++pos;
+		return pos;
+	};
+
+	begin = skip_spaces(begin);
+
+	while (begin != end)
+	{
+		begin = parse_number(begin, end);
+		if (!begin)
 			break;
-		case num_state_enum::started:
-			handle_char_started_state(*begin);
+
+		begin = skip_spaces(begin);
+
+		if (begin == end)
 			break;
-		case num_state_enum::finished:
-			handle_char_finished_state(*begin);
-		default:
+
+		if (*begin != CharT(','))
+		{
+			fail(parse_error_kind::missing_comma, begin);
 			break;
 		}
 
-		test_overflow();
+		begin = skip_spaces(begin + 1);
 	}
 
-	finalize_reading();
+	if (error)
+		result.clear();
 
-	return result;
+	return error;
 }
 
-void parse_ints_fast::handle_char_finished_state(char ch)
+// parses an optionally negative number starting at begin
+// returns the position after its last digit, or nullptr on error
+template<typename T, typename CharT>
+const CharT* parse_ints_fast<T, CharT>::parse_number(const CharT* begin, const CharT* end)
 {
-	switch (get_char_state(ch))
-	{
-	case char_state_enum::space:
-		// ok... nothing to do
-		break;
-	case char_state_enum::comma:
-		// ok
-		finalize_reading();
-		break;
-	case char_state_enum::minus:
-	case char_state_enum::digit:
-	case char_state_enum::invalid:
-	default:
-		throw runtime_error("Invalid Input");
-		break;
-	}
-}
+	const CharT* number_begin = begin;
 
-void parse_ints_fast::handle_char_started_state(char ch)
-{
-	switch (get_char_state(ch))
-	{
-	case char_state_enum::space:
-		// ok... end num reading
-		num_state = num_state_enum::finished;
-		break;
-	case char_state_enum::comma:
-		// ok... end num reading
-		num_state = num_state_enum::finished;
-		finalize_reading();
-		break;
-	case char_state_enum::minus:
-		// not ok
-		throw runtime_error("Invalid Input");
-		break;
-	case char_state_enum::digit:
-		// ok
-		num = num * 10 + char_to_int(ch);
-		break;
-	case char_state_enum::invalid:
-	default:
-		throw runtime_error("Invalid Input");
-		break;
-	}
-}
+	bool negative = (*begin == CharT('-'));
+	if (negative)
+		++begin;
 
-void parse_ints_fast::finalize_reading()
-{
-	if (num_state == num_state_enum::finished || num_state == num_state_enum::started)
-	{
-		test_overflow();
-		num = negative ? num * -1 : num;
-		negative = false;
-		result.push_back(static_cast<int>(num));
-		num_state = num_state_enum::ready_to_start;
-	}
-}
+	const CharT* digits_end = begin;
+	while (digits_end != end && get_char_class(*digits_end) == digit_class)
+		++digits_end;
 
-void parse_ints_fast::test_overflow()
-{
-	auto test_num = negative ? num * -1 : num;
+	if (digits_end == begin)
+		return fail(parse_error_kind::missing_number, number_begin);
 
-	if (test_num > INT_MAX || test_num < INT_MIN)
-		throw runtime_error("Int overflow");
-}
+	if (negative && !is_signed<T>::value)
+		return fail(parse_error_kind::out_of_range, number_begin);
 
-void parse_ints_fast::handle_char_ready_to_start_state(char ch)
-{
-	switch (get_char_state(ch))
-	{
-	case char_state_enum::space:
-		// ok... nothing to do
-		break;
-	case char_state_enum::comma:
-		// not ok
-		throw runtime_error("Invalid Input");
-		break;
-	case char_state_enum::minus:
-		// ok
-		negative = true;
-		num_state = num_state_enum::started;
-		break;
-	case char_state_enum::digit:
-		// ok
-		num = char_to_int(ch);
-		num_state = num_state_enum::started;
-		break;
-	case char_state_enum::invalid:
-	default:
-		throw runtime_error("Invalid Input");
-		break;
-	}
-}
+	// the magnitude of the min of a signed type is one more than its max
+	uint64_t max_value = static_cast<uint64_t>(numeric_limits<T>::max()) + (negative ? 1 : 0);
 
-parse_ints_fast::char_state_enum parse_ints_fast::get_char_state(char ch)
-{
-	if (isspace(ch))
-		return char_state_enum::space;
-	if (ch == ',')
-		return char_state_enum::comma;
-	if (ch == '-')
-		return char_state_enum::minus;
-	if (isdigit(ch))
-		return char_state_enum::digit;
-
-	return char_state_enum::invalid;
-}
+	uint64_t value;
+	if (!digits_to_uint(begin, digits_end, end, max_value, value))
+		return fail(parse_error_kind::out_of_range, number_begin);
 
-int parse_ints_fast::char_to_int(char ch)
-{
-	return static_cast<int>(ch - '0');
+	result.push_back(negative ?
+		static_cast<T>(0 - value) :
+		static_cast<T>(value));
+
+	return digits_end;
 }
 
 
 /*
-	An explicit specialization of get_numbers to use the fast parser
-	instead of the default one
+	The fast parser behind parse_numbers, for the types accepted by is_fast_parsed
 */
 
 namespace ncr_test
 {
-	template<>
-	vector<int> get_numbers<int, char>(const string& input)
+	template<typename T, typename CharT>
+	parse_error parse_integers(const CharT* first, const CharT* last, vector<T>& numbers)
 	{
-		parse_ints_fast parser;
-		return parser.get_values(input);
+		parse_ints_fast<T, CharT> parser(numbers);
+		return parser.get_values(first, last);
 	}
+
+#define NCR_INSTANTIATE_PARSE_INTEGERS(T) \
+	template parse_error parse_integers<T, char>(const char*, const char*, vector<T>&); \
+	template parse_error parse_integers<T, wchar_t>(const wchar_t*, const wchar_t*, vector<T>&);
+
+	NCR_INSTANTIATE_PARSE_INTEGERS(short)
+	NCR_INSTANTIATE_PARSE_INTEGERS(unsigned short)
+	NCR_INSTANTIATE_PARSE_INTEGERS(int)
+	NCR_INSTANTIATE_PARSE_INTEGERS(unsigned int)
+	NCR_INSTANTIATE_PARSE_INTEGERS(long)
+	NCR_INSTANTIATE_PARSE_INTEGERS(unsigned long)
+	NCR_INSTANTIATE_PARSE_INTEGERS(long long)
+	NCR_INSTANTIATE_PARSE_INTEGERS(unsigned long long)
+
+#undef NCR_INSTANTIATE_PARSE_INTEGERS
 }
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+/*
+	Statistics of a batch mode run
+	* every producer and consumer thread counts in its own stats, they are summed up at the end of the run
+	* only a few clock reads per range of input and per batch, so collecting them is cheap
+	* times of producers and consumers are summed over the threads, stage times are wall clock
+*/
+
+namespace ncr_test
+{
+	using stats_clock = std::chrono::steady_clock;
+
+	struct producer_stats
+	{
+		uint64_t bytes;
+		uint64_t lines;
+		uint64_t invalid_lines;
+		std::chrono::nanoseconds busy_time; // parsing, hashing and batching
+		std::chrono::nanoseconds stall_time; // blocked on a full consumer queue, or on the memory limit
+
+		producer_stats() :
+			bytes(0),
+			lines(0),
+			invalid_lines(0),
+			busy_time(0),
+			stall_time(0)
+		{}
+
+		void add(const producer_stats& other) {
+			bytes += other.bytes;
+			lines += other.lines;
+			invalid_lines += other.invalid_lines;
+			busy_time += other.busy_time;
+			stall_time += other.stall_time;
+		}
+	};
+
+	struct consumer_stats
+	{
+		uint64_t batches;
+		uint64_t sets;
+		std::chrono::nanoseconds busy_time; // adding sets to the table
+		std::chrono::nanoseconds idle_time; // spinning or sleeping on an empty queue
+		std::size_t max_queue_depth; // high water mark of batches waiting in a queue
+
+		consumer_stats() :
+			batches(0),
+			sets(0),
+			busy_time(0),
+			idle_time(0),
+			max_queue_depth(0)
+		{}
+
+		void add(const consumer_stats& other) {
+			batches += other.batches;
+			sets += other.sets;
+			busy_time += other.busy_time;
+			idle_time += other.idle_time;
+			max_queue_depth = std::max(max_queue_depth, other.max_queue_depth);
+		}
+	};
+
+	// the index of the resulting number_sets_data
+	struct table_stats
+	{
+		std::size_t set_count;
+		std::size_t slot_count;
+		double load_factor;
+		double average_probe_length; // groups visited to find a set
+		std::size_t max_probe_length;
+
+		table_stats() :
+			set_count(0),
+			slot_count(0),
+			load_factor(0),
+			average_probe_length(0),
+			max_probe_length(0)
+		{}
+	};
+
+	struct pipeline_stats
+	{
+		std::size_t producer_count;
+		std::size_t shard_count;
+
+		std::size_t memory_limit; // of the run, see batch_options
+		std::size_t max_bytes_in_flight; // high water mark of the batches sent and not consumed yet
+		std::size_t batch_bytes; // the batch size the run ended with, tuned from the consumer throughput
+
+		std::chrono::nanoseconds setup_time; // opening the input and starting the consumers
+		std::chrono::nanoseconds produce_time; // until all producers are done
+		std::chrono::nanoseconds drain_time; // consumers finishing their queues after that
+		std::chrono::nanoseconds merge_time; // merging the shards
+		std::chrono::nanoseconds total_time;
+
+		producer_stats producers;
+		consumer_stats consumers;
+		table_stats table;
+
+		pipeline_stats() :
+			producer_count(0),
+			shard_count(0),
+			memory_limit(0),
+			max_bytes_in_flight(0),
+			batch_bytes(0),
+			setup_time(0),
+			produce_time(0),
+			drain_time(0),
+			merge_time(0),
+			total_time(0)
+		{}
+
+		double bytes_per_second() const {
+			return per_second(producers.bytes);
+		}
+
+		double lines_per_second() const {
+			return per_second(producers.lines);
+		}
+
+	private:
+		double per_second(uint64_t count) const {
+			double seconds = std::chrono::duration<double>(total_time).count();
+			return seconds > 0 ? count / seconds : 0;
+		}
+	};
+}
@@ -2,7 +2,9 @@
 
 #include <cctype>
 #include <locale>
+#include <string>
 #include <vector>
+#include <cstddef>
 #include <iterator>
 #include <algorithm> 
 #include <functional> 
@@ -15,6 +17,8 @@
 	* hash_value - generates hash value from from a range of data
 	* convertTo - converts string to any other type, implemented using stringstream
 	* noncopyable - inherit this class to make your class noncopyable
+	* basic_string_ref - non owning view over a range of characters
+	* array_ref - non owning view over a contiguous range of elements
 	* trim - trims whitespace from a string
 	* operator<< overload for vector
 */
@@ -104,6 +108,121 @@ protected:
 
 
 
+/*
+	class basic_string_ref
+	a non owning [first, last) view over characters owned by someone else
+	(e.g. a memory mapped file), so that the text can be parsed in place
+*/
+
+// source: boost::string_ref (std::string_view is not available in C++14)
+
+template<typename CharT>
+class basic_string_ref
+{
+	const CharT* first;
+	const CharT* last;
+
+public:
+	basic_string_ref() :
+		first(nullptr),
+		last(nullptr)
+	{}
+
+	basic_string_ref(const CharT* _first, const CharT* _last) :
+		first(_first),
+		last(_last)
+	{}
+
+	const CharT* begin() const { return first; }
+	const CharT* end() const { return last; }
+	std::size_t size() const { return static_cast<std::size_t>(last - first); }
+	bool empty() const { return first == last; }
+
+	std::basic_string<CharT> to_string() const {
+		return std::basic_string<CharT>(first, last);
+	}
+};
+
+using string_ref = basic_string_ref<char>;
+
+
+
+
+/*
+	class array_ref
+	a non owning [first, last) view over contiguous elements owned by someone else
+*/
+
+// source: llvm::ArrayRef
+
+template<typename T>
+class array_ref
+{
+	const T* first;
+	const T* last;
+
+public:
+	array_ref() :
+		first(nullptr),
+		last(nullptr)
+	{}
+
+	array_ref(const T* _first, std::size_t count) :
+		first(_first),
+		last(_first + count)
+	{}
+
+	template<typename A>
+	array_ref(const std::vector<T, A>& v) :
+		first(v.data()),
+		last(v.data() + v.size())
+	{}
+
+	const T* begin() const { return first; }
+	const T* end() const { return last; }
+	const T* data() const { return first; }
+	std::size_t size() const { return static_cast<std::size_t>(last - first); }
+	bool empty() const { return first == last; }
+	const T& operator[](std::size_t pos) const { return first[pos]; }
+
+	std::vector<T> to_vector() const {
+		return std::vector<T>(first, last);
+	}
+};
+
+template<typename T>
+bool operator==(const array_ref<T>& lhs, const array_ref<T>& rhs)
+{
+	return lhs.size() == rhs.size() && std::equal(lhs.begin(), lhs.end(), rhs.begin());
+}
+
+template<typename T, typename A>
+bool operator==(const array_ref<T>& lhs, const std::vector<T, A>& rhs)
+{
+	return lhs == array_ref<T>(rhs);
+}
+
+template<typename T, typename A>
+bool operator==(const std::vector<T, A>& lhs, const array_ref<T>& rhs)
+{
+	return array_ref<T>(lhs) == rhs;
+}
+
+template<typename T>
+bool operator!=(const array_ref<T>& lhs, const array_ref<T>& rhs)
+{
+	return !(lhs == rhs);
+}
+
+template <class T>
+std::size_t hash_value(array_ref<T> const& v)
+{
+	return hash_range(v.begin(), v.end());
+}
+
+
+
+
 /* 
 	trim
 */
@@ -0,0 +1,276 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NCR_SET_INDEX_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/*
+	class set_index
+	open addressing hash index over the records of number_sets_data
+	* swiss table style... slots are probed in groups of 16, one control byte per slot
+	* a control byte holds 7 bits of the hash (or marks the slot empty), so a group is filtered with one sse2 compare
+	* slots keep the full 64 bit hash next to the record index, contents are only compared when full hashes match
+	* sets are never removed, so there are no tombstones
+*/
+
+namespace ncr_test
+{
+	struct probe_statistics
+	{
+		double average; // groups visited to find a set, 1 if it is in its home group
+		std::size_t max;
+	};
+
+	class set_index
+	{
+		static constexpr std::size_t group_size = 16;
+		enum : uint8_t { empty_control = 0x80 };
+
+		struct slot
+		{
+			uint64_t hash;
+			uint32_t record;
+		};
+
+		std::vector<uint8_t> controls;
+		std::vector<slot> slots;
+		std::size_t group_mask; // group count - 1, group count is a power of two
+		std::size_t count;
+		std::size_t growth_limit; // keeps at most 7/8 of the slots full
+
+	private:
+		// murmur3 finalizer, so that weak input hashes still spread over the groups
+		static uint64_t mix(uint64_t hash) {
+			hash ^= hash >> 33;
+			hash *= 0xff51afd7ed558ccdull;
+			hash ^= hash >> 33;
+			hash *= 0xc4ceb9fe1a85ec53ull;
+			hash ^= hash >> 33;
+			return hash;
+		}
+
+		static uint8_t control_of(uint64_t mixed) {
+			return static_cast<uint8_t>(mixed >> 57);
+		}
+
+		static unsigned first_bit(uint32_t mask) {
+#ifdef _MSC_VER
+			unsigned long index;
+			_BitScanForward(&index, mask);
+			return static_cast<unsigned>(index);
+#else
+			return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+		}
+
+		// bit i is set if the control byte of slot i of the group equals control
+		uint32_t match(std::size_t group, uint8_t control) const {
+#ifdef NCR_SET_INDEX_SSE2
+			__m128i controls_of_group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&controls[group * group_size]));
+			return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(controls_of_group, _mm_set1_epi8(static_cast<char>(control)))));
+#else
+			uint32_t mask = 0;
+			for (std::size_t i = 0; i < group_size; ++i)
+				mask |= static_cast<uint32_t>(controls[group * group_size + i] == control) << i;
+			return mask;
+#endif
+		}
+
+		// empty control bytes are the only ones with the high bit set
+		uint32_t match_empty(std::size_t group) const {
+#ifdef NCR_SET_INDEX_SSE2
+			__m128i controls_of_group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&controls[group * group_size]));
+			return static_cast<uint32_t>(_mm_movemask_epi8(controls_of_group));
+#else
+			return match(group, empty_control);
+#endif
+		}
+
+		// inserts a hash known not to be present yet
+		void insert_unique(uint64_t hash, uint32_t record) {
+			uint64_t mixed = mix(hash);
+			std::size_t group = static_cast<std::size_t>(mixed) & group_mask;
+
+			// triangular probing visits every group, as the group count is a power of two
+			for (std::size_t step = 1; ; ++step)
+			{
+				uint32_t empties = match_empty(group);
+				if (empties)
+				{
+					place(group * group_size + first_bit(empties), control_of(mixed), hash, record);
+					return;
+				}
+				group = (group + step) & group_mask;
+			}
+		}
+
+		void place(std::size_t pos, uint8_t control, uint64_t hash, uint32_t record) {
+			controls[pos] = control;
+			slots[pos].hash = hash;
+			slots[pos].record = record;
+			++count;
+		}
+
+		// hashes are stored, so nothing needs to be rehashed from the records
+		void resize(std::size_t group_count) {
+			std::vector<uint8_t> old_controls;
+			std::vector<slot> old_slots;
+
+			old_controls.swap(controls);
+			old_slots.swap(slots);
+
+			controls.assign(group_count * group_size, empty_control);
+			slots.resize(group_count * group_size);
+			group_mask = group_count - 1;
+			growth_limit = slots.size() - slots.size() / 8;
+			count = 0;
+
+			for (std::size_t i = 0; i < old_slots.size(); ++i)
+				if (old_controls[i] != empty_control)
+					insert_unique(old_slots[i].hash, old_slots[i].record);
+		}
+
+	public:
+		static constexpr uint32_t not_found = static_cast<uint32_t>(-1);
+
+		set_index() :
+			group_mask(0),
+			count(0),
+			growth_limit(0)
+		{}
+
+		// looks up the set with the given hash, is_equal(record) compares the contents of a candidate record
+		// if the set isn't found new_record is inserted for it
+		// returns the record of the set, and whether it was inserted
+		template<typename IsEqual>
+		std::pair<uint32_t, bool> find_or_insert(uint64_t hash, uint32_t new_record, IsEqual is_equal) {
+			if (slots.empty())
+				resize(1);
+
+			uint64_t mixed = mix(hash);
+			uint8_t control = control_of(mixed);
+			std::size_t group = static_cast<std::size_t>(mixed) & group_mask;
+
+			for (std::size_t step = 1; ; ++step)
+			{
+				for (uint32_t matches = match(group, control); matches; matches &= matches - 1)
+				{
+					const slot& candidate = slots[group * group_size + first_bit(matches)];
+
+					if (candidate.hash == hash && is_equal(candidate.record))
+						return std::make_pair(candidate.record, false);
+				}
+
+				uint32_t empties = match_empty(group);
+				if (empties)
+				{
+					// not present... an empty slot ends the probe sequence
+					if (count + 1 > growth_limit)
+					{
+						resize((group_mask + 1) * 2);
+						insert_unique(hash, new_record);
+					}
+					else
+						place(group * group_size + first_bit(empties), control, hash, new_record);
+
+					return std::make_pair(new_record, true);
+				}
+
+				group = (group + step) & group_mask;
+			}
+		}
+
+		// looks up the set with the given hash without inserting it, is_equal as for find_or_insert
+		// returns not_found if it isn't there... only reads the index, so it may be called from several threads at once
+		template<typename IsEqual>
+		uint32_t find(uint64_t hash, IsEqual is_equal) const {
+			if (slots.empty())
+				return not_found;
+
+			uint64_t mixed = mix(hash);
+			uint8_t control = control_of(mixed);
+			std::size_t group = static_cast<std::size_t>(mixed) & group_mask;
+
+			for (std::size_t step = 1; ; ++step)
+			{
+				for (uint32_t matches = match(group, control); matches; matches &= matches - 1)
+				{
+					const slot& candidate = slots[group * group_size + first_bit(matches)];
+					if (candidate.hash == hash && is_equal(candidate.record))
+						return candidate.record;
+				}
+
+				if (match_empty(group))
+					return not_found;
+
+				group = (group + step) & group_mask;
+			}
+		}
+
+		// inserts a set known not to be present, e.g. when rebuilding the index from stored records
+		void insert(uint64_t hash, uint32_t record) {
+			if (count + 1 > growth_limit)
+				resize(slots.empty() ? 1 : (group_mask + 1) * 2);
+
+			insert_unique(hash, record);
+		}
+
+		// makes room for set_count sets, so that no resize happens until then
+		void reserve(std::size_t set_count) {
+			std::size_t group_count = 1;
+			while ((group_count * group_size) - (group_count * group_size) / 8 < set_count)
+				group_count *= 2;
+
+			if (group_count > group_mask + 1 || slots.empty())
+				resize(group_count);
+		}
+
+		// walks every set, to be used for diagnostics only
+		probe_statistics get_probe_statistics() const {
+			probe_statistics stats{ 0, 0 };
+			std::size_t total = 0;
+
+			for (std::size_t pos = 0; pos < slots.size(); ++pos)
+			{
+				if (controls[pos] == empty_control)
+					continue;
+
+				std::size_t group = static_cast<std::size_t>(mix(slots[pos].hash)) & group_mask;
+				std::size_t length = 1;
+
+				for (std::size_t step = 1; group != pos / group_size; ++step, ++length)
+					group = (group + step) & group_mask;
+
+				total += length;
+				stats.max = std::max(stats.max, length);
+			}
+
+			if (count)
+				stats.average = static_cast<double>(total) / count;
+
+			return stats;
+		}
+
+		std::size_t size() const { return count; }
+		std::size_t capacity() const { return slots.size(); }
+
+		void clear() {
+			controls.clear();
+			slots.clear();
+			group_mask = 0;
+			count = 0;
+			growth_limit = 0;
+		}
+	};
+}
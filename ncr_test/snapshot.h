@@ -0,0 +1,269 @@
+#pragma once
+
+#include "mapped_file.h"
+#include "number_sets_impl.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <climits>
+#include <fstream>
+#include <stdexcept>
+#include <type_traits>
+
+/*
+	Binary snapshots of number_sets_data
+	* the file holds everything of a number_sets_data: sets, occurences, hashes, invalid inputs and counters
+	* the numbers of all the sets are stored back to back, as in the arena
+	* loading maps the file and copies the numbers into the arena, the index is rebuilt from the stored hashes
+	  so set contents are never hashed or compared... O(file size)
+	* snapshots are in native byte order, and only load into the same T, CharT and HashPolicy
+
+	Layout:
+	snapshot_header
+	snapshot_record[set_count]
+	uint64_t[invalid_count] - length of every invalid input
+	T[number_count]
+	CharT[invalid_char_count]
+	uint32_t[set_count] - the records in the order of occurence_ranking
+*/
+
+namespace ncr_test
+{
+	struct snapshot_header
+	{
+		enum : uint32_t { current_version = 2, byte_order_mark = 0x01020304 };
+
+		char magic[8];
+		uint32_t version;
+		uint32_t byte_order;
+		uint32_t value_size;
+		uint32_t value_is_signed;
+		uint32_t char_size;
+		uint32_t hash_policy;
+		uint64_t set_count;
+		uint64_t number_count;
+		uint64_t invalid_count;
+		uint64_t invalid_char_count;
+		uint64_t most_frequent;
+		int64_t duplicate_count;
+		int64_t non_duplicate_count;
+	};
+
+	struct snapshot_record
+	{
+		uint64_t length;
+		uint64_t hash;
+		int64_t occurences;
+	};
+
+	static_assert(sizeof(snapshot_header) % 8 == 0 && sizeof(snapshot_record) % 8 == 0, "snapshot layout must keep the numbers aligned");
+
+	const char snapshot_magic[8] = { 'N', 'C', 'R', 'S', 'N', 'A', 'P', '\0' };
+
+	// header expected for a number_sets_data of the given types, counts are left 0
+	template<typename T, typename CharT, typename HashPolicy>
+	snapshot_header make_snapshot_header()
+	{
+		snapshot_header header = {};
+		memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+		header.version = snapshot_header::current_version;
+		header.byte_order = snapshot_header::byte_order_mark;
+		header.value_size = sizeof(T);
+		header.value_is_signed = std::is_signed<T>::value;
+		header.char_size = sizeof(CharT);
+		header.hash_policy = HashPolicy::id;
+		return header;
+	}
+
+	/*
+		class snapshot_reader
+		bounds checked sequential reads from a mapped snapshot
+	*/
+	class snapshot_reader
+	{
+		const char* pos;
+		const char* end;
+
+	public:
+		snapshot_reader(const char* _begin, const char* _end) :
+			pos(_begin),
+			end(_end)
+		{}
+
+		// returns the position of count elements of type U, and skips them
+		template<typename U>
+		const char* skip(uint64_t count) {
+			if (count > static_cast<uint64_t>(end - pos) / sizeof(U))
+				throw std::runtime_error("Invalid snapshot: unexpected end of file");
+
+			const char* res = pos;
+			pos += count * sizeof(U);
+			return res;
+		}
+
+		// elements are copied out, so no alignment is assumed
+		template<typename U>
+		U read_at(const char* at, uint64_t index) const {
+			U value;
+			memcpy(&value, at + index * sizeof(U), sizeof(U));
+			return value;
+		}
+
+		bool at_end() const { return pos == end; }
+	};
+
+
+	template<typename T, typename CharT, typename HashPolicy>
+	void save_snapshot(const number_sets_data<T, CharT, HashPolicy> &data, const std::string& filename)
+	{
+		std::ofstream ofile(filename, std::ios::binary | std::ios::trunc);
+		if (!ofile)
+			throw std::runtime_error("Unable to open file: " + filename);
+
+		snapshot_header header = make_snapshot_header<T, CharT, HashPolicy>();
+		header.set_count = data.records.size();
+		header.invalid_count = data.invalid_inputs.size();
+		header.most_frequent = data.most_frequent == data.npos ? UINT64_MAX : data.most_frequent;
+		header.duplicate_count = data.duplicate_count;
+		header.non_duplicate_count = data.non_duplicate_count;
+
+		std::vector<snapshot_record> records;
+		records.reserve(data.records.size());
+		for (const auto& record : data.records)
+		{
+			records.push_back(snapshot_record{ record.length, record.hash, record.occurences });
+			header.number_count += record.length;
+		}
+
+		std::vector<uint64_t> invalid_lengths;
+		invalid_lengths.reserve(data.invalid_inputs.size());
+		for (const auto& input : data.invalid_inputs)
+		{
+			invalid_lengths.push_back(input.size());
+			header.invalid_char_count += input.size();
+		}
+
+		ofile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		ofile.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(snapshot_record));
+		ofile.write(reinterpret_cast<const char*>(invalid_lengths.data()), invalid_lengths.size() * sizeof(uint64_t));
+
+		for (std::size_t i = 0; i < data.records.size(); ++i)
+		{
+			array_ref<T> numbers = data.get_numbers(i);
+			ofile.write(reinterpret_cast<const char*>(numbers.data()), numbers.size() * sizeof(T));
+		}
+
+		for (const auto& input : data.invalid_inputs)
+			ofile.write(reinterpret_cast<const char*>(input.data()), input.size() * sizeof(CharT));
+
+		array_ref<uint32_t> ranked = data.ranking.top(data.records.size());
+		ofile.write(reinterpret_cast<const char*>(ranked.data()), ranked.size() * sizeof(uint32_t));
+
+		if (!ofile.flush())
+			throw std::runtime_error("Unable to write file: " + filename);
+	}
+
+	// replaces the content of data with the snapshot
+	// the snapshot is validated first, data is left untouched if it is invalid
+	template<typename T, typename CharT, typename HashPolicy>
+	void load_snapshot(const std::string& filename, number_sets_data<T, CharT, HashPolicy> &data)
+	{
+		mapped_file file(filename);
+		snapshot_reader reader(file.data(), file.data() + file.size());
+
+		snapshot_header header = reader.read_at<snapshot_header>(reader.skip<snapshot_header>(1), 0);
+		snapshot_header expected = make_snapshot_header<T, CharT, HashPolicy>();
+
+		if (memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.version != expected.version)
+			throw std::runtime_error("Invalid snapshot: " + filename);
+
+		if (header.byte_order != expected.byte_order || header.value_size != expected.value_size || header.value_is_signed != expected.value_is_signed ||
+			header.char_size != expected.char_size || header.hash_policy != expected.hash_policy)
+			throw std::runtime_error("Snapshot doesn't match the types of number sets: " + filename);
+
+		const char* records = reader.skip<snapshot_record>(header.set_count);
+		const char* invalid_lengths = reader.skip<uint64_t>(header.invalid_count);
+		const char* numbers = reader.skip<T>(header.number_count);
+		const char* invalid_chars = reader.skip<CharT>(header.invalid_char_count);
+		const char* ranked_records = reader.skip<uint32_t>(header.set_count);
+
+		if (!reader.at_end() || header.set_count > UINT32_MAX ||
+			(header.most_frequent != UINT64_MAX && header.most_frequent >= header.set_count))
+			throw std::runtime_error("Invalid snapshot: " + filename);
+
+		// lengths must add up, so that no set points outside of the numbers
+		uint64_t number_count = 0;
+		for (uint64_t i = 0; i < header.set_count; ++i)
+		{
+			snapshot_record record = reader.read_at<snapshot_record>(records, i);
+			if (record.length > header.number_count - number_count || record.occurences < 1 || record.occurences > INT_MAX)
+				throw std::runtime_error("Invalid snapshot: " + filename);
+			number_count += record.length;
+		}
+
+		// the ranking must hold every record once, by descending occurences
+		std::vector<uint32_t> ranked(static_cast<std::size_t>(header.set_count));
+		std::vector<bool> ranked_seen(ranked.size());
+		for (std::size_t i = 0; i < ranked.size(); ++i)
+		{
+			ranked[i] = reader.read_at<uint32_t>(ranked_records, i);
+			if (ranked[i] >= ranked.size() || ranked_seen[ranked[i]] ||
+				(i != 0 && reader.read_at<snapshot_record>(records, ranked[i - 1]).occurences < reader.read_at<snapshot_record>(records, ranked[i]).occurences))
+				throw std::runtime_error("Invalid snapshot: " + filename);
+			ranked_seen[ranked[i]] = true;
+		}
+
+		uint64_t invalid_char_count = 0;
+		for (uint64_t i = 0; i < header.invalid_count; ++i)
+		{
+			uint64_t length = reader.read_at<uint64_t>(invalid_lengths, i);
+			if (length > header.invalid_char_count - invalid_char_count)
+				throw std::runtime_error("Invalid snapshot: " + filename);
+			invalid_char_count += length;
+		}
+
+		if (number_count != header.number_count || invalid_char_count != header.invalid_char_count)
+			throw std::runtime_error("Invalid snapshot: " + filename);
+
+		// valid... now replace the content
+		data.clear();
+		data.reserve(static_cast<std::size_t>(header.set_count));
+
+		// the file is mapped at a page boundary, and everything before the numbers is made of 8 byte fields
+		// so the numbers are aligned and can be appended straight from the mapping
+		const T* set_numbers = reinterpret_cast<const T*>(numbers);
+
+		for (uint64_t i = 0; i < header.set_count; ++i)
+		{
+			snapshot_record record = reader.read_at<snapshot_record>(records, i);
+			std::size_t length = static_cast<std::size_t>(record.length);
+
+			data.index.insert(record.hash, static_cast<uint32_t>(data.records.size()));
+			data.records.push_back(set_record{ data.arena.append(array_ref<T>(set_numbers, length)), length, record.hash, static_cast<int>(record.occurences) });
+
+			set_numbers += length;
+		}
+
+		data.invalid_inputs.reserve(static_cast<std::size_t>(header.invalid_count));
+
+		for (uint64_t i = 0; i < header.invalid_count; ++i)
+		{
+			std::size_t length = static_cast<std::size_t>(reader.read_at<uint64_t>(invalid_lengths, i));
+			std::basic_string<CharT> input(length, CharT());
+			if (length)
+				memcpy(&input[0], invalid_chars, length * sizeof(CharT));
+			invalid_chars += length * sizeof(CharT);
+
+			data.invalid_inputs.push_back(std::move(input));
+		}
+
+		const auto& loaded_records = data.records;
+		data.ranking.assign(std::move(ranked), [&loaded_records](uint32_t r) { return loaded_records[r].occurences; });
+
+		data.most_frequent = header.most_frequent == UINT64_MAX ? data.npos : static_cast<std::size_t>(header.most_frequent);
+		data.duplicate_count = static_cast<int>(header.duplicate_count);
+		data.non_duplicate_count = static_cast<int>(header.non_duplicate_count);
+	}
+}
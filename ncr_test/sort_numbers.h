@@ -0,0 +1,198 @@
+#pragma once
+
+#include "routines.h"
+
+#include <limits>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <type_traits>
+
+/*
+	sort_numbers
+	puts the numbers of a set in canonical order, ascending... the same order as std::sort
+	* up to 16 numbers: a sorting network, padded with the max of T, with branchless compare exchanges
+	* from radix_sort_min_count numbers: lsd radix sort, one byte per pass
+	  all the byte counts are taken in one pass, passes where every number has the same byte are skipped
+	* std::sort in between, where neither pays off
+
+	is_permutation_of_sorted
+	compares a set in any order with a sorted one without sorting it, for the order independent hash policies
+*/
+
+// source: Batcher's odd-even merge sort networks, Knuth "The Art of Computer Programming" vol. 3 5.3.4
+
+namespace ncr_test
+{
+	namespace sort_networks
+	{
+		const uint8_t network_8[][2] = {
+			{ 0, 1 }, { 2, 3 }, { 4, 5 }, { 6, 7 }, { 0, 2 }, { 1, 3 }, { 4, 6 }, { 5, 7 },
+			{ 1, 2 }, { 5, 6 }, { 0, 4 }, { 1, 5 }, { 2, 6 }, { 3, 7 }, { 2, 4 }, { 3, 5 },
+			{ 1, 2 }, { 3, 4 }, { 5, 6 }
+		};
+
+		const uint8_t network_16[][2] = {
+			{ 0, 1 }, { 2, 3 }, { 4, 5 }, { 6, 7 }, { 8, 9 }, { 10, 11 }, { 12, 13 }, { 14, 15 },
+			{ 0, 2 }, { 1, 3 }, { 4, 6 }, { 5, 7 }, { 8, 10 }, { 9, 11 }, { 12, 14 }, { 13, 15 },
+			{ 1, 2 }, { 5, 6 }, { 9, 10 }, { 13, 14 }, { 0, 4 }, { 1, 5 }, { 2, 6 }, { 3, 7 },
+			{ 8, 12 }, { 9, 13 }, { 10, 14 }, { 11, 15 }, { 2, 4 }, { 3, 5 }, { 10, 12 }, { 11, 13 },
+			{ 1, 2 }, { 3, 4 }, { 5, 6 }, { 9, 10 }, { 11, 12 }, { 13, 14 }, { 0, 8 }, { 1, 9 },
+			{ 2, 10 }, { 3, 11 }, { 4, 12 }, { 5, 13 }, { 6, 14 }, { 7, 15 }, { 4, 8 }, { 5, 9 },
+			{ 6, 10 }, { 7, 11 }, { 2, 4 }, { 3, 5 }, { 6, 8 }, { 7, 9 }, { 10, 12 }, { 11, 13 },
+			{ 1, 2 }, { 3, 4 }, { 5, 6 }, { 7, 8 }, { 9, 10 }, { 11, 12 }, { 13, 14 }
+		};
+
+		// written as selects, so that the compiler emits conditional moves instead of branches
+		template<typename T>
+		inline void compare_exchange(T& a, T& b)
+		{
+			T low = b < a ? b : a;
+			T high = b < a ? a : b;
+			a = low;
+			b = high;
+		}
+
+		// the numbers are sorted in a local copy of Size elements
+		// the padding holds the max of T, which sorts after (or equal to) every number
+		template<typename T, std::size_t Size, std::size_t ComparatorCount>
+		inline void network_sort(T* first, std::size_t count, const uint8_t (&network)[ComparatorCount][2])
+		{
+			T values[Size];
+
+			for (std::size_t i = 0; i < Size; ++i)
+				values[i] = i < count ? first[i] : std::numeric_limits<T>::max();
+
+			for (std::size_t i = 0; i < ComparatorCount; ++i)
+				compare_exchange(values[network[i][0]], values[network[i][1]]);
+
+			std::copy(values, values + count, first);
+		}
+	}
+
+	// numbers from which radix sort is faster than std::sort, it takes a pass per byte of T
+	template<typename T>
+	struct radix_sort_min_count : std::integral_constant<std::size_t, 12 * sizeof(T)>
+	{};
+
+	// lsd radix sort of integral numbers, scratch is resized to count
+	template<typename T>
+	void radix_sort(T* first, std::size_t count, std::vector<T>& scratch)
+	{
+		using unsigned_type = typename std::make_unsigned<T>::type;
+
+		// flipping the sign bit orders signed numbers as unsigned ones
+		const unsigned_type flip = std::is_signed<T>::value ? static_cast<unsigned_type>(unsigned_type(1) << (8 * sizeof(T) - 1)) : 0;
+
+		uint32_t counts[sizeof(T)][256];
+		memset(counts, 0, sizeof(counts));
+
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			unsigned_type key = static_cast<unsigned_type>(first[i]) ^ flip;
+			for (std::size_t byte = 0; byte < sizeof(T); ++byte)
+				++counts[byte][(key >> (8 * byte)) & 0xFF];
+		}
+
+		scratch.resize(count);
+		T* source = first;
+		T* target = scratch.data();
+
+		for (std::size_t byte = 0; byte < sizeof(T); ++byte)
+		{
+			uint32_t* byte_counts = counts[byte];
+
+			// every number has the same value for this byte
+			unsigned_type first_key = static_cast<unsigned_type>(first[0]) ^ flip;
+			if (byte_counts[(first_key >> (8 * byte)) & 0xFF] == count)
+				continue;
+
+			uint32_t offset = 0;
+			for (std::size_t i = 0; i < 256; ++i)
+			{
+				uint32_t value_count = byte_counts[i];
+				byte_counts[i] = offset;
+				offset += value_count;
+			}
+
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				unsigned_type key = static_cast<unsigned_type>(source[i]) ^ flip;
+				target[byte_counts[(key >> (8 * byte)) & 0xFF]++] = source[i];
+			}
+
+			std::swap(source, target);
+		}
+
+		if (source != first)
+			std::copy(source, source + count, first);
+	}
+
+	template<typename T>
+	void sort_numbers(T* first, std::size_t count)
+	{
+		static_assert(std::is_integral<T>::value, "Integral type required.");
+
+		if (count <= 8)
+			sort_networks::network_sort<T, 8>(first, count, sort_networks::network_8);
+		else if (count <= 16)
+			sort_networks::network_sort<T, 16>(first, count, sort_networks::network_16);
+		else if (count < radix_sort_min_count<T>::value)
+			std::sort(first, first + count);
+		else
+		{
+			// every thread keeps its buffer, sets are sorted one at a time
+			thread_local std::vector<T> scratch;
+			radix_sort(first, count, scratch);
+		}
+	}
+
+	template<typename T>
+	void sort_numbers(std::vector<T>& numbers)
+	{
+		sort_numbers(numbers.data(), numbers.size());
+	}
+
+	// true if numbers, in any order, are the same multiset as sorted
+	// a number takes the next free slot of its run of equal numbers in sorted, found by binary search
+	// a run running out of slots, or a number not in sorted, means the sets differ
+	template<typename T>
+	bool is_permutation_of_sorted(const array_ref<T>& sorted, const array_ref<T>& numbers)
+	{
+		if (sorted.size() != numbers.size())
+			return false;
+
+		// repeated lines usually come in the same order as the stored one
+		if (std::equal(numbers.begin(), numbers.end(), sorted.begin()))
+			return true;
+
+		// slots taken from every run, counted at the first slot of the run
+		thread_local std::vector<uint32_t> taken;
+		taken.assign(sorted.size(), 0);
+
+		for (T number : numbers)
+		{
+			std::size_t run = std::lower_bound(sorted.begin(), sorted.end(), number) - sorted.begin();
+			if (run == sorted.size())
+				return false;
+
+			std::size_t slot = run + taken[run];
+			if (slot == sorted.size() || sorted.begin()[slot] != number)
+				return false;
+
+			++taken[run];
+		}
+
+		return true;
+	}
+
+	// sorts the numbers, and hashes them while they are still in the cache
+	template<typename HashPolicy, typename T>
+	uint64_t sort_and_hash(std::vector<T>& numbers)
+	{
+		sort_numbers(numbers);
+		return HashPolicy::hash(array_ref<T>(numbers));
+	}
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include "routines.h"
+#include "occurence_ranking.h"
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <algorithm>
+#include <unordered_map>
+
+/*
+	class space_saving
+	keeps the most frequent number sets of a stream in a fixed number of entries
+	* a monitored set counts its occurences, a new set replaces the set with the fewest
+	  and starts from its occurences + 1... the inherited part is kept as the error of the entry
+	* so occurences of an entry overcount by at most its error, and never undercount
+	* every set occuring more than total / capacity times is monitored
+	* entries are ranked by occurence_ranking, so the replaced entry is found in O(1)
+	* sets are identified by their 64 bit hash, numbers are only kept for reporting
+*/
+
+// source: Metwally et al. "Efficient Computation of Frequent and Top-k Elements in Data Streams"
+
+namespace ncr_test
+{
+	template<typename T>
+	class space_saving
+	{
+	public:
+		struct entry
+		{
+			uint64_t hash;
+			int occurences;
+			int error; // occurences inherited from replaced sets
+			std::vector<T> numbers;
+		};
+
+	private:
+		std::vector<entry> entries;
+		std::unordered_map<uint64_t, uint32_t> positions; // entry of every monitored hash
+		occurence_ranking ranking;
+		std::size_t capacity;
+		int merged_bound; // occurences a set dropped by a merge may have
+
+	private:
+		void add_occurence(uint32_t pos, int prev_occurences) {
+			const auto& all_entries = entries;
+			ranking.add_occurences(pos, prev_occurences, entries[pos].occurences, [&all_entries](uint32_t e) { return all_entries[e].occurences; });
+		}
+
+	public:
+		explicit space_saving(std::size_t _capacity) :
+			capacity(std::max<std::size_t>(_capacity, 1)),
+			merged_bound(0)
+		{
+			entries.reserve(capacity);
+			positions.reserve(capacity);
+			ranking.reserve(capacity);
+		}
+
+		// one occurence of the set
+		void add(uint64_t hash, const array_ref<T>& numbers) {
+			auto found = positions.find(hash);
+			if (found != positions.end())
+			{
+				entry& monitored = entries[found->second];
+				add_occurence(found->second, monitored.occurences++);
+				return;
+			}
+
+			if (entries.size() < capacity)
+			{
+				uint32_t pos = static_cast<uint32_t>(entries.size());
+				entries.push_back(entry{ hash, 1, 0, numbers.to_vector() });
+				positions.emplace(hash, pos);
+				add_occurence(pos, 0);
+				return;
+			}
+
+			// replaces the set with the fewest occurences, its numbers buffer is reused
+			uint32_t pos = ranking.bottom();
+			entry& replaced = entries[pos];
+
+			positions.erase(replaced.hash);
+			positions.emplace(hash, pos);
+
+			replaced.hash = hash;
+			replaced.error = replaced.occurences;
+			replaced.numbers.assign(numbers.begin(), numbers.end());
+			add_occurence(pos, replaced.occurences++);
+		}
+
+		// moves the entries of source in, source is left empty
+		// entries of a set monitored by both are summed up, the rest compete for the entries
+		void merge(space_saving&& source) {
+			int bound = std::max(get_unmonitored_bound(), source.get_unmonitored_bound());
+
+			for (auto& other : source.entries)
+			{
+				auto found = positions.find(other.hash);
+				if (found != positions.end())
+				{
+					entries[found->second].occurences += other.occurences;
+					entries[found->second].error += other.error;
+				}
+				else
+					entries.push_back(std::move(other));
+			}
+
+			std::stable_sort(entries.begin(), entries.end(), [](const entry& a, const entry& b) {
+				return a.occurences > b.occurences;
+			});
+
+			if (entries.size() > capacity)
+			{
+				bound = std::max(bound, entries[capacity].occurences);
+				entries.resize(capacity);
+			}
+
+			merged_bound = bound;
+
+			// entries are in ranked order now
+			std::vector<uint32_t> ranked(entries.size());
+			positions.clear();
+			for (uint32_t pos = 0; pos < entries.size(); ++pos)
+			{
+				ranked[pos] = pos;
+				positions.emplace(entries[pos].hash, pos);
+			}
+
+			const auto& all_entries = entries;
+			ranking.assign(std::move(ranked), [&all_entries](uint32_t e) { return all_entries[e].occurences; });
+
+			source.clear();
+		}
+
+		// entries with the most occurences first
+		array_ref<uint32_t> top(std::size_t k) const {
+			return ranking.top(k);
+		}
+
+		const entry& get(uint32_t pos) const {
+			return entries[pos];
+		}
+
+		// the most occurences a set without an entry may have
+		int get_unmonitored_bound() const {
+			return entries.size() < capacity ? merged_bound : std::max(merged_bound, entries[ranking.bottom()].occurences);
+		}
+
+		std::size_t size() const { return entries.size(); }
+		std::size_t get_capacity() const { return capacity; }
+
+		void clear() {
+			entries.clear();
+			positions.clear();
+			ranking.clear();
+			merged_bound = 0;
+		}
+	};
+}
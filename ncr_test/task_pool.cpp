@@ -0,0 +1,157 @@
+#include "task_pool.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace ncr_test
+{
+	/*
+		Implementation for class task_pool
+	*/
+
+	task_pool::task_pool(size_t thread_count) :
+		job(nullptr),
+		generation(0),
+		running(0),
+		stopping(false)
+	{
+		thread_count = max<size_t>(1, thread_count);
+
+		for (size_t i = 0; i < thread_count; ++i)
+		{
+			ranges.push_back(make_unique<task_range>());
+			ranges.back()->begin = ranges.back()->end = 0;
+		}
+
+		for (size_t i = 0; i < thread_count; ++i)
+			threads.emplace_back(&task_pool::worker_loop, this, i);
+	}
+
+	task_pool::~task_pool()
+	{
+		{
+			lock_guard<mutex> guard(state_mutex);
+			stopping = true;
+		}
+
+		job_posted.notify_all();
+
+		for (auto& worker_thread : threads)
+			worker_thread.join();
+	}
+
+	void task_pool::run(size_t task_count, const job_type& new_job)
+	{
+		// the tasks are split evenly between the workers, neighbouring tasks stay on the same worker
+		size_t worker_count = ranges.size();
+
+		for (size_t i = 0; i < worker_count; ++i)
+		{
+			lock_guard<mutex> guard(ranges[i]->range_mutex);
+			ranges[i]->begin = task_count * i / worker_count;
+			ranges[i]->end = task_count * (i + 1) / worker_count;
+		}
+
+		unique_lock<mutex> lock(state_mutex);
+
+		job = &new_job;
+		running = worker_count;
+		error = nullptr;
+		++generation;
+
+		job_posted.notify_all();
+		job_done.wait(lock, [this] { return running == 0; });
+
+		job = nullptr;
+
+		if (error)
+			rethrow_exception(error);
+	}
+
+	void task_pool::worker_loop(size_t worker)
+	{
+		size_t last_generation = 0;
+
+		for (;;)
+		{
+			const job_type* current_job;
+
+			{
+				unique_lock<mutex> lock(state_mutex);
+				job_posted.wait(lock, [&] { return stopping || generation != last_generation; });
+
+				if (stopping)
+					return;
+
+				last_generation = generation;
+				current_job = job;
+			}
+
+			try
+			{
+				task_source source(*this, worker);
+				(*current_job)(source);
+			}
+			catch (...)
+			{
+				lock_guard<mutex> guard(state_mutex);
+				if (!error)
+					error = current_exception();
+			}
+
+			// the tasks left by a failed worker may be stolen by others, the job fails anyway
+			{
+				lock_guard<mutex> guard(state_mutex);
+				if (--running == 0)
+					job_done.notify_one();
+			}
+		}
+	}
+
+	bool task_pool::pop(size_t worker, size_t &task)
+	{
+		task_range& own = *ranges[worker];
+		lock_guard<mutex> guard(own.range_mutex);
+
+		if (own.begin == own.end)
+			return false;
+
+		task = own.begin++;
+		return true;
+	}
+
+	bool task_pool::steal(size_t thief, size_t &task)
+	{
+		size_t worker_count = ranges.size();
+
+		for (size_t i = 1; i < worker_count; ++i)
+		{
+			task_range& victim = *ranges[(thief + i) % worker_count];
+			size_t begin, end;
+
+			{
+				lock_guard<mutex> guard(victim.range_mutex);
+
+				if (victim.begin == victim.end)
+					continue;
+
+				// the back half, at least one task
+				end = victim.end;
+				begin = victim.begin + (victim.end - victim.begin) / 2;
+				victim.end = begin;
+			}
+
+			// the own range is empty at this point, only its owner refills it
+			task_range& own = *ranges[thief];
+			lock_guard<mutex> guard(own.range_mutex);
+			own.begin = begin + 1;
+			own.end = end;
+
+			task = begin;
+			return true;
+		}
+
+		return false;
+	}
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "routines.h"
+
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <condition_variable>
+
+/*
+	class task_pool
+	a fixed set of worker threads, kept alive between jobs
+	* a job is a number of tasks, identified by their index, and a function run once by every worker
+	* the function pulls tasks from a task_source until there are none left
+	* every worker owns a contiguous range of the task indexes, and takes tasks from its front
+	* a worker that runs out steals the back half of the range of another worker
+*/
+
+namespace ncr_test
+{
+	class task_pool : private noncopyable
+	{
+		// the tasks not taken yet by a worker, [begin, end)
+		struct task_range
+		{
+			std::mutex range_mutex;
+			std::size_t begin;
+			std::size_t end;
+			char padding[64]; // the ranges of different workers are locked by different threads
+		};
+
+	public:
+		class task_source
+		{
+			task_pool &pool;
+			std::size_t worker;
+
+		public:
+			task_source(task_pool &_pool, std::size_t _worker) :
+				pool(_pool),
+				worker(_worker)
+			{}
+
+			// returns false once all tasks of the job have been taken
+			bool next(std::size_t &task) {
+				return pool.pop(worker, task) || pool.steal(worker, task);
+			}
+
+			std::size_t worker_index() const { return worker; }
+		};
+
+		using job_type = std::function<void(task_source&)>;
+
+	private:
+		std::vector<std::unique_ptr<task_range>> ranges;
+		std::vector<std::thread> threads;
+
+		std::mutex state_mutex; // guards everything below
+		std::condition_variable job_posted;
+		std::condition_variable job_done;
+		const job_type* job;
+		std::size_t generation; // incremented for every job
+		std::size_t running; // workers still busy with the current job
+		bool stopping;
+		std::exception_ptr error; // first exception thrown by the current job
+
+	private:
+		void worker_loop(std::size_t worker);
+		bool pop(std::size_t worker, std::size_t &task);
+		bool steal(std::size_t thief, std::size_t &task);
+
+	public:
+		explicit task_pool(std::size_t thread_count);
+		~task_pool();
+
+		std::size_t size() const { return threads.size(); }
+
+		// runs job on every worker, blocks until all of them are done
+		// rethrows the first exception thrown by job
+		// not to be called concurrently
+		void run(std::size_t task_count, const job_type& job);
+	};
+}